@@ -206,6 +206,45 @@ function toggleEditBtn() {
 addBtn.addEventListener('click', addItem);
 saveBtn.addEventListener('click', saveData);
 
+// The server holds get_title.cgi until the title differs from seq
+let titleSeq = -1;
+const nowPlaying = document.querySelector('.now-playing');
+
+function pollTitle() {
+  const xhttp = new XMLHttpRequest();
+  const url = "get_title.cgi?seq=" + titleSeq;
+  const sent = Date.now();
+  xhttp.onload = function() {
+    let seq = titleSeq;
+    let title = '';
+    this.responseText.split('\r\n').forEach((item) => {
+      const pos = item.indexOf('=');
+      const name = item.substring(0, pos);
+      const value = item.substring(pos + 1);
+      if (name === 'seq') {
+        seq = Number(value);
+      }
+      if (name === 'title') {
+        title = value;
+      }
+    });
+    // a server that answers at once is asked again later
+    const delay = (seq === titleSeq && Date.now() - sent < 1000) ? 5000 : 0;
+    if (seq !== titleSeq) {
+      titleSeq = seq;
+      nowPlaying.textContent = title;
+    }
+    setTimeout(pollTitle, delay);
+  }
+  xhttp.onerror = function() {
+    setTimeout(pollTitle, 5000);
+  }
+  xhttp.open("GET", url, true);
+  xhttp.send();
+}
+
+pollTitle();
+
 function rowDragStart(){  
   row = event.target; 
 }
@@ -13,8 +13,10 @@
 */
 
 #include <stdint.h>
+#include <stddef.h>
 #include "hw_types.h"
 #include "hw_memmap.h"
+#include "hw_ints.h"
 #include "hw_gpio.h"
 #include "pin.h"
 #include "spi.h"
@@ -22,6 +24,8 @@
 #include "rom_map.h"
 #include "gpio.h"
 #include "prcm.h"
+#include "interrupt.h"
+#include "osi.h"
 
 //--------------------------------------------
 #define	PIN_SCK           PIN_05                // SCK  --> SCLK
@@ -47,11 +51,62 @@
 #define	GPIO_PIN_DREQ     1 << GPIO_BIT_DREQ    // 1 << 4 = 0x10
 
 //--------------------------------------------
-#define SPI_BIT_RATE  1000000
+#define SPI_BIT_RATE_SLOW  1000000     // reset, CLKI = XTALI: XTALI/7
+#define SPI_BIT_RATE_SCI   4000000     // registers after CLOCKF: CLKI/7
+#define SPI_BIT_RATE_SDI   8000000     // data after CLOCKF: CLKI/4
+#define SPI_BLOCK_SIZE  32
+#define DREQ_RESET_MS   100            // DREQ rises a few ms after reset
+
+//--------------------------------------------
+static unsigned long spi_bit_rate;
+static uint8_t spi_fast;
+static OsiSyncObj_t dreq_event;
+
+//--------------------------------------------
+static void spi_config(unsigned long bit_rate)
+{
+	spi_bit_rate = bit_rate;
+	MAP_SPIConfigSetExpClk(GSPI_BASE,
+	                       MAP_PRCMPeripheralClockGet(PRCM_GSPI),
+	                       bit_rate,
+	                       SPI_MODE_MASTER,
+	                       SPI_SUB_MODE_0,
+	                       SPI_3PIN_MODE | SPI_TURBO_OFF | SPI_CS_ACTIVEHIGH | SPI_WL_8);
+}
+
+//--------------------------------------------
+// the clock can be changed only while SPI is disabled
+static void set_bit_rate(unsigned long bit_rate)
+{
+	if (bit_rate != spi_bit_rate)
+	{
+		MAP_SPIDisable(GSPI_BASE);
+		spi_config(bit_rate);
+		MAP_SPIEnable(GSPI_BASE);
+	}
+}
+
+//--------------------------------------------
+// DREQ going high wakes the task waiting for it
+static void dreq_isr(void)
+{
+	unsigned long status;
+
+	status = MAP_GPIOIntStatus(GPIO_PORT_DREQ, true);
+	MAP_GPIOIntClear(GPIO_PORT_DREQ, status);
+	osi_SyncObjSignalFromISR(&dreq_event);
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_set_fast(uint8_t state)
+{
+	spi_fast = state;
+}
 
 //--------------------------------------------
 void hal_spi_vs1003_reset(void)
 {
+	hal_spi_vs1003_set_fast(0);
 	MAP_GPIOPinWrite(GPIO_PORT_RESET, GPIO_PIN_RESET, 1 << GPIO_BIT_RESET);
 	MAP_UtilsDelay(10000);
 	MAP_GPIOPinWrite(GPIO_PORT_RESET, GPIO_PIN_RESET, 0 << GPIO_BIT_RESET);
@@ -60,7 +115,7 @@ void hal_spi_vs1003_reset(void)
 	MAP_GPIOPinWrite(GPIO_PORT_XDCS, GPIO_PIN_XDCS, 1 << GPIO_BIT_XDCS);
 	MAP_GPIOPinWrite(GPIO_PORT_RESET, GPIO_PIN_RESET, 1 << GPIO_BIT_RESET);
 	MAP_UtilsDelay(20000);
-	while (!MAP_GPIOPinRead(GPIO_PORT_DREQ, GPIO_PIN_DREQ) >> GPIO_BIT_DREQ);
+	hal_spi_vs1003_wait_dreq(DREQ_RESET_MS);
 }
 
 //--------------------------------------------
@@ -82,6 +137,13 @@ void hal_spi_vs1003_init(void)
 	MAP_PinTypeGPIO(PIN_DREQ, PIN_MODE_0, false);
 	MAP_GPIODirModeSet(GPIO_PORT_DREQ, GPIO_PIN_DREQ, GPIO_DIR_MODE_IN);
 
+	// DREQ interrupt on the rising edge
+	osi_SyncObjCreate(&dreq_event);
+	MAP_GPIOIntTypeSet(GPIO_PORT_DREQ, GPIO_PIN_DREQ, GPIO_RISING_EDGE);
+	osi_InterruptRegister(INT_GPIOA3, dreq_isr, INT_PRIORITY_LVL_1);
+	MAP_GPIOIntClear(GPIO_PORT_DREQ, GPIO_PIN_DREQ);
+	MAP_GPIOIntEnable(GPIO_PORT_DREQ, GPIO_PIN_DREQ);
+
 	// configure SPI pins
 	MAP_PinTypeSPI(PIN_SCK, PIN_MODE_7);
 	MAP_PinTypeSPI(PIN_MISO, PIN_MODE_7);
@@ -91,12 +153,7 @@ void hal_spi_vs1003_init(void)
 	MAP_SPIReset(GSPI_BASE);
 
 	// configure SPI
-	MAP_SPIConfigSetExpClk(GSPI_BASE,
-	                       MAP_PRCMPeripheralClockGet(PRCM_GSPI),
-	                       SPI_BIT_RATE,
-	                       SPI_MODE_MASTER,
-	                       SPI_SUB_MODE_0,
-	                       SPI_3PIN_MODE | SPI_TURBO_OFF | SPI_CS_ACTIVEHIGH | SPI_WL_8);
+	spi_config(SPI_BIT_RATE_SLOW);
 
 	// enable SPI
 	MAP_SPIEnable(GSPI_BASE);
@@ -107,11 +164,28 @@ uint8_t hal_spi_vs1003_txrx(uint8_t data)
 {
 	unsigned long tmp;
 
+	set_bit_rate(spi_fast ? SPI_BIT_RATE_SCI : SPI_BIT_RATE_SLOW);
 	MAP_SPIDataPut(GSPI_BASE, (unsigned long)data);
 	MAP_SPIDataGet(GSPI_BASE, &tmp);
 	return (uint8_t)tmp;
 }
 
+//--------------------------------------------
+void hal_spi_vs1003_tx_block(uint8_t *buf, size_t size)
+{
+	static uint8_t rx_buf[SPI_BLOCK_SIZE];
+	size_t len;
+
+	set_bit_rate(spi_fast ? SPI_BIT_RATE_SDI : SPI_BIT_RATE_SLOW);
+	while (size)
+	{
+		len = size > SPI_BLOCK_SIZE ? SPI_BLOCK_SIZE : size;
+		MAP_SPITransfer(GSPI_BASE, buf, rx_buf, len, 0);
+		buf += len;
+		size -= len;
+	}
+}
+
 //--------------------------------------------
 void hal_spi_vs1003_xcs(uint8_t state)
 {
@@ -129,3 +203,17 @@ uint8_t hal_spi_vs1003_dreq(void)
 {
 	return MAP_GPIOPinRead(GPIO_PORT_DREQ, GPIO_PIN_DREQ) >> GPIO_BIT_DREQ;
 }
+
+//--------------------------------------------
+// returns 0 once DREQ is high, -1 on timeout
+int hal_spi_vs1003_wait_dreq(uint32_t timeout_ms)
+{
+	while (!hal_spi_vs1003_dreq())
+	{
+		if (osi_SyncObjWait(&dreq_event, (OsiTime_t)timeout_ms) != OSI_OK)
+		{
+			return hal_spi_vs1003_dreq() ? 0 : -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef HTTP_CHUNKED_H
+#define HTTP_CHUNKED_H
+
+//--------------------------------------------
+typedef enum
+{
+	http_chunked_size = 0,
+	http_chunked_ext,
+	http_chunked_data,
+	http_chunked_data_end,
+	http_chunked_trailer,
+	http_chunked_done
+} http_chunked_state_t;
+
+//--------------------------------------------
+// Undoes Transfer-Encoding: chunked as the body arrives,
+// chunk size lines and data may be split over any number of reads.
+typedef struct
+{
+	http_chunked_state_t state;
+	size_t left;
+	size_t digits;
+	size_t line_len;
+} http_chunked_t;
+
+//--------------------------------------------
+void http_chunked_init(http_chunked_t *chunked);
+int http_chunked_decode(http_chunked_t *chunked, uint8_t *buf, size_t size);
+bool http_chunked_is_done(http_chunked_t *chunked);
+
+#endif /* HTTP_CHUNKED_H */
@@ -0,0 +1,152 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t */
+#include <stdbool.h>    /* bool */
+#include <string.h>     /* memcpy, strcmp */
+#include <intrinsics.h> /* __DMB */
+#include "now_playing.h"
+
+//--------------------------------------------
+// Written by the network task only. Readers copy slots[seq & 1];
+// a new title goes to the other slot and is published by seq++.
+// The next title after that rewrites the slot being copied,
+// so a copy is kept only if seq has not moved at all.
+static now_playing_t slots[2];
+static volatile uint32_t seq;
+static now_playing_t next;
+
+//--------------------------------------------
+static inline uint32_t load_seq(void)
+{
+	uint32_t value = seq;
+	__DMB();
+	return value;
+}
+
+//--------------------------------------------
+static inline void store_seq(uint32_t value)
+{
+	__DMB();
+	seq = value;
+}
+
+//--------------------------------------------
+static inline void full_fence(void)
+{
+	__DMB();
+}
+
+//--------------------------------------------
+// value of name='...'; in a metadata block, control characters dropped;
+// a quote inside the value is kept unless it is followed by ';'
+static bool get_field(const uint8_t *meta, size_t size, const char *name, char *value, size_t value_size)
+{
+	size_t name_len = strlen(name);
+	size_t cnt;
+	size_t len = 0;
+
+	value[0] = '\0';
+	for (cnt = 0; cnt + name_len + 2 <= size; cnt++)
+	{
+		if (memcmp(meta + cnt, name, name_len) || meta[cnt + name_len] != '=' || meta[cnt + name_len + 1] != '\'')
+		{
+			continue;
+		}
+		for (cnt += name_len + 2; cnt < size && meta[cnt]; cnt++)
+		{
+			if (meta[cnt] == '\'' && (cnt + 1 == size || meta[cnt + 1] == ';' || !meta[cnt + 1]))
+			{
+				break;
+			}
+			if (meta[cnt] >= ' ' && len < value_size - 1)
+			{
+				value[len++] = meta[cnt];
+			}
+		}
+		value[len] = '\0';
+		return true;
+	}
+	return false;
+}
+
+//--------------------------------------------
+static void publish(void)
+{
+	next.seq = seq + 1;
+	// readers see seq move on before their slot is rewritten
+	full_fence();
+	memcpy(&slots[next.seq & 1], &next, sizeof(now_playing_t));
+	store_seq(next.seq);
+}
+
+//--------------------------------------------
+// network task: a new stream starts without a title,
+// returns 1 if readers have to be told
+int now_playing_clear(void)
+{
+	now_playing_t *now = &slots[seq & 1];
+
+	if (!now->title[0] && !now->url[0])
+	{
+		return 0;
+	}
+	next.title[0] = '\0';
+	next.url[0] = '\0';
+	publish();
+	return 1;
+}
+
+//--------------------------------------------
+// network task: a complete ICY metadata block,
+// returns 1 if the title has changed
+int now_playing_update(const uint8_t *meta, size_t size)
+{
+	now_playing_t *now = &slots[seq & 1];
+
+	// blocks without StreamTitle keep the current one
+	if (!get_field(meta, size, "StreamTitle", next.title, sizeof(next.title)))
+	{
+		return 0;
+	}
+	get_field(meta, size, "StreamUrl", next.url, sizeof(next.url));
+	if (!strcmp(next.title, now->title) && !strcmp(next.url, now->url))
+	{
+		return 0;
+	}
+	publish();
+	return 1;
+}
+
+//--------------------------------------------
+// any task, without locks
+void now_playing_get(now_playing_t *now_playing)
+{
+	uint32_t start;
+
+	do
+	{
+		start = load_seq();
+		memcpy(now_playing, &slots[start & 1], sizeof(now_playing_t));
+		// the copy is complete before seq is checked again
+		full_fence();
+	} while (load_seq() != start);
+}
+
+//--------------------------------------------
+uint32_t now_playing_get_seq(void)
+{
+	return load_seq();
+}
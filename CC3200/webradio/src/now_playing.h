@@ -0,0 +1,37 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef NOW_PLAYING_H
+#define NOW_PLAYING_H
+
+//--------------------------------------------
+#define NOW_PLAYING_TITLE_SIZE     128
+#define NOW_PLAYING_URL_SIZE       128
+
+//--------------------------------------------
+// seq grows with every change of the title or the stream
+typedef struct
+{
+	uint32_t seq;
+	char title[NOW_PLAYING_TITLE_SIZE];
+	char url[NOW_PLAYING_URL_SIZE];
+} now_playing_t;
+
+//--------------------------------------------
+int now_playing_clear(void);
+int now_playing_update(const uint8_t *meta, size_t size);
+void now_playing_get(now_playing_t *now_playing);
+uint32_t now_playing_get_seq(void);
+
+#endif /* NOW_PLAYING_H */
@@ -0,0 +1,154 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t */
+#include <stdbool.h>    /* bool */
+#include "FreeRTOS.h"
+#include "task.h"
+#include "vs1053.h"
+#include "ring_buf_audio.h"
+#include "player.h"
+
+//--------------------------------------------
+#define PLAY_BUFFER_SIZE           256
+#define PLAY_WAIT_MS               100
+#define DECODER_POLL_MS            500
+#define DECODER_STALL_MS           3000
+#define DECODER_STALL_BYTES        4096   // more than the codec FIFO holds
+
+//--------------------------------------------
+// Used by the player task only, decoder_status is read by the status page
+typedef struct
+{
+	bool start;
+	uint32_t poll_ms;
+	uint32_t change_ms;
+	size_t stall_bytes;
+	uint16_t decode_time;
+	vs1053_status_t decoder_status;
+} player_t;
+static player_t player;
+
+//--------------------------------------------
+static uint32_t get_time_ms(void)
+{
+	return xTaskGetTickCount() * portTICK_RATE_MS;
+}
+
+//--------------------------------------------
+// The decoder status is read between SDI bursts every DECODER_POLL_MS.
+// DECODE_TIME counts whole seconds, so the decoder is taken as stuck
+// once it stands still for DECODER_STALL_MS while more bytes than
+// the codec FIFO holds have been written.
+static void poll_decoder(size_t size)
+{
+	uint32_t now = get_time_ms();
+
+	player.stall_bytes += size;
+	if (now - player.poll_ms < DECODER_POLL_MS)
+	{
+		return;
+	}
+	player.poll_ms = now;
+	vs1053_get_status(&player.decoder_status);
+	ring_buf_audio_set_decoded_bitrate(player.decoder_status.bitrate_kbps);
+	if (player.decoder_status.decode_time != player.decode_time)
+	{
+		player.decode_time = player.decoder_status.decode_time;
+		player.change_ms = now;
+		player.stall_bytes = 0;
+		return;
+	}
+	if (now - player.change_ms < DECODER_STALL_MS || player.stall_bytes < DECODER_STALL_BYTES)
+	{
+		return;
+	}
+	player.change_ms = now;
+	player.stall_bytes = 0;
+	if (vs1053_cancel() < 0)
+	{
+		vs1053_reset();
+	}
+}
+
+//--------------------------------------------
+// one pass of the player task loop
+void player_run(void)
+{
+	uint8_t *buf;
+	int size;
+	int level;
+
+	// No span of the buffer is in use here
+	ring_buf_audio_apply_resize();
+	ring_buf_audio_sample_fill();
+	if (!player.start)
+	{
+		// Sleep until the buffer is filled up to the start level
+		level = ring_buf_audio_get_start_level();
+		if (ring_buf_audio_wait_read(level, PLAY_WAIT_MS) < level)
+		{
+			return;
+		}
+		if (ring_buf_audio_start_playing())
+		{
+			// The codec still decodes the end of the old stream
+			if (vs1053_cancel() < 0)
+			{
+				vs1053_reset();
+			}
+		}
+		// the decoder has been idle while the buffer filled up
+		player.change_ms = get_time_ms();
+		player.stall_bytes = 0;
+		player.start = true;
+	}
+	if (ring_buf_audio_get_count() <= ring_buf_audio_get_stop_level())
+	{
+		// Underrun, refill up to the high watermark
+		ring_buf_audio_stop_playing();
+		player.start = false;
+		return;
+	}
+	// Write straight from the filled span of the audio ring buffer
+	size = ring_buf_audio_peek_read(&buf);
+	if (ring_buf_audio_is_new_stream())
+	{
+		// Cleared for a new stream while playing: the old one is
+		// cancelled at the start level before any of the new is written
+		player.start = false;
+		return;
+	}
+	if (size > PLAY_BUFFER_SIZE)
+	{
+		size = PLAY_BUFFER_SIZE;
+	}
+	if (size > 0)
+	{
+		if (vs1053_write_data(buf, size) < 0)
+		{
+			// DREQ stuck low, the codec hangs
+			vs1053_reset();
+		}
+		ring_buf_audio_consume(size);
+		poll_decoder(size);
+	}
+}
+
+//--------------------------------------------
+void player_get_decoder_status(vs1053_status_t *status)
+{
+	*status = player.decoder_status;
+}
@@ -14,14 +14,17 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include "rom_map.h"
 #include "utils.h"
-#include "osi.h"
 #include "hal-spi-vs1003.h"
 #include "vs1053-regs.h"
 #include "vs1053.h"
 #include "vs1053-plugin.h"
 
+//--------------------------------------------
+static vs1053_stats_t stats;
+
 //--------------------------------------------
 void vs1053_init_iface(void)
 {
@@ -29,12 +32,30 @@ void vs1053_init_iface(void)
 	vs1053_reset();
 }
 
+//--------------------------------------------
+#define VS1053_CLOCKF_SETTING  (VS1053_CLOCKF_MULT_XTALIx30 | VS1053_CLOCKF_ADDx10)
+
+//--------------------------------------------
+// CLKI goes from XTALI to XTALI * 3.0, so the HAL may switch to
+// the faster SCI and SDI clocks; the register is read back at the new rate
+// and the bus stays slow if the readback does not match
+static void vs1053_set_clock(void)
+{
+	vs1053_write_register(VS1053_CLOCKF, VS1053_CLOCKF_SETTING);
+	MAP_UtilsDelay(2 * 8000);
+	hal_spi_vs1003_set_fast(1);
+	if (vs1053_read_register(VS1053_CLOCKF) != VS1053_CLOCKF_SETTING)
+	{
+		hal_spi_vs1003_set_fast(0);
+	}
+}
+
 //--------------------------------------------
 void vs1053_reset(void)
 {
+	stats.resets++;
 	hal_spi_vs1003_reset();
-	vs1053_write_register(VS1053_CLOCKF, VS1053_CLOCKF_MULT_XTALIx30 | VS1053_CLOCKF_ADDx10);
-	MAP_UtilsDelay(2 * 8000);
+	vs1053_set_clock();
 	vs1053_load_user_code();
 }
 
@@ -43,6 +64,7 @@ uint16_t vs1053_read_register(uint8_t reg)
 {
 	uint16_t data;
 
+	stats.sci_reads++;
 	hal_spi_vs1003_xcs(0);
 	hal_spi_vs1003_txrx(VS1053_CMD_READ);
 	hal_spi_vs1003_txrx(reg);
@@ -55,6 +77,7 @@ uint16_t vs1053_read_register(uint8_t reg)
 //--------------------------------------------
 void vs1053_write_register(uint8_t reg, uint16_t data)
 {
+	stats.sci_writes++;
 	hal_spi_vs1003_xcs(0);
 	hal_spi_vs1003_txrx(VS1053_CMD_WRITE);
 	hal_spi_vs1003_txrx(reg);
@@ -64,21 +87,68 @@ void vs1053_write_register(uint8_t reg, uint16_t data)
 }
 
 //--------------------------------------------
-void vs1053_write_data(uint8_t *buf, size_t size)
+int vs1053_write_data(uint8_t *buf, size_t size)
 {
-	size_t cnt;
+	size_t len;
 
 	hal_spi_vs1003_xdcs(0);
-	for (cnt = 0; cnt < size; cnt++)
+	while (size)
 	{
-		while (!hal_spi_vs1003_dreq())
+		// DREQ high means room for a whole burst in the SDI FIFO
+		len = size > VS1053_SDI_BURST_SIZE ? VS1053_SDI_BURST_SIZE : size;
+		if (hal_spi_vs1003_wait_dreq(VS1053_DREQ_TIMEOUT_MS) < 0)
 		{
-			osi_Sleep(1);
+			hal_spi_vs1003_xdcs(1);
+			stats.dreq_timeouts++;
+			return -1;
 		}
-//		while (!hal_spi_vs1003_dreq());
-		hal_spi_vs1003_txrx(*buf++);
+		hal_spi_vs1003_tx_block(buf, len);
+		stats.sdi_bursts++;
+		stats.sdi_bytes += len;
+		buf += len;
+		size -= len;
 	}
 	hal_spi_vs1003_xdcs(1);
+	return 0;
+}
+
+//--------------------------------------------
+// Ends decoding of the current stream without a hardware reset,
+// the plugin and the register settings are kept.
+// returns 0 on success, -1 if the codec has to be reset
+int vs1053_cancel(void)
+{
+	uint8_t buf[VS1053_SDI_BURST_SIZE];
+	uint16_t mode;
+	size_t cnt;
+
+	stats.cancels++;
+	vs1053_write_register(VS1053_WRAMADDR, VS1053_PARA_END_FILL_BYTE);
+	// the address write is executed before WRAM can be read
+	hal_spi_vs1003_wait_dreq(VS1053_DREQ_TIMEOUT_MS);
+	memset(buf, (uint8_t)vs1053_read_register(VS1053_WRAM), sizeof(buf));
+	// Padding lets the decoder finish the last frame
+	for (cnt = 0; cnt < VS1053_END_FILL_SIZE; cnt += sizeof(buf))
+	{
+		if (vs1053_write_data(buf, sizeof(buf)) < 0)
+		{
+			return -1;
+		}
+	}
+	mode = vs1053_read_register(VS1053_MODE);
+	vs1053_write_register(VS1053_MODE, mode | VS1053_MODE_CANCEL);
+	for (cnt = 0; cnt < VS1053_CANCEL_SIZE; cnt += sizeof(buf))
+	{
+		if (vs1053_write_data(buf, sizeof(buf)) < 0)
+		{
+			return -1;
+		}
+		if (!(vs1053_read_register(VS1053_MODE) & VS1053_MODE_CANCEL))
+		{
+			return 0;
+		}
+	}
+	return -1;
 }
 
 //--------------------------------------------
@@ -90,7 +160,7 @@ void vs1053_sinewave_test(uint32_t time_ms)
 
 	hal_spi_vs1003_reset();
 	vs1053_write_register(VS1053_MODE, VS1053_MODE_SDINEW | VS1053_MODE_TESTS);
-	while (!hal_spi_vs1003_dreq());
+	hal_spi_vs1003_wait_dreq(VS1053_DREQ_TIMEOUT_MS);
 	for (cnt = 0; cnt < sizeof(sine_on); cnt++)
 	{
 		hal_spi_vs1003_xdcs(0);
@@ -106,7 +176,36 @@ void vs1053_sinewave_test(uint32_t time_ms)
 	}
 	hal_spi_vs1003_reset();
 	vs1053_write_register(VS1053_MODE, VS1053_MODE_SDINEW);
-	vs1053_write_register(VS1053_CLOCKF, VS1053_CLOCKF_MULT_XTALIx30 | VS1053_CLOCKF_ADDx10);
+	vs1053_set_clock();
+}
+
+//--------------------------------------------
+// SCI multiple write: all words of a plugin run go to the same register
+// under one XCS assertion, the opcode and address are sent once.
+// DREQ is low while a word is executed (about 100 CLKI for WRAM,
+// 2.7 us at 3.0x), so the words go at the SCI clock (4 us each)
+// and DREQ is checked before every next word.
+static void vs1053_write_run(uint8_t reg, const unsigned short *data, size_t n, int rle)
+{
+	stats.sci_writes++;
+	hal_spi_vs1003_wait_dreq(VS1053_DREQ_TIMEOUT_MS);
+	hal_spi_vs1003_xcs(0);
+	hal_spi_vs1003_txrx(VS1053_CMD_WRITE);
+	hal_spi_vs1003_txrx(reg);
+	while (n--)
+	{
+		hal_spi_vs1003_txrx(*data >> 8);
+		hal_spi_vs1003_txrx((uint8_t)*data);
+		if (!rle)
+		{
+			data++;
+		}
+		if (n)
+		{
+			hal_spi_vs1003_wait_dreq(VS1053_DREQ_TIMEOUT_MS);
+		}
+	}
+	hal_spi_vs1003_xcs(1);
 }
 
 //--------------------------------------------
@@ -116,27 +215,103 @@ void vs1053_load_user_code(void)
 
 	while (cnt < sizeof(vs1053_plugin) / sizeof(uint16_t))
 	{
-		unsigned short addr, n, val;
+		unsigned short addr, n;
 		addr = vs1053_plugin[cnt++];
 		n = vs1053_plugin[cnt++];
 		if (n & 0x8000U)
 		{
 			// RLE run, replicate n samples
 			n &= 0x7FFF;
-			val = vs1053_plugin[cnt++];
-			while (n--)
-			{
-				vs1053_write_register(addr, val);
-			}
+			vs1053_write_run((uint8_t)addr, &vs1053_plugin[cnt], n, 1);
+			cnt++;
 		}
 		else
 		{
 			// Copy run, copy n samples
-			while (n--)
-			{
-				val = vs1053_plugin[cnt++];
-				vs1053_write_register(addr, val);
-			}
+			vs1053_write_run((uint8_t)addr, &vs1053_plugin[cnt], n, 0);
+			cnt += n;
+		}
+	}
+}
+
+//--------------------------------------------
+void vs1053_get_stats(vs1053_stats_t *vs1053_stats)
+{
+	*vs1053_stats = stats;
+}
+
+//--------------------------------------------
+// MPEG audio bitrates in kbps [MPEG-1, MPEG-2/2.5][layer I, II, III][index - 1]
+static const uint16_t mpeg_bitrates[2][3][14] =
+{
+	{
+		{ 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+		{ 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+		{ 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+	},
+	{
+		{ 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		{ 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+		{ 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+	}
+};
+
+//--------------------------------------------
+// HDAT1 format identifiers other than the MPEG sync word
+static const struct
+{
+	uint16_t hdat1;
+	const char *codec;
+} formats[] =
+{
+	{ 0x7665, "wav" },
+	{ 0x4154, "aac" },   // ADTS
+	{ 0x4144, "aac" },   // ADIF
+	{ 0x4D34, "aac" },   // MP4
+	{ 0x574D, "wma" },
+	{ 0x4F67, "ogg" },
+	{ 0x664C, "flac" },
+	{ 0x4D54, "midi" }
+};
+
+//--------------------------------------------
+// Four SCI reads, cheap enough to run between two SDI bursts
+void vs1053_get_status(vs1053_status_t *status)
+{
+	uint16_t hdat0 = vs1053_read_register(VS1053_HDAT0);
+	uint16_t hdat1 = vs1053_read_register(VS1053_HDAT1);
+	uint16_t audata = vs1053_read_register(VS1053_AUDATA);
+	uint8_t version;
+	uint8_t layer;
+	uint8_t index;
+	size_t cnt;
+
+	status->decode_time = vs1053_read_register(VS1053_DECODE_TIME);
+	status->sample_rate = audata & 0xFFFE;
+	status->channels = (audata & 0x0001) + 1;
+	status->bitrate_kbps = 0;
+	if ((hdat1 & 0xFFE0) == 0xFFE0)
+	{
+		// HDAT1 and HDAT0 hold the MPEG frame header
+		version = (hdat1 >> 3) & 0x03;   // 0 - MPEG-2.5, 1 - reserved, 2 - MPEG-2, 3 - MPEG-1
+		layer = (hdat1 >> 1) & 0x03;     // 0 - reserved, 1 - III, 2 - II, 3 - I
+		index = hdat0 >> 12;
+		status->codec = layer == 1 ? "mp3" : layer == 2 ? "mp2" : "mp1";
+		if (version != 1 && layer != 0 && index != 0 && index != 15)
+		{
+			status->bitrate_kbps = mpeg_bitrates[version == 3 ? 0 : 1][3 - layer][index - 1];
+		}
+		return;
+	}
+	status->codec = hdat1 ? "unknown" : "none";
+	for (cnt = 0; cnt < sizeof(formats) / sizeof(formats[0]); cnt++)
+	{
+		if (formats[cnt].hdat1 == hdat1)
+		{
+			// HDAT0 is the data rate in bytes per second
+			status->codec = formats[cnt].codec;
+			status->bitrate_kbps = (uint32_t)hdat0 * 8 / 1000;
+			break;
 		}
 	}
 }
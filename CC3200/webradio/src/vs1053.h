@@ -15,13 +15,41 @@
 #ifndef VS1053_H_
 #define VS1053_H_
 
+//--------------------------------------------
+// SPI traffic to the codec: sci_* count chip select frames, a multiple
+// write is one; sdi_bursts counts the DREQ bursts of up to 32 bytes
+typedef struct
+{
+	uint32_t sci_reads;
+	uint32_t sci_writes;
+	uint32_t sdi_bursts;
+	uint32_t sdi_bytes;
+	uint32_t dreq_timeouts;
+	uint32_t cancels;
+	uint32_t resets;
+} vs1053_stats_t;
+
+//--------------------------------------------
+// What the decoder is playing, from HDAT0, HDAT1, AUDATA and DECODE_TIME
+typedef struct
+{
+	const char *codec;
+	uint32_t bitrate_kbps;
+	uint32_t sample_rate;
+	uint8_t channels;
+	uint16_t decode_time;
+} vs1053_status_t;
+
 //--------------------------------------------
 void vs1053_init_iface(void);
 void vs1053_reset(void);
 uint16_t vs1053_read_register(uint8_t reg);
 void vs1053_write_register(uint8_t reg, uint16_t data);
-void vs1053_write_data(uint8_t *buf, size_t size);
+int vs1053_write_data(uint8_t *buf, size_t size);
+int vs1053_cancel(void);
 void vs1053_sinewave_test(uint32_t time_ms);
 void vs1053_load_user_code(void);
+void vs1053_get_stats(vs1053_stats_t *stats);
+void vs1053_get_status(vs1053_status_t *status);
 
 #endif // VS1053_H_
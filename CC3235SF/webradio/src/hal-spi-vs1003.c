@@ -13,21 +13,94 @@
 */
 
 #include <stdint.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <time.h>
+#include <semaphore.h>
 #include <ti/drivers/GPIO.h>
 #include <ti/drivers/SPI.h>
 #include <ti/display/Display.h>
 #include "ti_drivers_config.h"
 
 //--------------------------------------------
-#define SPI_BIT_RATE  1000000
+#define SPI_BIT_RATE_SLOW  1000000     // reset, CLKI = XTALI: XTALI/7
+#define SPI_BIT_RATE_SCI   4000000     // registers after CLOCKF: CLKI/7
+#define SPI_BIT_RATE_SDI   8000000     // data after CLOCKF: CLKI/4
+#define DREQ_RESET_MS      100         // DREQ rises a few ms after reset
+#define SDI_ON_SCI_BYTES   2048        // data kept on the SCI clock after a register access
 
 //--------------------------------------------
 static SPI_Handle spiHandle;
+static uint32_t spi_bit_rate;
+static uint8_t spi_fast;
+static size_t sdi_on_sci_left;
+static sem_t dreq_event;
+
+//--------------------------------------------
+// bitRate is fixed at SPI_open(), reopen the driver only when the rate changes;
+// returns -1 if the driver could not be opened
+static int set_bit_rate(uint32_t bit_rate)
+{
+	SPI_Params spiParams;
+
+	if (bit_rate == spi_bit_rate && spiHandle)
+	{
+		return 0;
+	}
+	if (spiHandle)
+	{
+		SPI_close(spiHandle);
+	}
+	SPI_Params_init(&spiParams);
+	spiParams.bitRate = bit_rate;
+	spiHandle = SPI_open(CONFIG_SPI_0, &spiParams);
+	spi_bit_rate = bit_rate;
+	return spiHandle ? 0 : -1;
+}
+
+//--------------------------------------------
+// Data written between register accesses (the end fill bytes of a cancel,
+// the audio right after a status poll) stays on the slower SCI clock,
+// which is within the SDI limit, so the driver is not reopened for every
+// switch; the data clock comes back after SDI_ON_SCI_BYTES.
+static uint32_t sdi_bit_rate(size_t size)
+{
+	if (!spi_fast)
+	{
+		return SPI_BIT_RATE_SLOW;
+	}
+	if (!sdi_on_sci_left)
+	{
+		return SPI_BIT_RATE_SDI;
+	}
+	sdi_on_sci_left -= size < sdi_on_sci_left ? size : sdi_on_sci_left;
+	return SPI_BIT_RATE_SCI;
+}
+
+//--------------------------------------------
+// DREQ going high wakes the task waiting for it
+static void dreq_isr(uint_least8_t index)
+{
+	int value;
+
+	// keep the semaphore binary
+	if (sem_getvalue(&dreq_event, &value) == 0 && value > 0)
+	{
+		return;
+	}
+	sem_post(&dreq_event);
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_set_fast(uint8_t state)
+{
+	spi_fast = state;
+}
 
 //--------------------------------------------
 void hal_spi_vs1003_reset(void)
 {
+	hal_spi_vs1003_set_fast(0);
 	GPIO_write(CONFIG_GPIO_VS1003_RESET, 1);
 	usleep(1000);
 	GPIO_write(CONFIG_GPIO_VS1003_RESET, 0);
@@ -36,7 +109,7 @@ void hal_spi_vs1003_reset(void)
 	GPIO_write(CONFIG_GPIO_VS1003_XDCS, 1);
 	GPIO_write(CONFIG_GPIO_VS1003_RESET, 1);
 	usleep(1000);
-	while (!GPIO_read(CONFIG_GPIO_VS1003_DREQ));
+	hal_spi_vs1003_wait_dreq(DREQ_RESET_MS);
 }
 
 //--------------------------------------------
@@ -46,10 +119,13 @@ void hal_spi_vs1003_init(void)
 	GPIO_init();
 	SPI_init();
 
-	SPI_Params spiParams;
-	SPI_Params_init(&spiParams);
-	spiParams.bitRate = SPI_BIT_RATE;
-	spiHandle = SPI_open(CONFIG_SPI_0, &spiParams);
+	set_bit_rate(SPI_BIT_RATE_SLOW);
+
+	// DREQ interrupt on the rising edge
+	sem_init(&dreq_event, 0, 0);
+	GPIO_setConfig(CONFIG_GPIO_VS1003_DREQ, GPIO_CFG_INPUT_INTERNAL | GPIO_CFG_IN_INT_RISING | GPIO_CFG_PULL_NONE_INTERNAL);
+	GPIO_setCallback(CONFIG_GPIO_VS1003_DREQ, dreq_isr);
+	GPIO_enableInt(CONFIG_GPIO_VS1003_DREQ);
 }
 
 //--------------------------------------------
@@ -60,6 +136,11 @@ uint8_t hal_spi_vs1003_txrx(uint8_t data)
 	uint8_t rx_buf[1];
 	volatile bool res;
 
+	sdi_on_sci_left = SDI_ON_SCI_BYTES;
+	if (set_bit_rate(spi_fast ? SPI_BIT_RATE_SCI : SPI_BIT_RATE_SLOW) < 0)
+	{
+		return 0;
+	}
 	tx_buf[0] = data;
 	transaction.count = 1;
 	transaction.txBuf = (void *)tx_buf;
@@ -70,6 +151,23 @@ uint8_t hal_spi_vs1003_txrx(uint8_t data)
 	return rx_buf[0];
 }
 
+//--------------------------------------------
+void hal_spi_vs1003_tx_block(uint8_t *buf, size_t size)
+{
+	SPI_Transaction transaction;
+	volatile bool res;
+
+	if (set_bit_rate(sdi_bit_rate(size)) < 0)
+	{
+		return;
+	}
+	transaction.count = size;
+	transaction.txBuf = (void *)buf;
+	transaction.rxBuf = NULL;
+
+	res = SPI_transfer(spiHandle, &transaction);
+}
+
 //--------------------------------------------
 void hal_spi_vs1003_xcs(uint8_t state)
 {
@@ -87,3 +185,27 @@ uint8_t hal_spi_vs1003_dreq(void)
 {
 	return GPIO_read(CONFIG_GPIO_VS1003_DREQ);
 }
+
+//--------------------------------------------
+// returns 0 once DREQ is high, -1 on timeout
+int hal_spi_vs1003_wait_dreq(uint32_t timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000;
+	}
+	while (!GPIO_read(CONFIG_GPIO_VS1003_DREQ))
+	{
+		if (sem_timedwait(&dreq_event, &ts) != 0)
+		{
+			return GPIO_read(CONFIG_GPIO_VS1003_DREQ) ? 0 : -1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,305 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, strtoul */
+#include <stdbool.h>    /* bool */
+#include <string.h>     /* strncmp */
+#include <stdio.h>      /* snprintf */
+#include "playlist.h"
+#include "hls.h"
+
+//--------------------------------------------
+#define HLS_TARGET_DURATION  "#EXT-X-TARGETDURATION:"
+#define HLS_MEDIA_SEQUENCE   "#EXT-X-MEDIA-SEQUENCE:"
+#define HLS_ENDLIST          "#EXT-X-ENDLIST"
+#define HLS_VOD              "#EXT-X-PLAYLIST-TYPE:VOD"
+#define HLS_KEY              "#EXT-X-KEY:"
+#define HLS_KEY_NONE         "METHOD=NONE"
+
+//--------------------------------------------
+typedef struct
+{
+	bool is_open;
+	bool started;
+	bool endlist;
+	bool vod;                             // finished, known before the segments
+	bool encrypted;
+	bool refresh;                         // hls_next gave the media playlist
+	char location[HLS_LOCATION_SIZE];     // the media playlist
+	uint32_t target_duration;
+	uint32_t media_seq;                   // of the first segment in the playlist
+	uint32_t seq;                         // of the next segment line
+	uint32_t next_seq;                    // the first segment not queued yet
+	uint32_t end_seq;                     // the one after the last in the playlist
+	uint32_t wait_ms;
+	char line[HLS_LOCATION_SIZE];         // the line being received
+	size_t line_len;
+	char segments[HLS_MAX_SEGMENTS][HLS_LOCATION_SIZE];
+	size_t segment_first;
+	size_t segment_count;
+} hls_t;
+static hls_t hls;
+
+//--------------------------------------------
+static bool tag_is(const char *line, size_t len, const char *tag)
+{
+	size_t tag_len = strlen(tag);
+
+	return len >= tag_len && !strncmp(line, tag, tag_len);
+}
+
+//--------------------------------------------
+// the line is not terminated, str is looked for within its len bytes
+static bool line_has(const char *line, size_t len, const char *str)
+{
+	size_t str_len = strlen(str);
+
+	for (; len >= str_len; line++, len--)
+	{
+		if (!strncmp(line, str, str_len))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+//--------------------------------------------
+static void queue_segment(const char *uri, size_t len)
+{
+	char entry[HLS_LOCATION_SIZE];
+	size_t pos;
+
+	snprintf(entry, sizeof(entry), "%.*s", (int)len, uri);
+	pos = (hls.segment_first + hls.segment_count) % HLS_MAX_SEGMENTS;
+	playlist_resolve(hls.location, entry, hls.segments[pos], sizeof(hls.segments[pos]));
+	hls.segment_count++;
+}
+
+//--------------------------------------------
+// the sequence number of the first segment, it comes before the segments
+static void take_media_seq(uint32_t seq)
+{
+	if (hls.started && (int32_t)(seq - hls.media_seq) < 0)
+	{
+		// the encoder has restarted, the stream is joined anew
+		hls.started = false;
+	}
+	else if (hls.started && (int32_t)(hls.next_seq - seq) < 0)
+	{
+		// the segments in between have gone
+		hls.next_seq = seq;
+	}
+	hls.media_seq = seq;
+	hls.seq = seq;
+}
+
+//--------------------------------------------
+static void take_segment(const char *uri, size_t len)
+{
+	if (!hls.started && hls.vod)
+	{
+		// played from its start
+		hls.next_seq = hls.seq;
+		hls.started = true;
+	}
+	if (!hls.started)
+	{
+		// a live stream is joined close to its end, the last ones are kept
+		if (hls.segment_count == HLS_MAX_SEGMENTS)
+		{
+			hls.segment_first = (hls.segment_first + 1) % HLS_MAX_SEGMENTS;
+			hls.segment_count--;
+		}
+		queue_segment(uri, len);
+	}
+	else if (hls.seq == hls.next_seq && hls.segment_count < HLS_MAX_SEGMENTS)
+	{
+		queue_segment(uri, len);
+		hls.next_seq++;
+	}
+	hls.seq++;
+}
+
+//--------------------------------------------
+static void parse_line(const char *line, size_t len)
+{
+	for (; len && (*line == ' ' || *line == '\t'); line++, len--);
+	while (len && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+	{
+		len--;
+	}
+	if (!len)
+	{
+		return;
+	}
+	if (tag_is(line, len, HLS_TARGET_DURATION))
+	{
+		hls.target_duration = strtoul(line + sizeof(HLS_TARGET_DURATION) - 1, NULL, 10);
+	}
+	else if (tag_is(line, len, HLS_MEDIA_SEQUENCE))
+	{
+		take_media_seq(strtoul(line + sizeof(HLS_MEDIA_SEQUENCE) - 1, NULL, 10));
+	}
+	else if (tag_is(line, len, HLS_ENDLIST))
+	{
+		hls.endlist = true;
+	}
+	else if (tag_is(line, len, HLS_VOD))
+	{
+		hls.vod = true;
+		hls.endlist = true;
+	}
+	else if (tag_is(line, len, HLS_KEY) && !line_has(line, len, HLS_KEY_NONE))
+	{
+		// encrypted segments
+		hls.encrypted = true;
+	}
+	else if (line[0] != '#')
+	{
+		take_segment(line, len);
+	}
+}
+
+//--------------------------------------------
+// the values in the line end with it
+static void end_line(void)
+{
+	hls.line[hls.line_len] = '\0';
+	parse_line(hls.line, hls.line_len);
+	hls.line_len = 0;
+}
+
+//--------------------------------------------
+// a playlist body begins, from location; while a stream is open
+// it is the media playlist again
+void hls_begin(const char *location)
+{
+	if (!hls.is_open)
+	{
+		memset(&hls, 0, sizeof(hls));
+		snprintf(hls.location, sizeof(hls.location), "%s", location);
+	}
+	hls.encrypted = false;
+	hls.seq = 0;
+	hls.line_len = 0;
+}
+
+//--------------------------------------------
+// the body is parsed line by line as it arrives,
+// so that a media playlist may be of any length
+void hls_append(const uint8_t *buf, size_t size)
+{
+	size_t cnt;
+
+	for (cnt = 0; cnt < size; cnt++)
+	{
+		if (buf[cnt] == '\r' || buf[cnt] == '\n')
+		{
+			end_line();
+		}
+		else if (hls.line_len < sizeof(hls.line) - 1)
+		{
+			// the tail of an overlong line is dropped
+			hls.line[hls.line_len++] = (char)buf[cnt];
+		}
+	}
+}
+
+//--------------------------------------------
+// the body since hls_begin is a media playlist to be followed
+void hls_open(void)
+{
+	hls.is_open = true;
+}
+
+//--------------------------------------------
+void hls_close(void)
+{
+	hls.is_open = false;
+}
+
+//--------------------------------------------
+bool hls_is_open(void)
+{
+	return hls.is_open;
+}
+
+//--------------------------------------------
+// the location given last by hls_next is the media playlist
+bool hls_is_refresh(void)
+{
+	return hls.refresh;
+}
+
+//--------------------------------------------
+// the media playlist is complete, its segments not seen before are queued;
+// returns the number of queued segments, -1 if the stream cannot be played
+int hls_update(void)
+{
+	// the last line may have no end
+	end_line();
+	if (!hls.target_duration || hls.encrypted)
+	{
+		return -1;
+	}
+	// an unchanged playlist is asked again after half the target duration
+	hls.wait_ms = hls.segment_count ? 0 : hls.target_duration * 500;
+	if (!hls.started)
+	{
+		hls.next_seq = hls.seq;
+		if (hls.endlist && (int32_t)(hls.seq - hls.media_seq) > HLS_MAX_SEGMENTS)
+		{
+			// an ENDLIST at the end is seen once the first segments have gone
+			// from the queue, the playlist is asked again at once for them
+			hls.segment_count = 0;
+			hls.next_seq = hls.media_seq;
+			hls.wait_ms = 0;
+		}
+		hls.started = true;
+	}
+	hls.end_seq = hls.seq;
+	return (int)hls.segment_count;
+}
+
+//--------------------------------------------
+// the next location to fetch: 0 for a segment, 1 for the media playlist
+// once the queued segments are over; -1 at the end of the stream
+int hls_next(char *location, size_t size)
+{
+	hls.refresh = false;
+	if (hls.segment_count)
+	{
+		snprintf(location, size, "%s", hls.segments[hls.segment_first]);
+		hls.segment_first = (hls.segment_first + 1) % HLS_MAX_SEGMENTS;
+		hls.segment_count--;
+		return 0;
+	}
+	if (hls.endlist && (int32_t)(hls.end_seq - hls.next_seq) <= 0)
+	{
+		// a finished playlist may list more than one queue of segments
+		return -1;
+	}
+	snprintf(location, size, "%s", hls.location);
+	hls.refresh = true;
+	return 1;
+}
+
+//--------------------------------------------
+// the wait before the media playlist is asked again
+uint32_t hls_get_wait_ms(void)
+{
+	return hls.wait_ms;
+}
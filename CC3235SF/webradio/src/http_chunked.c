@@ -0,0 +1,168 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t */
+#include <stdbool.h>    /* bool */
+#include <string.h>     /* memmove */
+#include "http_chunked.h"
+
+//--------------------------------------------
+#define CHUNK_SIZE_MAX       0x1000000  // a larger chunk is taken for garbage
+
+//--------------------------------------------
+static int hex_digit(uint8_t c)
+{
+	if (c >= '0' && c <= '9')
+	{
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f')
+	{
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F')
+	{
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+//--------------------------------------------
+// the size line is over, a zero size chunk is the last one
+static int end_size_line(http_chunked_t *chunked)
+{
+	if (!chunked->digits)
+	{
+		return -1;
+	}
+	chunked->state = chunked->left ? http_chunked_data : http_chunked_trailer;
+	chunked->line_len = 0;
+	return 0;
+}
+
+//--------------------------------------------
+void http_chunked_init(http_chunked_t *chunked)
+{
+	memset(chunked, 0, sizeof(http_chunked_t));
+	chunked->state = http_chunked_size;
+}
+
+//--------------------------------------------
+// Chunk data is moved in place to the front of buf over the size lines,
+// returns the resulting length; -1 on a malformed chunk.
+int http_chunked_decode(http_chunked_t *chunked, uint8_t *buf, size_t size)
+{
+	size_t cnt = 0;
+	size_t out_cnt = 0;
+	size_t len;
+	uint8_t c;
+	int digit;
+
+	while (cnt < size && chunked->state != http_chunked_done)
+	{
+		if (chunked->state == http_chunked_data)
+		{
+			len = size - cnt > chunked->left ? chunked->left : size - cnt;
+			if (out_cnt != cnt)
+			{
+				memmove(buf + out_cnt, buf + cnt, len);
+			}
+			out_cnt += len;
+			cnt += len;
+			chunked->left -= len;
+			if (!chunked->left)
+			{
+				chunked->state = http_chunked_data_end;
+			}
+			continue;
+		}
+		c = buf[cnt++];
+		switch (chunked->state)
+		{
+			case http_chunked_size:
+				digit = hex_digit(c);
+				if (digit >= 0)
+				{
+					chunked->left = chunked->left * 16 + digit;
+					chunked->digits++;
+					if (chunked->left > CHUNK_SIZE_MAX)
+					{
+						return -1;
+					}
+				}
+				else if (c == '\n')
+				{
+					if (end_size_line(chunked) < 0)
+					{
+						return -1;
+					}
+				}
+				else if (c == ';' || c == ' ' || c == '\t' || c == '\r')
+				{
+					// chunk extensions are ignored
+					chunked->state = http_chunked_ext;
+				}
+				else
+				{
+					return -1;
+				}
+				break;
+			case http_chunked_ext:
+				if (c == '\n' && end_size_line(chunked) < 0)
+				{
+					return -1;
+				}
+				break;
+			case http_chunked_data_end:
+				// CRLF after the data, a bare LF is let through
+				if (c == '\n')
+				{
+					chunked->state = http_chunked_size;
+					chunked->left = 0;
+					chunked->digits = 0;
+				}
+				else if (c != '\r')
+				{
+					return -1;
+				}
+				break;
+			case http_chunked_trailer:
+				// trailer fields are skipped up to the empty line
+				if (c == '\n')
+				{
+					if (!chunked->line_len)
+					{
+						chunked->state = http_chunked_done;
+					}
+					chunked->line_len = 0;
+				}
+				else if (c != '\r')
+				{
+					chunked->line_len++;
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	return (int)out_cnt;
+}
+
+//--------------------------------------------
+// the last chunk and the trailer have been received
+bool http_chunked_is_done(http_chunked_t *chunked)
+{
+	return chunked->state == http_chunked_done;
+}
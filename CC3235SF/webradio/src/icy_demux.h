@@ -0,0 +1,55 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef ICY_DEMUX_H
+#define ICY_DEMUX_H
+
+//--------------------------------------------
+typedef enum
+{
+	icy_span_none = 0,
+	icy_span_audio,
+	icy_span_meta
+} icy_span_type_t;
+
+//--------------------------------------------
+// Audio spans point into the input buffer,
+// a metadata span points to the complete block in meta_buf.
+typedef struct
+{
+	icy_span_type_t type;
+	const uint8_t *data;
+	size_t size;
+} icy_span_t;
+
+//--------------------------------------------
+// Splits a stream with interleaved ICY metadata: metaint audio bytes,
+// a length byte, length * 16 metadata bytes, and again.
+// The whole state is here, so there may be one demuxer per connection.
+// Metadata beyond meta_buf_size is dropped.
+typedef struct
+{
+	size_t metaint;
+	size_t audio_left;
+	size_t meta_left;
+	uint8_t *meta_buf;
+	size_t meta_buf_size;
+	size_t meta_len;
+} icy_demux_t;
+
+//--------------------------------------------
+void icy_demux_init(icy_demux_t *demux, size_t metaint, uint8_t *meta_buf, size_t meta_buf_size);
+size_t icy_demux_next(icy_demux_t *demux, const uint8_t *buf, size_t size, icy_span_t *span);
+
+#endif /* ICY_DEMUX_H */
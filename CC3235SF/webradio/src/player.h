@@ -0,0 +1,25 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef PLAYER_H
+#define PLAYER_H
+
+//--------------------------------------------
+// The player task writes the audio ring buffer to the codec.
+// player_run() is one pass of its loop: it writes at most
+// one span of the buffer or waits for the start level.
+void player_run(void);
+void player_get_decoder_status(vs1053_status_t *status);
+
+#endif /* PLAYER_H */
@@ -13,9 +13,145 @@
 */
 
 #include <stdint.h>     /* uint8_t ... uint64_t */
-#include "pthread.h"
+#include <stdlib.h>     /* size_t */
+#include <string.h>     /* memcpy */
+#include <intrinsics.h> /* __DMB */
+#include <time.h>
+#include <semaphore.h>
 #include "ring_buf.h"
 
+//--------------------------------------------
+// head/tail are shared between the producer and the consumer tasks
+static inline size_t load_index(volatile size_t *index)
+{
+	size_t value = *index;
+	__DMB();
+	return value;
+}
+
+//--------------------------------------------
+static inline void store_index(volatile size_t *index, size_t value)
+{
+	__DMB();
+	*index = value;
+}
+
+//--------------------------------------------
+static inline void full_fence(void)
+{
+	__DMB();
+}
+
+//--------------------------------------------
+static inline size_t index_count(ring_buf_t *ring_buf, size_t head, size_t tail)
+{
+	return head >= tail ? head - tail : 2 * ring_buf->length - tail + head;
+}
+
+//--------------------------------------------
+static inline size_t index_advance(ring_buf_t *ring_buf, size_t index, size_t size)
+{
+	index += size;
+	return index >= 2 * ring_buf->length ? index - 2 * ring_buf->length : index;
+}
+
+//--------------------------------------------
+static inline size_t index_offset(ring_buf_t *ring_buf, size_t index)
+{
+	return index >= ring_buf->length ? index - ring_buf->length : index;
+}
+
+//--------------------------------------------
+#define RESIZE_WAIT_MS             100
+
+//--------------------------------------------
+// consumer side: apply the pending ring_buf_clear() request
+static size_t consumer_tail(ring_buf_t *ring_buf)
+{
+	size_t seq = load_index(&ring_buf->flush_seq);
+
+	if (seq != ring_buf->flush_ack)
+	{
+		ring_buf->flush_ack = seq;
+		store_index(&ring_buf->tail, load_index(&ring_buf->flush_pos));
+	}
+	return ring_buf->tail;
+}
+
+//--------------------------------------------
+// producer side: the consumer has not moved to the requested buffer yet
+static inline int resize_pending(ring_buf_t *ring_buf)
+{
+	return ring_buf->resize_seq != load_index(&ring_buf->resize_ack);
+}
+
+//--------------------------------------------
+// producer side: number of writable bytes, none while a resize is pending
+static size_t producer_space(ring_buf_t *ring_buf)
+{
+	if (resize_pending(ring_buf))
+	{
+		return 0;
+	}
+	return ring_buf->length - index_count(ring_buf, ring_buf->head, load_index(&ring_buf->tail));
+}
+
+//--------------------------------------------
+static int event_create(sem_t *event)
+{
+	return sem_init(event, 0, 0);
+}
+
+//--------------------------------------------
+static void event_delete(sem_t *event)
+{
+	sem_destroy(event);
+}
+
+//--------------------------------------------
+static void event_signal(sem_t *event)
+{
+	int value;
+
+	// keep the semaphore binary
+	if (sem_getvalue(event, &value) == 0 && value > 0)
+	{
+		return;
+	}
+	sem_post(event);
+}
+
+//--------------------------------------------
+// returns 0 if signalled, -1 on timeout
+static int event_wait(sem_t *event, uint32_t timeout_ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000;
+	}
+	return sem_timedwait(event, &ts) == 0 ? 0 : -1;
+}
+
+//--------------------------------------------
+// wake the other side once its watermark is reached
+static void notify(volatile size_t *wanted, size_t available, sem_t *event)
+{
+	size_t size;
+
+	full_fence();
+	size = *wanted;
+	if (size && available >= size)
+	{
+		event_signal(event);
+	}
+}
+
 //--------------------------------------------
 int ring_buf_init(ring_buf_t *ring_buf, uint8_t *buf, size_t size)
 {
@@ -23,110 +159,388 @@ int ring_buf_init(ring_buf_t *ring_buf, uint8_t *buf, size_t size)
 	{
 		return -1;
 	}
-	if (pthread_mutex_init(&ring_buf->mutex, NULL) < 0)
+	if (event_create(&ring_buf->data_event) < 0)
 	{
 		return -1;
 	}
-	ring_buf->valid = 1;
+	if (event_create(&ring_buf->space_event) < 0)
+	{
+		event_delete(&ring_buf->data_event);
+		return -1;
+	}
 	ring_buf->buffer = buf;
 	ring_buf->length = size;
-	ring_buf->count = 0;
-	ring_buf->head = size - 1;
+	ring_buf->head = 0;
 	ring_buf->tail = 0;
+	ring_buf->flush_pos = 0;
+	ring_buf->flush_seq = 0;
+	ring_buf->flush_ack = 0;
 	ring_buf->max_count = 0;
+	ring_buf->read_wanted = 0;
+	ring_buf->write_wanted = 0;
+	ring_buf->bytes_in = 0;
+	ring_buf->bytes_out = 0;
+	ring_buf->stalls = 0;
+	ring_buf->resize_length = 0;
+	ring_buf->resize_seq = 0;
+	ring_buf->resize_ack = 0;
+	ring_buf->resize_seen = 0;
+	ring_buf->valid = 1;
 	return 0;
 }
 
 //--------------------------------------------
+// producer side: the consumer drops everything up to the current head
 int ring_buf_clear(ring_buf_t *ring_buf)
 {
 	if (!ring_buf->valid)
 	{
 		return -1;
 	}
-	pthread_mutex_lock(&ring_buf->mutex);
-	ring_buf->count = 0;
-	ring_buf->head = ring_buf->length - 1;
-	ring_buf->tail = 0;
+	// head is moved by the consumer until the resize is acknowledged
+	while (resize_pending(ring_buf))
+	{
+		event_wait(&ring_buf->space_event, RESIZE_WAIT_MS);
+	}
+	store_index(&ring_buf->flush_pos, ring_buf->head);
+	store_index(&ring_buf->flush_seq, ring_buf->flush_seq + 1);
 	ring_buf->max_count = 0;
-	pthread_mutex_unlock(&ring_buf->mutex);
 	return 0;
 }
 
 //--------------------------------------------
 int ring_buf_put(ring_buf_t *ring_buf, uint8_t *buf, size_t size)
 {
-	size_t next;
-	size_t added = 0;
+	size_t head;
+	size_t count;
+	size_t offset;
+	size_t first;
 
 	if (!ring_buf->valid)
 	{
 		return -1;
 	}
-	pthread_mutex_lock(&ring_buf->mutex);
+	if (resize_pending(ring_buf))
+	{
+		return 0;
+	}
+	head = ring_buf->head;
+	count = index_count(ring_buf, head, load_index(&ring_buf->tail));
+
+	size = size > ring_buf->length - count ? ring_buf->length - count : size;
+	offset = index_offset(ring_buf, head);
+	first = size > ring_buf->length - offset ? ring_buf->length - offset : size;
+	memcpy(ring_buf->buffer + offset, buf, first);
+	memcpy(ring_buf->buffer, buf + first, size - first);
+	store_index(&ring_buf->head, index_advance(ring_buf, head, size));
+	notify(&ring_buf->read_wanted, count + size, &ring_buf->data_event);
+	ring_buf->bytes_in += size;
 
-	size = size > ring_buf->length - ring_buf->count ? ring_buf->length - ring_buf->count : size;
-	while (size)
+	if (ring_buf->max_count < count + size)
 	{
-		next = (ring_buf->head + 1) % ring_buf->length;
-		ring_buf->buffer[next] = *buf++;
-		ring_buf->head = next;
-		++ring_buf->count;
-		--size;
-		++added;
+		ring_buf->max_count = count + size;
 	}
-	if (ring_buf->max_count < ring_buf->count)
+	return size;
+}
+
+//--------------------------------------------
+int ring_buf_get(ring_buf_t *ring_buf, uint8_t *buf, size_t size)
+{
+	size_t tail;
+	size_t count;
+	size_t offset;
+	size_t first;
+
+	if (!ring_buf->valid)
 	{
-		ring_buf->max_count = ring_buf->count;
+		return -1;
 	}
+	tail = consumer_tail(ring_buf);
+	count = index_count(ring_buf, load_index(&ring_buf->head), tail);
 
-	pthread_mutex_unlock(&ring_buf->mutex);
+	size = size > count ? count : size;
+	offset = index_offset(ring_buf, tail);
+	first = size > ring_buf->length - offset ? ring_buf->length - offset : size;
+	memcpy(buf, ring_buf->buffer + offset, first);
+	memcpy(buf + first, ring_buf->buffer, size - first);
+	store_index(&ring_buf->tail, index_advance(ring_buf, tail, size));
+	notify(&ring_buf->write_wanted, ring_buf->length - count + size, &ring_buf->space_event);
+	ring_buf->bytes_out += size;
 
-	return added;
+	return size;
 }
 
 //--------------------------------------------
-int ring_buf_get(ring_buf_t *ring_buf, uint8_t *buf, size_t size)
+// producer side: contiguous free span that can be filled in place
+int ring_buf_reserve_write(ring_buf_t *ring_buf, uint8_t **buf)
 {
-	size_t removed = 0;
+	size_t head;
+	size_t count;
+	size_t offset;
 
 	if (!ring_buf->valid)
 	{
 		return -1;
 	}
-	pthread_mutex_lock(&ring_buf->mutex);
+	if (resize_pending(ring_buf))
+	{
+		*buf = NULL;
+		return 0;
+	}
+	head = ring_buf->head;
+	count = index_count(ring_buf, head, load_index(&ring_buf->tail));
+	offset = index_offset(ring_buf, head);
+	*buf = ring_buf->buffer + offset;
+	return ring_buf->length - count > ring_buf->length - offset ? ring_buf->length - offset : ring_buf->length - count;
+}
+
+//--------------------------------------------
+// producer side: publish the first size bytes of the reserved span
+int ring_buf_commit_write(ring_buf_t *ring_buf, size_t size)
+{
+	size_t head;
+	size_t count;
 
-	size = size > ring_buf->count ? ring_buf->count : size;
-	while (size)
+	if (!ring_buf->valid || resize_pending(ring_buf))
 	{
-		*buf++ = ring_buf->buffer[ring_buf->tail++];
-		ring_buf->tail %= ring_buf->length;
-		--ring_buf->count;
-		--size;
-		++removed;
+		return -1;
+	}
+	head = ring_buf->head;
+	count = index_count(ring_buf, head, load_index(&ring_buf->tail));
+	if (size > ring_buf->length - count)
+	{
+		return -1;
 	}
+	store_index(&ring_buf->head, index_advance(ring_buf, head, size));
+	notify(&ring_buf->read_wanted, count + size, &ring_buf->data_event);
+	ring_buf->bytes_in += size;
 
-	pthread_mutex_unlock(&ring_buf->mutex);
+	if (ring_buf->max_count < count + size)
+	{
+		ring_buf->max_count = count + size;
+	}
+	return size;
+}
 
-	return removed;
+//--------------------------------------------
+// consumer side: contiguous filled span that can be read in place
+int ring_buf_peek_read(ring_buf_t *ring_buf, uint8_t **buf)
+{
+	size_t tail;
+	size_t count;
+	size_t offset;
+
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	tail = consumer_tail(ring_buf);
+	count = index_count(ring_buf, load_index(&ring_buf->head), tail);
+	offset = index_offset(ring_buf, tail);
+	*buf = ring_buf->buffer + offset;
+	return count > ring_buf->length - offset ? ring_buf->length - offset : count;
+}
+
+//--------------------------------------------
+// consumer side: release the first size bytes of the peeked span
+// (a clear issued in between is applied by the next peek)
+int ring_buf_consume(ring_buf_t *ring_buf, size_t size)
+{
+	size_t tail;
+	size_t count;
+
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	tail = ring_buf->tail;
+	count = index_count(ring_buf, load_index(&ring_buf->head), tail);
+	if (size > count)
+	{
+		return -1;
+	}
+	store_index(&ring_buf->tail, index_advance(ring_buf, tail, size));
+	notify(&ring_buf->write_wanted, ring_buf->length - count + size, &ring_buf->space_event);
+	ring_buf->bytes_out += size;
+	return size;
+}
+
+//--------------------------------------------
+// consumer side: block until at least size bytes can be read
+// or timeout_ms expires, returns the number of readable bytes
+int ring_buf_wait_read(ring_buf_t *ring_buf, size_t size, uint32_t timeout_ms)
+{
+	size_t count;
+
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	size = size > ring_buf->length ? ring_buf->length : size;
+	count = index_count(ring_buf, load_index(&ring_buf->head), consumer_tail(ring_buf));
+	while (count < size)
+	{
+		ring_buf->read_wanted = size;
+		full_fence();
+		count = index_count(ring_buf, load_index(&ring_buf->head), consumer_tail(ring_buf));
+		if (count >= size)
+		{
+			break;
+		}
+		if (event_wait(&ring_buf->data_event, timeout_ms) < 0)
+		{
+			count = index_count(ring_buf, load_index(&ring_buf->head), consumer_tail(ring_buf));
+			break;
+		}
+		count = index_count(ring_buf, load_index(&ring_buf->head), consumer_tail(ring_buf));
+	}
+	ring_buf->read_wanted = 0;
+	return count;
+}
+
+//--------------------------------------------
+// producer side: block until at least size bytes can be written
+// or timeout_ms expires, returns the number of free bytes
+int ring_buf_wait_write(ring_buf_t *ring_buf, size_t size, uint32_t timeout_ms)
+{
+	size_t space;
+
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	size = size > ring_buf->length ? ring_buf->length : size;
+	space = producer_space(ring_buf);
+	if (space < size)
+	{
+		ring_buf->stalls++;
+	}
+	while (space < size)
+	{
+		ring_buf->write_wanted = size;
+		full_fence();
+		space = producer_space(ring_buf);
+		if (space >= size)
+		{
+			break;
+		}
+		if (event_wait(&ring_buf->space_event, timeout_ms) < 0)
+		{
+			space = producer_space(ring_buf);
+			break;
+		}
+		space = producer_space(ring_buf);
+	}
+	ring_buf->write_wanted = 0;
+	return space;
+}
+
+//--------------------------------------------
+// consumer side: number of readable bytes
+int ring_buf_get_count(ring_buf_t *ring_buf)
+{
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	return index_count(ring_buf, load_index(&ring_buf->head), consumer_tail(ring_buf));
 }
 
 //--------------------------------------------
 int ring_buf_get_percentage_fill(ring_buf_t *ring_buf)
 {
-	size_t percentage_fill = 0;
+	size_t head;
+	size_t tail;
+
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	head = load_index(&ring_buf->head);
+	if (load_index(&ring_buf->flush_seq) != ring_buf->flush_ack)
+	{
+		tail = load_index(&ring_buf->flush_pos);
+	}
+	else
+	{
+		tail = load_index(&ring_buf->tail);
+	}
+	return index_count(ring_buf, head, tail) * 100 / ring_buf->length;
+}
+
+//--------------------------------------------
+// producer side: ask the consumer to move to a buffer of size bytes
+int ring_buf_request_resize(ring_buf_t *ring_buf, size_t size)
+{
+	if (!ring_buf->valid || !size)
+	{
+		return -1;
+	}
+	ring_buf->resize_length = size;
+	store_index(&ring_buf->resize_seq, ring_buf->resize_seq + 1);
+	return 0;
+}
 
+//--------------------------------------------
+// consumer side: size of the requested buffer, 0 if none is pending
+int ring_buf_get_resize(ring_buf_t *ring_buf)
+{
 	if (!ring_buf->valid)
 	{
 		return -1;
 	}
-	pthread_mutex_lock(&ring_buf->mutex);
+	ring_buf->resize_seen = load_index(&ring_buf->resize_seq);
+	if (ring_buf->resize_seen == ring_buf->resize_ack)
+	{
+		return 0;
+	}
+	return ring_buf->resize_length;
+}
 
-	percentage_fill = ring_buf->count * 100 / ring_buf->length;
+//--------------------------------------------
+// consumer side: move the buffered bytes to buf and go on with it,
+// buf = NULL keeps the current buffer (no memory for the new one);
+// must not be called while a span from ring_buf_peek_read() is in use
+int ring_buf_resize(ring_buf_t *ring_buf, uint8_t *buf, size_t size)
+{
+	size_t tail;
+	size_t count;
+	size_t offset;
+	size_t first;
 
-	pthread_mutex_unlock(&ring_buf->mutex);
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	if (buf)
+	{
+		tail = consumer_tail(ring_buf);
+		count = index_count(ring_buf, load_index(&ring_buf->head), tail);
+		// the newest bytes are dropped if they do not fit
+		count = count > size ? size : count;
+		offset = index_offset(ring_buf, tail);
+		first = count > ring_buf->length - offset ? ring_buf->length - offset : count;
+		memcpy(buf, ring_buf->buffer + offset, first);
+		memcpy(buf + first, ring_buf->buffer, count - first);
+		ring_buf->buffer = buf;
+		ring_buf->length = size;
+		ring_buf->tail = 0;
+		ring_buf->head = count;
+		ring_buf->max_count = count;
+	}
+	store_index(&ring_buf->resize_ack, ring_buf->resize_seen);
+	event_signal(&ring_buf->space_event);
+	return 0;
+}
 
-	return percentage_fill;
+//--------------------------------------------
+int ring_buf_get_length(ring_buf_t *ring_buf)
+{
+	if (!ring_buf->valid)
+	{
+		return -1;
+	}
+	return ring_buf->length;
 }
 
 //--------------------------------------------
@@ -136,7 +550,8 @@ int ring_buf_destroy(ring_buf_t *ring_buf)
 	{
 		return -1;
 	}
-	pthread_mutex_destroy(&ring_buf->mutex);
 	ring_buf->valid = 0;
+	event_delete(&ring_buf->data_event);
+	event_delete(&ring_buf->space_event);
 	return 0;
 }
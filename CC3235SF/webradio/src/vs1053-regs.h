@@ -54,4 +54,17 @@
 #define VS1053_CLOCKF_ADDx15         0x1000 // 1.5x
 #define VS1053_CLOCKF_ADDx20         0x1800 // 2.0x
 
+// SDI FIFO space guaranteed while DREQ is high
+#define VS1053_SDI_BURST_SIZE        32
+
+// DREQ low for longer than this means the codec hangs
+#define VS1053_DREQ_TIMEOUT_MS       1000
+
+// Extra parameters, read through WRAMADDR and WRAM
+#define VS1053_PARA_END_FILL_BYTE    0x1E06
+
+// Cancel sequence
+#define VS1053_END_FILL_SIZE         2052 // endFillByte padding before SM_CANCEL
+#define VS1053_CANCEL_SIZE           2048 // SM_CANCEL has to clear within this
+
 #endif // VS1053_REGS_H_
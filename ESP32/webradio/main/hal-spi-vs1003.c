@@ -13,7 +13,12 @@
 */
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 #include "driver/spi_master.h"
+#include "esp_heap_caps.h"
 #include "driver/gpio.h"
 #include "esp_log.h"
 
@@ -21,9 +26,17 @@
 void delay_ms(uint32_t time_ms);
 static const char* TAG = "hal-spi-vs1003";
 
+//--------------------------------------------
+#define SPI_DMA_ENABLED  1
+
 //--------------------------------------------
 #define SPI_HOST_ID      SPI3_HOST
-#define SPI_CLK_2MHz     (2*1000*1000)
+#define SPI_CLK_SLOW     (1*1000*1000)   // reset, CLKI = XTALI: XTALI/7
+#define SPI_CLK_SCI      (4*1000*1000)   // registers after CLOCKF: CLKI/7
+#define SPI_CLK_SDI      (8*1000*1000)   // data after CLOCKF: CLKI/4
+#define SPI_BLOCK_SIZE   64      // transaction limit without DMA
+#define SPI_DMA_CHUNK    256     // size of the DMA buffer
+#define DREQ_RESET_MS    100     // DREQ rises a few ms after reset
 
 //--------------------------------------------
 #define	GPIO_CLK         18
@@ -39,11 +52,83 @@ static const char* TAG = "hal-spi-vs1003";
 #define INPUT_PINS_SEL   (1ULL << GPIO_DREQ)
 
 //--------------------------------------------
-static spi_device_handle_t spi;
+// One device per clock rate, the driver keeps the clock setting per device
+static spi_device_handle_t spi_slow;
+static spi_device_handle_t spi_sci;
+static spi_device_handle_t spi_sdi;
+static uint8_t spi_fast;
+static SemaphoreHandle_t dreq_event;
+
+#if SPI_DMA_ENABLED
+//--------------------------------------------
+// tx_block() copies a burst into the DMA buffer, queues it and returns.
+// The result is collected by the next access that needs an idle bus
+// (DREQ, SCI, XCS), and XDCS is released only then, so the player
+// goes back to the ring while the burst is on the wire.
+// One buffer is enough: the next burst waits for DREQ anyway,
+// and DREQ has to cover every byte already sent.
+static uint8_t *dma_buf;
+static spi_transaction_t dma_trans;
+static bool dma_queued;
+static bool xdcs_release;
+static spi_device_handle_t dma_spi;
+
+//--------------------------------------------
+static void dma_wait(void)
+{
+    spi_transaction_t *t;
+
+    if (!dma_queued)
+    {
+        return;
+    }
+    ESP_ERROR_CHECK(spi_device_get_trans_result(dma_spi, &t, portMAX_DELAY));
+    dma_queued = false;
+    if (xdcs_release)
+    {
+        xdcs_release = false;
+        gpio_set_level(GPIO_XDCS, 1);
+    }
+}
+#endif
+
+//--------------------------------------------
+static void add_device(int clock_speed_hz, spi_device_handle_t *handle)
+{
+    spi_device_interface_config_t dev_cfg = { 0 };
+
+    dev_cfg.clock_speed_hz = clock_speed_hz;
+    dev_cfg.spics_io_num = GPIO_NOT_USED;
+    dev_cfg.queue_size = 1;
+    ESP_ERROR_CHECK(spi_bus_add_device(SPI_HOST_ID, &dev_cfg, handle));
+}
+
+//--------------------------------------------
+static void IRAM_ATTR dreq_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+
+    xSemaphoreGiveFromISR(dreq_event, &woken);
+    if (woken)
+    {
+        portYIELD_FROM_ISR();
+    }
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_set_fast(uint8_t state)
+{
+#if SPI_DMA_ENABLED
+    dma_wait();
+#endif
+    spi_fast = state;
+    ESP_LOGD(TAG, "%s clock", state ? "fast" : "slow");
+}
 
 //--------------------------------------------
 void hal_spi_vs1003_reset(void)
 {
+    hal_spi_vs1003_set_fast(0);
 	delay_ms(1);
     gpio_set_level(GPIO_RESET, 1);
 	delay_ms(1);
@@ -53,16 +138,20 @@ void hal_spi_vs1003_reset(void)
     gpio_set_level(GPIO_XDCS, 1);
     gpio_set_level(GPIO_RESET, 1);
 	delay_ms(1);
-	while (!gpio_get_level(GPIO_DREQ));
+    if (hal_spi_vs1003_wait_dreq(DREQ_RESET_MS) < 0)
+    {
+        ESP_LOGE(TAG, "reset: no DREQ");
+        return;
+    }
     ESP_LOGD(TAG, "reset ok");
 }
 
 //--------------------------------------------
 void hal_spi_vs1003_init(void)
 {
+    esp_err_t res;
     gpio_config_t io_conf = { 0 };
     spi_bus_config_t buscfg= { 0 };
-    spi_device_interface_config_t dev_cfg = { 0 };
 
     buscfg.sclk_io_num = GPIO_CLK;
     buscfg.miso_io_num = GPIO_MISO;
@@ -73,9 +162,20 @@ void hal_spi_vs1003_init(void)
     buscfg.data5_io_num = GPIO_NOT_USED;
     buscfg.data6_io_num = GPIO_NOT_USED;
     buscfg.data7_io_num = GPIO_NOT_USED;
+#if SPI_DMA_ENABLED
+    buscfg.max_transfer_sz = SPI_DMA_CHUNK;
+    //Initialize the SPI bus
+    ESP_ERROR_CHECK(spi_bus_initialize(SPI_HOST_ID, &buscfg, SPI_DMA_CH_AUTO));
+    dma_buf = heap_caps_malloc(SPI_DMA_CHUNK, MALLOC_CAP_DMA);
+    if (!dma_buf)
+    {
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+#else
     buscfg.max_transfer_sz = 0;
     //Initialize the SPI bus
     ESP_ERROR_CHECK(spi_bus_initialize(SPI_HOST_ID, &buscfg, SPI_DMA_DISABLED));
+#endif
 
     // Output pins
     io_conf.intr_type = GPIO_INTR_DISABLE;
@@ -85,17 +185,29 @@ void hal_spi_vs1003_init(void)
     io_conf.pull_up_en = 1;
     ESP_ERROR_CHECK(gpio_config(&io_conf));
 
-    // Input pins
+    // Input pins, DREQ going high wakes the task waiting for it
+    io_conf.intr_type = GPIO_INTR_POSEDGE;
     io_conf.mode = GPIO_MODE_INPUT;
     io_conf.pull_up_en = 0;
     io_conf.pin_bit_mask = INPUT_PINS_SEL;
     ESP_ERROR_CHECK(gpio_config(&io_conf));
+    dreq_event = xSemaphoreCreateBinary();
+    if (!dreq_event)
+    {
+        ESP_ERROR_CHECK(ESP_ERR_NO_MEM);
+    }
+    // The service may already be installed by another driver
+    res = gpio_install_isr_service(0);
+    if (res != ESP_ERR_INVALID_STATE)
+    {
+        ESP_ERROR_CHECK(res);
+    }
+    ESP_ERROR_CHECK(gpio_isr_handler_add(GPIO_DREQ, dreq_isr, NULL));
 
     // Interface parameters
-    dev_cfg.clock_speed_hz = SPI_CLK_2MHz;
-    dev_cfg.spics_io_num = GPIO_NOT_USED;
-    dev_cfg.queue_size = 1;
-    ESP_ERROR_CHECK(spi_bus_add_device(SPI_HOST_ID, &dev_cfg, &spi));
+    add_device(SPI_CLK_SLOW, &spi_slow);
+    add_device(SPI_CLK_SCI, &spi_sci);
+    add_device(SPI_CLK_SDI, &spi_sdi);
 }
 
 //--------------------------------------------
@@ -103,30 +215,108 @@ uint8_t hal_spi_vs1003_txrx(uint8_t data)
 {
     spi_transaction_t t = { 0 };
 
+#if SPI_DMA_ENABLED
+    dma_wait();
+#endif
     t.length = 8;
     t.tx_data[0] = data;
     t.flags = SPI_TRANS_USE_TXDATA | SPI_TRANS_USE_RXDATA;
 
     // Start send data
-    ESP_ERROR_CHECK(spi_device_polling_transmit(spi, &t));
+    ESP_ERROR_CHECK(spi_device_polling_transmit(spi_fast ? spi_sci : spi_slow, &t));
 
     return t.rx_data[0];
 }
 
+//--------------------------------------------
+void hal_spi_vs1003_tx_block(uint8_t *buf, size_t size)
+{
+#if SPI_DMA_ENABLED
+    size_t len;
+
+    while (size)
+    {
+        len = size > SPI_DMA_CHUNK ? SPI_DMA_CHUNK : size;
+        // The previous transfer frees the buffer, XDCS stays low
+        if (dma_queued)
+        {
+            xdcs_release = false;
+            dma_wait();
+        }
+        memcpy(dma_buf, buf, len);
+        memset(&dma_trans, 0, sizeof(spi_transaction_t));
+        dma_trans.length = len * 8;
+        dma_trans.tx_buffer = dma_buf;
+
+        // Start send data, returns as soon as the transfer is queued
+        dma_spi = spi_fast ? spi_sdi : spi_slow;
+        ESP_ERROR_CHECK(spi_device_queue_trans(dma_spi, &dma_trans, portMAX_DELAY));
+        dma_queued = true;
+        buf += len;
+        size -= len;
+    }
+#else
+    spi_transaction_t t = { 0 };
+    size_t len;
+
+    while (size)
+    {
+        len = size > SPI_BLOCK_SIZE ? SPI_BLOCK_SIZE : size;
+        t.length = len * 8;
+        t.tx_buffer = buf;
+        t.rx_buffer = NULL;
+
+        // Start send data
+        ESP_ERROR_CHECK(spi_device_polling_transmit(spi_fast ? spi_sdi : spi_slow, &t));
+        buf += len;
+        size -= len;
+    }
+#endif
+}
+
 //--------------------------------------------
 void hal_spi_vs1003_xcs(uint8_t state)
 {
+#if SPI_DMA_ENABLED
+    dma_wait();
+#endif
     gpio_set_level(GPIO_XCS, state);
 }
 
 //--------------------------------------------
 void hal_spi_vs1003_xdcs(uint8_t state)
 {
+#if SPI_DMA_ENABLED
+    if (dma_queued)
+    {
+        // XDCS is still low, it goes high once the burst is out
+        xdcs_release = state;
+        return;
+    }
+#endif
     gpio_set_level(GPIO_XDCS, state);
 }
 
 //--------------------------------------------
 uint8_t hal_spi_vs1003_dreq(void)
 {
+#if SPI_DMA_ENABLED
+    // DREQ only counts the bytes that have reached the codec
+    dma_wait();
+#endif
 	return gpio_get_level(GPIO_DREQ);
 }
+
+//--------------------------------------------
+// returns 0 once DREQ is high, -1 on timeout
+int hal_spi_vs1003_wait_dreq(uint32_t timeout_ms)
+{
+    while (!hal_spi_vs1003_dreq())
+    {
+        if (xSemaphoreTake(dreq_event, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+        {
+            return hal_spi_vs1003_dreq() ? 0 : -1;
+        }
+    }
+    return 0;
+}
@@ -18,9 +18,12 @@
 //--------------------------------------------
 void hal_spi_vs1003_reset(void);
 void hal_spi_vs1003_init(void);
+void hal_spi_vs1003_set_fast(uint8_t state);
 uint8_t hal_spi_vs1003_txrx(uint8_t data);
+void hal_spi_vs1003_tx_block(uint8_t *buf, size_t size);
 void hal_spi_vs1003_xcs(uint8_t state);
 void hal_spi_vs1003_xdcs(uint8_t state);
 uint8_t hal_spi_vs1003_dreq(void);
+int hal_spi_vs1003_wait_dreq(uint32_t timeout_ms);
 
 #endif // HAL_SPI_VS1003_H_
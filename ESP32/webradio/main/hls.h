@@ -0,0 +1,38 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef HLS_H
+#define HLS_H
+
+//--------------------------------------------
+#define HLS_MAX_SEGMENTS           3      // queued at once, a live stream starts that far from its end
+#define HLS_LOCATION_SIZE          256
+
+//--------------------------------------------
+// Follows an HLS media playlist: segments are handed out in order
+// of their media sequence numbers, the playlist is refreshed
+// once the queued ones have been fetched.
+// Every playlist body goes through hls_append as it arrives,
+// a media playlist is not held in the playlist body buffer.
+void hls_begin(const char *location);
+void hls_append(const uint8_t *buf, size_t size);
+void hls_open(void);
+void hls_close(void);
+bool hls_is_open(void);
+bool hls_is_refresh(void);
+int hls_update(void);
+int hls_next(char *location, size_t size);
+uint32_t hls_get_wait_ms(void);
+
+#endif /* HLS_H */
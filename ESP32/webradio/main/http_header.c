@@ -0,0 +1,187 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, strtoul */
+#include <stdbool.h>    /* bool */
+#include <string.h>     /* strncmp, strncasecmp */
+#include "http_header.h"
+
+//--------------------------------------------
+#define HTTP_VER1            "HTTP/1."
+#define ICY_VER              "ICY "     // status line of SHOUTcast v1 servers
+#define HTTP_CHUNKED         "chunked"
+
+//--------------------------------------------
+static bool field_is(const char *line, size_t name_len, const char *name)
+{
+	return name_len == strlen(name) && !strncasecmp(line, name, name_len);
+}
+
+//--------------------------------------------
+// returns false if the value has been cut to fit
+static bool copy_value(char *dst, size_t size, const char *value)
+{
+	memset(dst, 0, size);
+	strncpy(dst, value, size - 1);
+	return strlen(value) < size;
+}
+
+//--------------------------------------------
+// the last coding applied is the one to undo first
+static bool is_chunked(const char *value)
+{
+	size_t len = strlen(value);
+	size_t chunked_len = sizeof(HTTP_CHUNKED) - 1;
+
+	return len >= chunked_len && !strncasecmp(value + len - chunked_len, HTTP_CHUNKED, chunked_len);
+}
+
+//--------------------------------------------
+static int parse_status_line(http_header_t *header)
+{
+	char *str;
+
+	if (strncmp(header->line, HTTP_VER1, sizeof(HTTP_VER1) - 1) &&
+		strncmp(header->line, ICY_VER, sizeof(ICY_VER) - 1))
+	{
+		return -1;
+	}
+	str = strchr(header->line, ' ');
+	header->status = str ? strtoul(str, NULL, 10) : 0;
+	if (!header->status)
+	{
+		return -1;
+	}
+	header->state = http_header_fields;
+	return 0;
+}
+
+//--------------------------------------------
+static int parse_field(http_header_t *header)
+{
+	char *value;
+	size_t name_len;
+
+	if (!header->line_len)
+	{
+		// empty line ends the header
+		header->state = http_header_done;
+		return 0;
+	}
+	value = strchr(header->line, ':');
+	if (!value)
+	{
+		return 0;
+	}
+	name_len = value - header->line;
+	for (value++; *value == ' ' || *value == '\t'; value++);
+	if (field_is(header->line, name_len, "Location"))
+	{
+		header->location_cut = header->line_cut ||
+			!copy_value(header->location, sizeof(header->location), value);
+	}
+	else if (field_is(header->line, name_len, "Content-Type"))
+	{
+		copy_value(header->content_type, sizeof(header->content_type), value);
+	}
+	else if (field_is(header->line, name_len, "Transfer-Encoding"))
+	{
+		header->chunked = is_chunked(value);
+	}
+	else if (field_is(header->line, name_len, "Content-Length"))
+	{
+		header->has_length = true;
+		header->content_length = strtoul(value, NULL, 10);
+	}
+	else if (field_is(header->line, name_len, "Connection"))
+	{
+		header->connection_close = !strncasecmp(value, "close", 5);
+	}
+	else if (field_is(header->line, name_len, "icy-metaint"))
+	{
+		header->icy_metaint = strtoul(value, NULL, 10);
+	}
+	else if (field_is(header->line, name_len, "icy-br"))
+	{
+		header->icy_br = strtoul(value, NULL, 10);
+	}
+	return 0;
+}
+
+//--------------------------------------------
+void http_header_init(http_header_t *header)
+{
+	memset(header, 0, sizeof(http_header_t));
+	header->state = http_header_status_line;
+}
+
+//--------------------------------------------
+// returns the number of header bytes in buf once the header is complete,
+// the rest of buf is body; 0 if the header goes on in the next read;
+// -1 on a malformed or too long header
+int http_header_parse(http_header_t *header, const uint8_t *buf, size_t size)
+{
+	size_t cnt;
+	int res;
+
+	for (cnt = 0; cnt < size && header->state != http_header_done; cnt++)
+	{
+		if (++header->length > HTTP_HEADER_MAX_SIZE)
+		{
+			return -1;
+		}
+		if (buf[cnt] != '\n')
+		{
+			// the tail of an overlong line is dropped
+			if (buf[cnt] != '\r' && header->line_len < sizeof(header->line) - 1)
+			{
+				header->line[header->line_len++] = buf[cnt];
+			}
+			else if (buf[cnt] != '\r')
+			{
+				header->line_cut = true;
+			}
+			continue;
+		}
+		while (header->line_len && (header->line[header->line_len - 1] == ' ' || header->line[header->line_len - 1] == '\t'))
+		{
+			header->line_len--;
+		}
+		header->line[header->line_len] = '\0';
+		if (header->state == http_header_status_line)
+		{
+			res = parse_status_line(header);
+		}
+		else
+		{
+			res = parse_field(header);
+		}
+		if (res < 0)
+		{
+			return -1;
+		}
+		header->line_len = 0;
+		header->line_cut = false;
+	}
+	return header->state == http_header_done ? (int)cnt : 0;
+}
+
+//--------------------------------------------
+bool http_header_is_redirect(http_header_t *header)
+{
+	uint32_t status = header->status;
+
+	return status == 301 || status == 302 || status == 303 || status == 307 || status == 308;
+}
@@ -0,0 +1,60 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef HTTP_HEADER_H
+#define HTTP_HEADER_H
+
+//--------------------------------------------
+#define HTTP_HEADER_LINE_SIZE           320    // longer lines are cut
+#define HTTP_HEADER_MAX_SIZE            8192   // whole response header
+#define HTTP_HEADER_LOCATION_SIZE       256
+#define HTTP_HEADER_CONTENT_TYPE_SIZE   64
+
+//--------------------------------------------
+typedef enum
+{
+	http_header_status_line = 0,
+	http_header_fields,
+	http_header_done
+} http_header_state_t;
+
+//--------------------------------------------
+// Response header parsed line by line as it arrives, so that
+// the header may be split over any number of reads.
+// Only the current line is kept, the fields are taken out of it.
+typedef struct
+{
+	uint32_t status;
+	uint32_t icy_metaint;
+	uint32_t icy_br;
+	bool chunked;
+	bool has_length;
+	uint32_t content_length;
+	bool connection_close;
+	char location[HTTP_HEADER_LOCATION_SIZE];
+	bool location_cut;         // too long for location, not to be followed
+	char content_type[HTTP_HEADER_CONTENT_TYPE_SIZE];
+	http_header_state_t state;
+	char line[HTTP_HEADER_LINE_SIZE];
+	size_t line_len;
+	bool line_cut;
+	size_t length;
+} http_header_t;
+
+//--------------------------------------------
+void http_header_init(http_header_t *header);
+int http_header_parse(http_header_t *header, const uint8_t *buf, size_t size);
+bool http_header_is_redirect(http_header_t *header);
+
+#endif /* HTTP_HEADER_H */
@@ -0,0 +1,92 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t */
+#include <string.h>     /* memcpy */
+#include "icy_demux.h"
+
+//--------------------------------------------
+#define ICY_META_BLOCK_SIZE  16
+
+//--------------------------------------------
+// metaint is 0 for a stream without metadata
+void icy_demux_init(icy_demux_t *demux, size_t metaint, uint8_t *meta_buf, size_t meta_buf_size)
+{
+	demux->metaint = metaint;
+	demux->audio_left = metaint;
+	demux->meta_left = 0;
+	demux->meta_buf = meta_buf;
+	demux->meta_buf_size = meta_buf_size;
+	demux->meta_len = 0;
+}
+
+//--------------------------------------------
+// takes the next span from the start of buf,
+// returns the number of bytes of buf it covers;
+// a length byte and the head of a split metadata block give icy_span_none
+size_t icy_demux_next(icy_demux_t *demux, const uint8_t *buf, size_t size, icy_span_t *span)
+{
+	size_t len;
+	size_t copy_len;
+
+	span->type = icy_span_none;
+	span->data = NULL;
+	span->size = 0;
+	if (!size)
+	{
+		return 0;
+	}
+	if (!demux->metaint || demux->audio_left)
+	{
+		len = size;
+		if (demux->metaint && len > demux->audio_left)
+		{
+			len = demux->audio_left;
+		}
+		if (demux->metaint)
+		{
+			demux->audio_left -= len;
+		}
+		span->type = icy_span_audio;
+		span->data = buf;
+		span->size = len;
+		return len;
+	}
+	if (!demux->meta_left)
+	{
+		// length byte
+		demux->meta_left = (size_t)buf[0] * ICY_META_BLOCK_SIZE;
+		demux->meta_len = 0;
+		if (!demux->meta_left)
+		{
+			demux->audio_left = demux->metaint;
+		}
+		return 1;
+	}
+	len = size > demux->meta_left ? demux->meta_left : size;
+	copy_len = demux->meta_buf_size - demux->meta_len;
+	copy_len = len < copy_len ? len : copy_len;
+	memcpy(demux->meta_buf + demux->meta_len, buf, copy_len);
+	demux->meta_len += copy_len;
+	demux->meta_left -= len;
+	if (!demux->meta_left)
+	{
+		demux->audio_left = demux->metaint;
+		span->type = icy_span_meta;
+		span->data = demux->meta_buf;
+		span->size = demux->meta_len;
+	}
+	return len;
+}
@@ -0,0 +1,445 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, strtoul */
+#include <stdbool.h>    /* bool */
+#include <string.h>     /* memcpy, strncasecmp */
+#include <stdio.h>      /* snprintf */
+#include "playlist.h"
+
+//--------------------------------------------
+#define PLS_HEADER           "[playlist]"
+#define PLS_FILE             "File"
+#define HLS_MEDIA_PLAYLIST   "#EXT-X-TARGETDURATION"
+#define UTF8_BOM             "\xEF\xBB\xBF"
+
+//--------------------------------------------
+static const char *playlist_types[] =
+{
+	"audio/x-scpls",
+	"application/pls+xml",
+	"audio/x-mpegurl",
+	"audio/mpegurl",
+	"application/x-mpegurl",
+	"application/vnd.apple.mpegurl"
+};
+
+//--------------------------------------------
+static const char *playlist_extensions[] =
+{
+	".pls",
+	".m3u",
+	".m3u8"
+};
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t origin_hash;
+	uint32_t used;
+	bool permanent;                       // reached by permanent redirects only
+	char location[PLAYLIST_LOCATION_SIZE];
+} playlist_cache_t;
+
+//--------------------------------------------
+typedef struct
+{
+	char origin[PLAYLIST_LOCATION_SIZE];  // list entry being resolved
+	char base[PLAYLIST_LOCATION_SIZE];    // location of the last playlist
+	char body[PLAYLIST_BODY_SIZE];
+	size_t body_len;
+	bool truncated;
+	uint16_t entries[PLAYLIST_MAX_ENTRIES];
+	size_t entry_count;
+	size_t entry_next;
+	size_t depth;
+	bool from_cache;
+	bool redirected;
+	bool permanent;
+	playlist_cache_t cache[PLAYLIST_CACHE_SIZE];
+	uint32_t cache_clock;
+	bool cache_changed;                   // the permanent entries are to be saved
+} playlist_t;
+static playlist_t playlist;
+
+//--------------------------------------------
+// FNV-1a, the cache keeps hashes of the origins only
+static uint32_t get_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *str; str++)
+	{
+		hash = (hash ^ (uint8_t)*str) * 16777619u;
+	}
+	return hash;
+}
+
+//--------------------------------------------
+static playlist_cache_t *cache_find(uint32_t hash)
+{
+	size_t cnt;
+
+	for (cnt = 0; cnt < PLAYLIST_CACHE_SIZE; cnt++)
+	{
+		if (playlist.cache[cnt].used && playlist.cache[cnt].origin_hash == hash)
+		{
+			return &playlist.cache[cnt];
+		}
+	}
+	return NULL;
+}
+
+//--------------------------------------------
+// the least recently used entry is replaced
+static void cache_put(uint32_t hash, const char *location, size_t len, bool permanent)
+{
+	playlist_cache_t *entry;
+	size_t cnt;
+
+	entry = cache_find(hash);
+	if (!entry)
+	{
+		entry = &playlist.cache[0];
+		for (cnt = 1; cnt < PLAYLIST_CACHE_SIZE; cnt++)
+		{
+			if (playlist.cache[cnt].used < entry->used)
+			{
+				entry = &playlist.cache[cnt];
+			}
+		}
+	}
+	if (entry->permanent || permanent)
+	{
+		playlist.cache_changed = true;
+	}
+	entry->origin_hash = hash;
+	entry->used = ++playlist.cache_clock;
+	entry->permanent = permanent;
+	snprintf(entry->location, sizeof(entry->location), "%.*s", (int)len, location);
+}
+
+//--------------------------------------------
+// the body up to its last complete line as a string
+static char *get_body(void)
+{
+	char *end;
+
+	playlist.body[playlist.body_len] = '\0';
+	if (playlist.truncated)
+	{
+		// the last line may be cut
+		end = strrchr(playlist.body, '\n');
+		playlist.body_len = end ? (size_t)(end - playlist.body) : 0;
+		playlist.body[playlist.body_len] = '\0';
+		playlist.truncated = false;
+	}
+	return playlist.body;
+}
+
+//--------------------------------------------
+// an entry may be relative to the playlist location
+void playlist_resolve(const char *base, const char *entry, char *location, size_t size)
+{
+	const char *host;
+	const char *path;
+	const char *last;
+
+	if (strstr(entry, "://"))
+	{
+		snprintf(location, size, "%s", entry);
+		return;
+	}
+	host = strstr(base, "://");
+	host = host ? host + 3 : base;
+	path = host + strcspn(host, "/?#");
+	if (entry[0] == '/' || *path != '/')
+	{
+		// relative to the host
+		snprintf(location, size, "%.*s%s%s", (int)(path - base), base, entry[0] == '/' ? "" : "/", entry);
+		return;
+	}
+	// relative to the directory of the playlist
+	for (last = path + strcspn(path, "?#"); last[-1] != '/'; last--);
+	snprintf(location, size, "%.*s%s", (int)(last - base), base, entry);
+}
+
+//--------------------------------------------
+// by the content type, or by the extension if the server
+// does not tell an audio type
+bool playlist_is_playlist(const char *content_type, const char *location)
+{
+	size_t cnt;
+	size_t len;
+	size_t ext_len;
+
+	for (cnt = 0; cnt < sizeof(playlist_types) / sizeof(playlist_types[0]); cnt++)
+	{
+		if (!strncasecmp(content_type, playlist_types[cnt], strlen(playlist_types[cnt])))
+		{
+			return true;
+		}
+	}
+	if (!strncasecmp(content_type, "audio/", 6))
+	{
+		return false;
+	}
+	len = strcspn(location, "?#");
+	for (cnt = 0; cnt < sizeof(playlist_extensions) / sizeof(playlist_extensions[0]); cnt++)
+	{
+		ext_len = strlen(playlist_extensions[cnt]);
+		if (len >= ext_len && !strncasecmp(location + len - ext_len, playlist_extensions[cnt], ext_len))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+//--------------------------------------------
+// a list entry is to be played, the entries of
+// the previous playlist are forgotten
+void playlist_set_origin(const char *location)
+{
+	snprintf(playlist.origin, sizeof(playlist.origin), "%s", location);
+	playlist.entry_count = 0;
+	playlist.entry_next = 0;
+	playlist.depth = 0;
+	playlist.from_cache = false;
+	playlist.redirected = false;
+}
+
+//--------------------------------------------
+// the stream resolved from the origin before, -1 if there is none
+int playlist_get_cached(char *location, size_t size)
+{
+	playlist_cache_t *entry;
+
+	entry = cache_find(get_hash(playlist.origin));
+	if (!entry)
+	{
+		return -1;
+	}
+	entry->used = ++playlist.cache_clock;
+	snprintf(location, size, "%s", entry->location);
+	playlist.from_cache = true;
+	playlist.permanent = entry->permanent;
+	return 0;
+}
+
+//--------------------------------------------
+void playlist_open(void)
+{
+	playlist.body_len = 0;
+	playlist.truncated = false;
+}
+
+//--------------------------------------------
+void playlist_append(const uint8_t *buf, size_t size)
+{
+	size_t len;
+
+	// one byte is left for the terminating null
+	len = sizeof(playlist.body) - 1 - playlist.body_len;
+	if (size > len)
+	{
+		playlist.truncated = true;
+		size = len;
+	}
+	memcpy(playlist.body + playlist.body_len, buf, size);
+	playlist.body_len += size;
+}
+
+//--------------------------------------------
+// takes the entries out of the received playlist,
+// returns their number, PLAYLIST_HLS for an HLS media playlist,
+// -1 if there is nothing to play
+int playlist_parse(const char *location)
+{
+	char *body;
+	char *line;
+	char *end;
+	char *value;
+	bool pls;
+
+	playlist.entry_count = 0;
+	playlist.entry_next = 0;
+	playlist.from_cache = false;
+	if (++playlist.depth > PLAYLIST_MAX_DEPTH)
+	{
+		return -1;
+	}
+	snprintf(playlist.base, sizeof(playlist.base), "%s", location);
+	body = get_body();
+	if (strstr(body, HLS_MEDIA_PLAYLIST))
+	{
+		// segments are not streams, the body is left for the HLS client
+		return PLAYLIST_HLS;
+	}
+	if (!strncmp(body, UTF8_BOM, sizeof(UTF8_BOM) - 1))
+	{
+		body += sizeof(UTF8_BOM) - 1;
+	}
+	body += strspn(body, " \t\r\n");
+	pls = !strncasecmp(body, PLS_HEADER, sizeof(PLS_HEADER) - 1);
+	for (line = body; line < playlist.body + playlist.body_len; line = end + 1)
+	{
+		end = line + strcspn(line, "\n");
+		*end = '\0';
+		for (value = end; value > line && (value[-1] == '\r' || value[-1] == ' ' || value[-1] == '\t'); value--);
+		*value = '\0';
+		line += strspn(line, " \t");
+		if (pls)
+		{
+			// File1=http://...
+			value = strchr(line, '=');
+			if (strncasecmp(line, PLS_FILE, sizeof(PLS_FILE) - 1) || !value)
+			{
+				continue;
+			}
+			line = value + 1;
+		}
+		else if (line[0] == '#')
+		{
+			continue;
+		}
+		if (line[0] && playlist.entry_count < PLAYLIST_MAX_ENTRIES)
+		{
+			playlist.entries[playlist.entry_count++] = (uint16_t)(line - playlist.body);
+		}
+	}
+	return playlist.entry_count ? (int)playlist.entry_count : -1;
+}
+
+//--------------------------------------------
+// the next location to try for the origin: the next playlist entry,
+// or the origin itself once its cached stream has failed;
+// -1 if nothing is left
+int playlist_next(char *location, size_t size)
+{
+	playlist_cache_t *entry;
+
+	if (playlist.from_cache)
+	{
+		entry = cache_find(get_hash(playlist.origin));
+		if (entry)
+		{
+			playlist.cache_changed |= entry->permanent;
+			entry->used = 0;
+			entry->permanent = false;
+		}
+		playlist.from_cache = false;
+		playlist.redirected = false;
+		snprintf(location, size, "%s", playlist.origin);
+		return 0;
+	}
+	if (playlist.entry_next >= playlist.entry_count)
+	{
+		return -1;
+	}
+	playlist_resolve(playlist.base, playlist.body + playlist.entries[playlist.entry_next++], location, size);
+	return 0;
+}
+
+//--------------------------------------------
+// the received body as a string, valid up to the next playlist_open
+const char *playlist_get_body(void)
+{
+	return get_body();
+}
+
+//--------------------------------------------
+// the location answered with a redirect, the chain from the origin
+// is permanent if all its redirects are, a cached part included
+void playlist_redirected(bool permanent)
+{
+	if (!playlist.redirected && !playlist.from_cache)
+	{
+		playlist.permanent = true;
+	}
+	playlist.permanent = playlist.permanent && permanent;
+	playlist.redirected = true;
+}
+
+//--------------------------------------------
+// the stream has started, later tunes of the origin go straight to it
+void playlist_resolved(const char *location)
+{
+	if (!playlist.depth && !playlist.redirected)
+	{
+		// no playlist or redirect on the way
+		return;
+	}
+	// the content of a playlist may change, it is not kept over a reboot
+	cache_put(get_hash(playlist.origin), location, strlen(location), playlist.redirected && playlist.permanent && !playlist.depth);
+	playlist.entry_count = 0;
+	playlist.entry_next = 0;
+	playlist.depth = 0;
+	playlist.redirected = false;
+}
+
+//--------------------------------------------
+// true if the permanent entries have changed since the last playlist_cache_save
+bool playlist_cache_is_changed(void)
+{
+	return playlist.cache_changed;
+}
+
+//--------------------------------------------
+// the permanent entries as hash=location lines,
+// returns the length of the text
+size_t playlist_cache_save(char *buf, size_t size)
+{
+	size_t cnt;
+	size_t len = 0;
+	int res;
+
+	for (cnt = 0; cnt < PLAYLIST_CACHE_SIZE; cnt++)
+	{
+		if (!playlist.cache[cnt].used || !playlist.cache[cnt].permanent)
+		{
+			continue;
+		}
+		res = snprintf(buf + len, size - len, "%08lx=%s\r\n", (unsigned long)playlist.cache[cnt].origin_hash, playlist.cache[cnt].location);
+		if (res < 0 || (size_t)res >= size - len)
+		{
+			break;
+		}
+		len += res;
+	}
+	playlist.cache_changed = false;
+	return len;
+}
+
+//--------------------------------------------
+// the entries saved by playlist_cache_save, buf is a string
+void playlist_cache_load(const char *buf)
+{
+	const char *line;
+	const char *end;
+	char *value;
+	uint32_t hash;
+
+	for (line = buf; *line; line = end + strspn(end, "\r\n"))
+	{
+		end = line + strcspn(line, "\r\n");
+		hash = strtoul(line, &value, 16);
+		if (*value == '=' && value + 1 < end)
+		{
+			cache_put(hash, value + 1, end - value - 1, true);
+		}
+	}
+	playlist.cache_changed = false;
+}
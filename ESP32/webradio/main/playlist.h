@@ -0,0 +1,50 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+//--------------------------------------------
+#define PLAYLIST_BODY_SIZE         2048   // the tail of a longer playlist is dropped, hls_append takes all of it
+#define PLAYLIST_MAX_ENTRIES       8
+#define PLAYLIST_MAX_DEPTH         3      // playlists of playlists
+#define PLAYLIST_LOCATION_SIZE     256
+#define PLAYLIST_CACHE_SIZE        4
+#define PLAYLIST_CACHE_TEXT_SIZE   (PLAYLIST_CACHE_SIZE * (PLAYLIST_LOCATION_SIZE + 11))
+
+//--------------------------------------------
+#define PLAYLIST_HLS               -2     // playlist_parse: an HLS media playlist
+
+//--------------------------------------------
+// A list entry (the origin) may be a .pls/.m3u/.m3u8 playlist.
+// Its entries are tried in order, and the stream that plays
+// is cached against the origin, so later tunes connect to it at once.
+// So is the target of a redirect; those reached by permanent (301/308)
+// redirects only are saved with playlist_cache_save to outlive a reboot.
+bool playlist_is_playlist(const char *content_type, const char *location);
+void playlist_set_origin(const char *location);
+int playlist_get_cached(char *location, size_t size);
+void playlist_open(void);
+void playlist_append(const uint8_t *buf, size_t size);
+int playlist_parse(const char *location);
+int playlist_next(char *location, size_t size);
+const char *playlist_get_body(void);
+void playlist_resolve(const char *base, const char *entry, char *location, size_t size);
+void playlist_redirected(bool permanent);
+void playlist_resolved(const char *location);
+bool playlist_cache_is_changed(void);
+size_t playlist_cache_save(char *buf, size_t size);
+void playlist_cache_load(const char *buf);
+
+#endif /* PLAYLIST_H */
@@ -16,15 +16,38 @@
 #define RING_BUF_H
 
 //--------------------------------------------
+// Single-producer/single-consumer ring buffer without locks.
+// head is written only by the producer (put, clear),
+// tail is written only by the consumer (get).
+// Both indices run over [0, 2 * length) so that a full buffer
+// can be told apart from an empty one without a shared counter.
+// A side that has to wait publishes its watermark in read_wanted or
+// write_wanted and sleeps on its event until the other side reaches it.
+// bytes_in and stalls are counted by the producer, bytes_out by the consumer.
+// A resize is requested by the producer and carried out by the consumer,
+// which moves the buffered bytes; the producer writes nothing until
+// resize_ack catches up with resize_seq.
 typedef struct
 {
 	uint8_t *buffer;
 	size_t length;
-	size_t count;
-	size_t head;
-	size_t tail;
+	volatile size_t head;
+	volatile size_t tail;
+	volatile size_t flush_pos;
+	volatile size_t flush_seq;
+	size_t flush_ack;
 	size_t max_count;
-	pthread_mutex_t mutex;
+	volatile size_t read_wanted;
+	volatile size_t write_wanted;
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint32_t stalls;
+	volatile size_t resize_length;
+	volatile size_t resize_seq;
+	volatile size_t resize_ack;
+	size_t resize_seen;
+	SemaphoreHandle_t data_event;
+	SemaphoreHandle_t space_event;
 	int valid;
 } ring_buf_t;
 
@@ -33,7 +56,18 @@ int ring_buf_init(ring_buf_t *ring_buf, uint8_t *buf, size_t size);
 int ring_buf_clear(ring_buf_t *ring_buf);
 int ring_buf_put(ring_buf_t *ring_buf, uint8_t *buf, size_t size);
 int ring_buf_get(ring_buf_t *ring_buf, uint8_t *buf, size_t size);
+int ring_buf_reserve_write(ring_buf_t *ring_buf, uint8_t **buf);
+int ring_buf_commit_write(ring_buf_t *ring_buf, size_t size);
+int ring_buf_peek_read(ring_buf_t *ring_buf, uint8_t **buf);
+int ring_buf_consume(ring_buf_t *ring_buf, size_t size);
+int ring_buf_wait_read(ring_buf_t *ring_buf, size_t size, uint32_t timeout_ms);
+int ring_buf_wait_write(ring_buf_t *ring_buf, size_t size, uint32_t timeout_ms);
+int ring_buf_request_resize(ring_buf_t *ring_buf, size_t size);
+int ring_buf_get_resize(ring_buf_t *ring_buf);
+int ring_buf_resize(ring_buf_t *ring_buf, uint8_t *buf, size_t size);
+int ring_buf_get_length(ring_buf_t *ring_buf);
+int ring_buf_get_count(ring_buf_t *ring_buf);
 int ring_buf_get_percentage_fill(ring_buf_t *ring_buf);
 int ring_buf_destroy(ring_buf_t *ring_buf);
 
-#endif /* RING_BUF_H */
\ No newline at end of file
+#endif /* RING_BUF_H */
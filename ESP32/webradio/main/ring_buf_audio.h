@@ -15,11 +15,59 @@
 #ifndef RING_BUF_AUDIO_H
 #define RING_BUF_AUDIO_H
 
+//--------------------------------------------
+#define RING_BUF_AUDIO_FILL_BINS   8
+
+//--------------------------------------------
+typedef enum
+{
+	ring_buf_audio_stage_tcp = 0,
+	ring_buf_audio_stage_feed,
+	ring_buf_audio_stage_play,
+	ring_buf_audio_stages
+} ring_buf_audio_stage_t;
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint32_t stalls;
+	uint32_t underruns;
+	uint32_t length;
+	uint32_t max_count;
+	int fill_percentage;
+	uint32_t fill_hist[RING_BUF_AUDIO_FILL_BINS];
+	uint32_t max_gap_ms[ring_buf_audio_stages];
+} ring_buf_audio_stats_t;
+
 //--------------------------------------------
 int ring_buf_audio_init(void);
 int ring_buf_audio_clear(void);
 int ring_buf_audio_put(uint8_t *buf, size_t size);
 int ring_buf_audio_get(uint8_t *buf, size_t size);
+int ring_buf_audio_reserve_write(uint8_t **buf);
+int ring_buf_audio_commit_write(size_t size);
+int ring_buf_audio_peek_read(uint8_t **buf);
+int ring_buf_audio_consume(size_t size);
+int ring_buf_audio_wait_read(size_t size, uint32_t timeout_ms);
+int ring_buf_audio_wait_write(size_t size, uint32_t timeout_ms);
+int ring_buf_audio_get_length(void);
+int ring_buf_audio_get_count(void);
+void ring_buf_audio_set_watermarks(uint32_t start_ms, uint32_t high_ms, uint32_t low_ms);
+void ring_buf_audio_get_watermarks(uint32_t *start_ms, uint32_t *high_ms, uint32_t *low_ms);
+void ring_buf_audio_set_bitrate(uint32_t bitrate_kbps);
+void ring_buf_audio_detect_bitrate(uint8_t *buf, size_t size);
+void ring_buf_audio_set_decoded_bitrate(uint32_t bitrate_kbps);
+int ring_buf_audio_apply_resize(void);
+int ring_buf_audio_get_start_level(void);
+int ring_buf_audio_get_stop_level(void);
+int ring_buf_audio_start_playing(void);
+int ring_buf_audio_is_new_stream(void);
+void ring_buf_audio_stop_playing(void);
+void ring_buf_audio_mark_stage(ring_buf_audio_stage_t stage);
+void ring_buf_audio_sample_fill(void);
+void ring_buf_audio_get_stats(ring_buf_audio_stats_t *audio_stats);
 int ring_buf_audio_get_percentage_fill(void);
 int ring_buf_audio_destroy(void);
 
@@ -0,0 +1,231 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t */
+#include <stdbool.h>    /* bool */
+#include <string.h>     /* memcpy, memchr */
+#include "ts_demux.h"
+
+//--------------------------------------------
+#define TS_SYNC_BYTE         0x47
+#define TS_PAT_PID           0x0000
+#define TS_PAT_TABLE_ID      0x00
+#define TS_PMT_TABLE_ID      0x02
+#define TS_CRC_SIZE          4
+#define PES_HEADER_SIZE      9
+
+//--------------------------------------------
+// stream types the decoder plays
+static bool is_audio(uint8_t stream_type)
+{
+	return stream_type == 0x03 ||   // MPEG-1 audio
+		stream_type == 0x04 ||      // MPEG-2 audio
+		stream_type == 0x0F;        // AAC with ADTS
+}
+
+//--------------------------------------------
+static uint16_t get_pid(const uint8_t *buf)
+{
+	return ((buf[0] & 0x1F) << 8) | buf[1];
+}
+
+//--------------------------------------------
+// a PSI section that starts in this payload,
+// returns its length without the CRC, 0 if it is not usable
+static size_t get_section(const uint8_t **payload, size_t size, uint8_t table_id)
+{
+	const uint8_t *section;
+	size_t len;
+
+	if (!size || (size_t)(*payload)[0] + 1 >= size)
+	{
+		return 0;
+	}
+	// pointer field
+	section = *payload + 1 + (*payload)[0];
+	size -= 1 + (*payload)[0];
+	if (size < 3 || section[0] != table_id)
+	{
+		return 0;
+	}
+	len = 3 + (((section[1] & 0x0F) << 8) | section[2]);
+	if (len < TS_CRC_SIZE)
+	{
+		return 0;
+	}
+	len -= TS_CRC_SIZE;
+	*payload = section;
+	// sections beyond one packet are cut
+	return len < size ? len : size;
+}
+
+//--------------------------------------------
+// the PMT of the first program
+static void parse_pat(ts_demux_t *demux, const uint8_t *payload, size_t size)
+{
+	size_t len;
+	size_t pos;
+
+	len = get_section(&payload, size, TS_PAT_TABLE_ID);
+	for (pos = 8; pos + 4 <= len; pos += 4)
+	{
+		// program 0 is the network PID
+		if (payload[pos] || payload[pos + 1])
+		{
+			demux->pmt_pid = get_pid(payload + pos + 2);
+			return;
+		}
+	}
+}
+
+//--------------------------------------------
+// the first audio stream of the program
+static void parse_pmt(ts_demux_t *demux, const uint8_t *payload, size_t size)
+{
+	size_t len;
+	size_t pos;
+
+	len = get_section(&payload, size, TS_PMT_TABLE_ID);
+	if (len < 12)
+	{
+		return;
+	}
+	pos = 12 + (((payload[10] & 0x0F) << 8) | payload[11]);
+	for (; pos + 5 <= len; pos += 5 + (((payload[pos + 3] & 0x0F) << 8) | payload[pos + 4]))
+	{
+		if (is_audio(payload[pos]))
+		{
+			demux->audio_pid = get_pid(payload + pos + 1);
+			return;
+		}
+	}
+}
+
+//--------------------------------------------
+static void parse_packet(ts_demux_t *demux, const uint8_t *packet, const uint8_t **data, size_t *data_size)
+{
+	uint16_t pid;
+	size_t pos = 4;
+	bool unit_start;
+
+	pid = get_pid(packet + 1);
+	unit_start = packet[1] & 0x40;
+	if ((packet[1] & 0x80) || !(packet[3] & 0x10))
+	{
+		// transport error or no payload
+		return;
+	}
+	if (packet[3] & 0x20)
+	{
+		// adaptation field
+		pos += 1 + packet[4];
+	}
+	if (pos >= TS_PACKET_SIZE)
+	{
+		return;
+	}
+	if (pid == TS_PAT_PID)
+	{
+		if (unit_start)
+		{
+			parse_pat(demux, packet + pos, TS_PACKET_SIZE - pos);
+		}
+		return;
+	}
+	if (demux->pmt_pid && pid == demux->pmt_pid)
+	{
+		if (unit_start)
+		{
+			parse_pmt(demux, packet + pos, TS_PACKET_SIZE - pos);
+		}
+		return;
+	}
+	if (!demux->audio_pid || pid != demux->audio_pid)
+	{
+		return;
+	}
+	if (unit_start)
+	{
+		// PES header, a packet it does not fit in is dropped
+		if (pos + PES_HEADER_SIZE > TS_PACKET_SIZE ||
+			packet[pos] || packet[pos + 1] || packet[pos + 2] != 1)
+		{
+			return;
+		}
+		pos += PES_HEADER_SIZE + packet[pos + 8];
+		if (pos >= TS_PACKET_SIZE)
+		{
+			return;
+		}
+	}
+	*data = packet + pos;
+	*data_size = TS_PACKET_SIZE - pos;
+}
+
+//--------------------------------------------
+void ts_demux_init(ts_demux_t *demux)
+{
+	memset(demux, 0, sizeof(ts_demux_t));
+	demux->mode = ts_demux_unknown;
+}
+
+//--------------------------------------------
+// takes the next packet from the start of buf,
+// returns the number of bytes of buf it covers;
+// data points to the audio of the packet, data_size is 0 if there is none
+size_t ts_demux_next(ts_demux_t *demux, const uint8_t *buf, size_t size, const uint8_t **data, size_t *data_size)
+{
+	const uint8_t *sync;
+	size_t len;
+
+	*data = NULL;
+	*data_size = 0;
+	if (!size)
+	{
+		return 0;
+	}
+	if (demux->mode == ts_demux_unknown)
+	{
+		demux->mode = buf[0] == TS_SYNC_BYTE ? ts_demux_ts : ts_demux_raw;
+	}
+	if (demux->mode == ts_demux_raw)
+	{
+		*data = buf;
+		*data_size = size;
+		return size;
+	}
+	if (!demux->packet_len && buf[0] != TS_SYNC_BYTE)
+	{
+		// lost sync
+		sync = memchr(buf + 1, TS_SYNC_BYTE, size - 1);
+		return sync ? (size_t)(sync - buf) : size;
+	}
+	if (!demux->packet_len && size >= TS_PACKET_SIZE)
+	{
+		parse_packet(demux, buf, data, data_size);
+		return TS_PACKET_SIZE;
+	}
+	// a packet split over reads
+	len = TS_PACKET_SIZE - demux->packet_len;
+	len = size < len ? size : len;
+	memcpy(demux->packet + demux->packet_len, buf, len);
+	demux->packet_len += len;
+	if (demux->packet_len == TS_PACKET_SIZE)
+	{
+		demux->packet_len = 0;
+		parse_packet(demux, demux->packet, data, data_size);
+	}
+	return len;
+}
@@ -12,6 +12,12 @@
 * GNU General Public License for more details.
 */
 
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_log.h"
 #include "lwip/err.h"
 #include "lwip/sys.h"
@@ -23,6 +29,9 @@
 #define TLS_USING_OPENSSL     0
 #define TLS_USING_MBEDTLS     1
 
+// small records and a short cipher list for a chip with a small heap
+#define TLS_LOW_MEMORY        0
+
 #if !TLS_USING_OPENSSL && !TLS_USING_MBEDTLS
 #pragma GCC error "You must select ssl/tls library"
 #endif
@@ -45,26 +54,343 @@
 //--------------------------------------------
 static const char* TAG = "wrsocket";
 
+//--------------------------------------------
+#define TLS_RECORD_WAIT_MS    1000
+
 //--------------------------------------------
 void delay_ms(uint32_t time_ms);
 
 //--------------------------------------------
+// TLS state of one secure connection, looked up by its socket descriptor.
+// Plain sockets have no context and go straight to lwip.
+typedef struct
+{
+    int fd;
+#if TLS_USING_OPENSSL
+    SSL_CTX *ctx;
+    SSL *ssl;
+#elif TLS_USING_MBEDTLS
+    mbedtls_ssl_context ssl;
+    mbedtls_net_context server_fd;
+#endif
+} wr_conn_t;
+
+#if TLS_USING_MBEDTLS
+//--------------------------------------------
+// Seeded and configured once, shared by all secure connections.
+// MBEDTLS_THREADING_C is off, so the DRBG is used under tls_lock.
+typedef struct
+{
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_x509_crt cacert;
+    mbedtls_ssl_config conf;
+    bool valid;
+} wr_tls_t;
+static wr_tls_t tls;
+
+//--------------------------------------------
+// Last session per server for abbreviated handshakes on reconnects
+#define WR_SESSION_CACHE_SIZE  4
+typedef struct
+{
+    bool valid;
+    struct in_addr addr;
+    in_port_t port;
+    uint32_t used;
+    mbedtls_ssl_session session;
+} wr_session_t;
+static wr_session_t sessions[WR_SESSION_CACHE_SIZE];
+static uint32_t sessions_used;
+
+//--------------------------------------------
+static pthread_mutex_t tls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#if TLS_LOW_MEMORY
+//--------------------------------------------
+// AES-GCM with ECDHE first, ECDSA before RSA as it is cheaper to verify,
+// AES-CBC and RSA key exchange only for servers without those
+static const int tls_ciphersuites[] =
+{
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA256,
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_CBC_SHA,
+    MBEDTLS_TLS_RSA_WITH_AES_128_GCM_SHA256,
+    MBEDTLS_TLS_RSA_WITH_AES_128_CBC_SHA,
+    0
+};
+
+//--------------------------------------------
+static const mbedtls_ecp_group_id tls_curves[] =
+{
+    MBEDTLS_ECP_DP_CURVE25519,
+    MBEDTLS_ECP_DP_SECP256R1,
+    MBEDTLS_ECP_DP_SECP384R1,
+    MBEDTLS_ECP_DP_NONE
+};
+#endif
+#endif
+
+//--------------------------------------------
+// stream, prefetch and playlist connections at the same time
+#define WR_MAX_SECURE_SOCKETS  3
+
+static wr_conn_t *conns[WR_MAX_SECURE_SOCKETS];
+static portMUX_TYPE conns_mux = portMUX_INITIALIZER_UNLOCKED;
+
+//--------------------------------------------
+// returns 0 if the connection got a slot, -1 if all are in use
+static int conn_add(wr_conn_t *conn)
+{
+    int res = -1;
+
+    taskENTER_CRITICAL(&conns_mux);
+    for (size_t cnt = 0; cnt < WR_MAX_SECURE_SOCKETS; cnt++)
+    {
+        if (!conns[cnt])
+        {
+            conns[cnt] = conn;
+            res = 0;
+            break;
+        }
+    }
+    taskEXIT_CRITICAL(&conns_mux);
+    return res;
+}
+
+//--------------------------------------------
+static void conn_remove(wr_conn_t *conn)
+{
+    taskENTER_CRITICAL(&conns_mux);
+    for (size_t cnt = 0; cnt < WR_MAX_SECURE_SOCKETS; cnt++)
+    {
+        if (conns[cnt] == conn)
+        {
+            conns[cnt] = NULL;
+        }
+    }
+    taskEXIT_CRITICAL(&conns_mux);
+}
+
+//--------------------------------------------
+// NULL for a plain socket
+static wr_conn_t *conn_find(int s)
+{
+    wr_conn_t *conn;
+
+    for (size_t cnt = 0; cnt < WR_MAX_SECURE_SOCKETS; cnt++)
+    {
+        conn = conns[cnt];
+        if (conn && conn->fd == s)
+        {
+            return conn;
+        }
+    }
+    return NULL;
+}
+
+//--------------------------------------------
+static void conn_free(wr_conn_t *conn)
+{
 #if TLS_USING_OPENSSL
-static SSL_CTX *ctx;
-static SSL *ssl;
+    if (conn->ssl)
+    {
+        SSL_shutdown(conn->ssl);
+        SSL_free(conn->ssl);
+    }
+    if (conn->ctx)
+    {
+        SSL_CTX_free(conn->ctx);
+    }
 #elif TLS_USING_MBEDTLS
-static mbedtls_entropy_context entropy;
-static mbedtls_ctr_drbg_context ctr_drbg;
-static mbedtls_ssl_context ssl;
-static mbedtls_x509_crt cacert;
-static mbedtls_ssl_config conf;
-static mbedtls_net_context server_fd;
-static bool mbedtls_init = false;
+    mbedtls_net_free(&conn->server_fd);
+    mbedtls_ssl_free(&conn->ssl);
+#endif
+    free(conn);
+}
+
+#if TLS_USING_MBEDTLS
+//--------------------------------------------
+static int tls_random(void *p_rng, unsigned char *output, size_t output_len)
+{
+    int res;
+
+    pthread_mutex_lock(&tls_lock);
+    res = mbedtls_ctr_drbg_random(p_rng, output, output_len);
+    pthread_mutex_unlock(&tls_lock);
+    return res;
+}
+
+//--------------------------------------------
+// returns 0 once the shared context is ready
+static int tls_init(void)
+{
+    int res = 0;
+
+    pthread_mutex_lock(&tls_lock);
+    if (tls.valid)
+    {
+        goto exit;
+    }
+    mbedtls_ssl_config_init(&tls.conf);
+    mbedtls_x509_crt_init(&tls.cacert);
+    mbedtls_ctr_drbg_init(&tls.ctr_drbg);
+    mbedtls_entropy_init(&tls.entropy);
+    if (mbedtls_ctr_drbg_seed(&tls.ctr_drbg, mbedtls_entropy_func, &tls.entropy, NULL, 0) != 0)
+    {
+        res = -2;
+        goto fail;
+    }
+    if (mbedtls_ssl_config_defaults(&tls.conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
+    {
+        res = -3;
+        goto fail;
+    }
+#if 0
+    res = mbedtls_x509_crt_parse(&tls.cacert, (const unsigned char *) mbedtls_test_cas_pem, mbedtls_test_cas_pem_len);
+    if (res < 0)
+    {
+        res = -4;
+        goto fail;
+    }
+#endif
+    mbedtls_ssl_conf_authmode(&tls.conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    mbedtls_ssl_conf_ca_chain(&tls.conf, &tls.cacert, NULL);
+    mbedtls_ssl_conf_rng(&tls.conf, tls_random, &tls.ctr_drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&tls.conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#if TLS_LOW_MEMORY
+    mbedtls_ssl_conf_ciphersuites(&tls.conf, tls_ciphersuites);
+    mbedtls_ssl_conf_curves(&tls.conf, tls_curves);
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    // servers that honour the extension send records of at most 4 KB,
+    // so the dynamic input buffer stays at that size
+    mbedtls_ssl_conf_max_frag_len(&tls.conf, MBEDTLS_SSL_MAX_FRAG_LEN_4096);
+#endif
 #endif
+    tls.valid = true;
+    goto exit;
+fail:
+    mbedtls_x509_crt_free(&tls.cacert);
+    mbedtls_ssl_config_free(&tls.conf);
+    mbedtls_ctr_drbg_free(&tls.ctr_drbg);
+    mbedtls_entropy_free(&tls.entropy);
+exit:
+    pthread_mutex_unlock(&tls_lock);
+    return res;
+}
+
+//--------------------------------------------
+// called under tls_lock, NULL if the server has no cached session
+static wr_session_t *session_find(const struct sockaddr *name)
+{
+    const struct sockaddr_in *addr = (const struct sockaddr_in *)name;
+
+    if (name->sa_family != AF_INET)
+    {
+        return NULL;
+    }
+    for (size_t cnt = 0; cnt < WR_SESSION_CACHE_SIZE; cnt++)
+    {
+        if (sessions[cnt].valid &&
+            sessions[cnt].addr.s_addr == addr->sin_addr.s_addr &&
+            sessions[cnt].port == addr->sin_port)
+        {
+            return &sessions[cnt];
+        }
+    }
+    return NULL;
+}
+
+//--------------------------------------------
+// offers the cached session to the server, a refusal ends in a full handshake
+static void session_load(mbedtls_ssl_context *ssl, const struct sockaddr *name)
+{
+    wr_session_t *entry;
+
+    pthread_mutex_lock(&tls_lock);
+    entry = session_find(name);
+    if (entry && mbedtls_ssl_set_session(ssl, &entry->session) == 0)
+    {
+        ESP_LOGI(TAG, "Resume TLS session ...");
+    }
+    pthread_mutex_unlock(&tls_lock);
+}
+
+//--------------------------------------------
+// keeps the session of a completed handshake in place of the oldest one
+static void session_save(mbedtls_ssl_context *ssl, const struct sockaddr *name)
+{
+    const struct sockaddr_in *addr = (const struct sockaddr_in *)name;
+    wr_session_t *entry;
+
+    if (name->sa_family != AF_INET)
+    {
+        return;
+    }
+    pthread_mutex_lock(&tls_lock);
+    entry = session_find(name);
+    if (!entry)
+    {
+        entry = &sessions[0];
+        for (size_t cnt = 1; cnt < WR_SESSION_CACHE_SIZE; cnt++)
+        {
+            if (!sessions[cnt].valid || sessions[cnt].used < entry->used)
+            {
+                entry = &sessions[cnt];
+            }
+        }
+    }
+    if (entry->valid)
+    {
+        mbedtls_ssl_session_free(&entry->session);
+    }
+    mbedtls_ssl_session_init(&entry->session);
+    entry->valid = mbedtls_ssl_get_session(ssl, &entry->session) == 0;
+    entry->addr = addr->sin_addr;
+    entry->port = addr->sin_port;
+    entry->used = ++sessions_used;
+    pthread_mutex_unlock(&tls_lock);
+}
+
+//--------------------------------------------
+static void session_drop(const struct sockaddr *name)
+{
+    wr_session_t *entry;
+
+    pthread_mutex_lock(&tls_lock);
+    entry = session_find(name);
+    if (entry)
+    {
+        mbedtls_ssl_session_free(&entry->session);
+        entry->valid = false;
+    }
+    pthread_mutex_unlock(&tls_lock);
+}
+#endif
+
+//--------------------------------------------
+// returns >0 if the socket is readable, 0 on timeout, <0 on error
+static int wait_readable(int s, uint32_t timeout_ms)
+{
+    fd_set rfds;
+    struct timeval tv;
+
+    FD_ZERO(&rfds);
+    FD_SET(s, &rfds);
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return select(s + 1, &rfds, NULL, NULL, &tv);
+}
 
 //--------------------------------------------
 int wr_socket(int domain, int type, int protocol)
 {
+    wr_conn_t *conn;
     int res = 0;
 
     if (domain != AF_INET || protocol != IPPROTO_IP)
@@ -76,168 +402,156 @@ int wr_socket(int domain, int type, int protocol)
         case WR_HTTP_SOCKET:
             return socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
         case WR_HTTPS_SOCKET:
-#if TLS_USING_OPENSSL
-        {
-            int sock;
-            ESP_LOGI(TAG, "Create SSL context ...");
-            ctx = SSL_CTX_new(TLSv1_1_client_method());
-            if (!ctx)
+            conn = calloc(1, sizeof(wr_conn_t));
+            if (!conn)
             {
-                ESP_LOGE(TAG, "failed");
                 return -2;
             }
-            SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
-            ESP_LOGI(TAG, "Create socket ...");
-            sock = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-            if (sock < 0)
-            {
-                SSL_CTX_free(ctx);
-                ESP_LOGE(TAG, "failed");
-                return sock;
-            }
-            return sock;
-        }
-#elif TLS_USING_MBEDTLS
+            conn->fd = -1;
+#if TLS_USING_OPENSSL
             ESP_LOGI(TAG, "Create SSL context ...");
-            mbedtls_net_init(&server_fd);
-            mbedtls_ssl_init(&ssl);
-            mbedtls_ssl_config_init(&conf);
-            mbedtls_entropy_init(&entropy);
-            if (mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0) != 0)
+            conn->ctx = SSL_CTX_new(TLSv1_1_client_method());
+            if (!conn->ctx)
             {
                 res = -2;
                 goto exit;
             }
-            if (mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT) != 0)
-            {
-                res = -3;
-                goto exit;
-            }
-#if 0
-            res = mbedtls_x509_crt_parse(&cacert, (const unsigned char *) mbedtls_test_cas_pem, mbedtls_test_cas_pem_len);
+            SSL_CTX_set_verify(conn->ctx, SSL_VERIFY_NONE, NULL);
+#elif TLS_USING_MBEDTLS
+            ESP_LOGI(TAG, "Create SSL context ...");
+            mbedtls_net_init(&conn->server_fd);
+            mbedtls_ssl_init(&conn->ssl);
+            res = tls_init();
             if (res < 0)
             {
-                res = -4;
                 goto exit;
             }
-#endif
-            mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
-            mbedtls_ssl_conf_ca_chain(&conf, &cacert, NULL);
-            mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
-            if (mbedtls_ssl_setup(&ssl, &conf) != 0)
+            if (mbedtls_ssl_setup(&conn->ssl, &tls.conf) != 0)
             {
                 res = -5;
                 goto exit;
             }
+#endif
             ESP_LOGI(TAG, "Create socket ...");
-            server_fd.fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
-            if (server_fd.fd < 0)
+            conn->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+            if (conn->fd < 0)
             {
-                res = server_fd.fd;
+                res = conn->fd;
                 goto exit;
             }
-            mbedtls_init = true;
-            return server_fd.fd;
+#if TLS_USING_MBEDTLS
+            conn->server_fd.fd = conn->fd;
 #endif
+            if (conn_add(conn) < 0)
+            {
+                close(conn->fd);
+                res = -6;
+                goto exit;
+            }
+            return conn->fd;
         default:
             return -1;
     }
-#if TLS_USING_OPENSSL
-#elif TLS_USING_MBEDTLS
 exit:
     ESP_LOGE(TAG, "failed");
-    mbedtls_net_free(&server_fd);
-    mbedtls_x509_crt_free(&cacert);
-    mbedtls_ssl_free(&ssl);
-    mbedtls_ssl_config_free(&conf);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
-    mbedtls_init = false;
-    return res;
+#if TLS_USING_MBEDTLS
+    // the descriptor is not owned by mbedtls_net_free() here
+    conn->server_fd.fd = -1;
 #endif
+    conn_free(conn);
+    return res;
 }
 
 //--------------------------------------------
 int wr_connect(int s, const struct sockaddr *name, socklen_t namelen)
 {
+    wr_conn_t *conn;
     int res;
+
     res = connect(s, name, namelen);
     if (res < 0)
     {
         return res;
     }
+    conn = conn_find(s);
+    if (!conn)
+    {
+        return res;
+    }
 #if TLS_USING_OPENSSL
-    if (ctx)
+    ESP_LOGI(TAG, "Create SSL ...");
+    conn->ssl = SSL_new(conn->ctx);
+    if (!conn->ssl)
     {
-        ESP_LOGI(TAG, "Create SSL ...");
-        ssl = SSL_new(ctx);
-        if (!ssl)
-        {
-            SSL_CTX_free(ctx);
-            ctx = NULL;
-            close(s);
-            ESP_LOGI(TAG, "failed");
-            return -1;
-        }
-        if (SSL_set_fd(ssl, s) != 1)
-        {
-            return -2;
-        }
-        if (SSL_connect(ssl) != 1)
-        {
-            return -3;
-        }
-        return 0;
+        ESP_LOGI(TAG, "failed");
+        return -1;
     }
+    if (SSL_set_fd(conn->ssl, s) != 1)
+    {
+        return -2;
+    }
+    if (SSL_connect(conn->ssl) != 1)
+    {
+        return -3;
+    }
+    return 0;
 #elif TLS_USING_MBEDTLS
-    if (mbedtls_init)
+    ESP_LOGI(TAG, "Create SSL ...");
+    mbedtls_ssl_set_bio(&conn->ssl, &conn->server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+    session_load(&conn->ssl, name);
+    res = mbedtls_ssl_handshake(&conn->ssl);
+    if (res == 0)
     {
-        ESP_LOGI(TAG, "Create SSL ...");
-        mbedtls_ssl_set_bio(&ssl, &server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
-        return mbedtls_ssl_handshake(&ssl);
+        session_save(&conn->ssl, name);
+    }
+    else
+    {
+        session_drop(name);
     }
-#endif
     return res;
+#endif
 }
 
 //--------------------------------------------
 ssize_t wr_send(int s, const void *dataptr, size_t size, int flags)
 {
-#if TLS_USING_OPENSSL
-    if (ssl)
+    wr_conn_t *conn = conn_find(s);
+
+    if (conn)
     {
-        return SSL_write(ssl, dataptr, size);
-    }
-    else
+#if TLS_USING_OPENSSL
+        return SSL_write(conn->ssl, dataptr, size);
 #elif TLS_USING_MBEDTLS
-    if (mbedtls_init)
-    {
-        return mbedtls_ssl_write( &ssl, dataptr, size);
-    }
+        return mbedtls_ssl_write(&conn->ssl, dataptr, size);
 #endif
-    {
-        return send(s, dataptr, size, flags);
     }
+    return send(s, dataptr, size, flags);
 }
 
-
 //--------------------------------------------
 ssize_t wr_recv(int s, void *mem, size_t len, int flags)
 {
-#if TLS_USING_OPENSSL
-    if (ssl)
+    wr_conn_t *conn = conn_find(s);
+
+    if (conn)
     {
-        return SSL_read(ssl, mem, len);
-    }
-    else
+#if TLS_USING_OPENSSL
+        return SSL_read(conn->ssl, mem, len);
 #elif TLS_USING_MBEDTLS
-    if (mbedtls_init)
-    {
         int res;
         while (1)
         {
-            res = mbedtls_ssl_read(&ssl, mem, len);
-            if (res == MBEDTLS_ERR_SSL_WANT_READ || res == MBEDTLS_ERR_SSL_WANT_WRITE)
+            res = mbedtls_ssl_read(&conn->ssl, mem, len);
+            if (res == MBEDTLS_ERR_SSL_WANT_READ)
+            {
+                // Sleep until the rest of the record arrives
+                if (wait_readable(s, TLS_RECORD_WAIT_MS) < 0)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            if (res == MBEDTLS_ERR_SSL_WANT_WRITE)
             {
                 delay_ms(10);
                 continue;
@@ -245,37 +559,46 @@ ssize_t wr_recv(int s, void *mem, size_t len, int flags)
             break;
         }
         return res;
-    }
 #endif
-    {
-        return recv(s, mem, len, flags);
     }
+    return recv(s, mem, len, flags);
 }
 
 //--------------------------------------------
-int wr_close(int s)
+// returns >0 if wr_recv() has data without blocking, 0 on timeout, <0 on error
+int wr_select(int s, uint32_t timeout_ms)
 {
+    wr_conn_t *conn = conn_find(s);
+
+    // decrypted bytes already taken off the socket are invisible to select()
 #if TLS_USING_OPENSSL
-    if (ssl)
+    if (conn && conn->ssl && SSL_pending(conn->ssl) > 0)
     {
-        SSL_shutdown(ssl);
-        SSL_free(ssl);
-        ssl = NULL;
+        return 1;
     }
-    if (ctx)
+#elif TLS_USING_MBEDTLS
+    if (conn && mbedtls_ssl_get_bytes_avail(&conn->ssl) > 0)
     {
-        SSL_CTX_free(ctx);
-        ctx = NULL;
+        return 1;
     }
-#elif TLS_USING_MBEDTLS
-    mbedtls_ssl_close_notify(&ssl);
-    mbedtls_net_free(&server_fd);
-    mbedtls_x509_crt_free(&cacert);
-    mbedtls_ssl_free(&ssl);
-    mbedtls_ssl_config_free(&conf);
-    mbedtls_ctr_drbg_free(&ctr_drbg);
-    mbedtls_entropy_free(&entropy);
-    mbedtls_init = false;
 #endif
+    return wait_readable(s, timeout_ms);
+}
+
+//--------------------------------------------
+int wr_close(int s)
+{
+    wr_conn_t *conn = conn_find(s);
+
+    if (conn)
+    {
+        conn_remove(conn);
+#if TLS_USING_MBEDTLS
+        mbedtls_ssl_close_notify(&conn->ssl);
+        // close() below releases the descriptor
+        conn->server_fd.fd = -1;
+#endif
+        conn_free(conn);
+    }
     return close(s);
 }
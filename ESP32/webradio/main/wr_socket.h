@@ -20,10 +20,13 @@
 #define WR_HTTPS_SOCKET     (100)        // TCP socket with TLS security (https)
 
 //--------------------------------------------
+// The descriptor returned by wr_socket() is the connection handle,
+// each WR_HTTPS_SOCKET carries its own TLS context.
 int wr_socket(int domain, int type, int protocol);
 int wr_connect(int s, const struct sockaddr *name, socklen_t namelen);
 ssize_t wr_send(int s, const void *dataptr, size_t size, int flags);
 ssize_t wr_recv(int s, void *mem, size_t len, int flags);
+int wr_select(int s, uint32_t timeout_ms);
 int wr_close(int s);
 
 #endif /* WR_SOCKET */
\ No newline at end of file
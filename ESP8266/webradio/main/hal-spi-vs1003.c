@@ -13,6 +13,9 @@
 */
 
 #include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_attr.h"
 #include "driver/spi.h"
 #include "esp8266/spi_struct.h"
 #include "driver/gpio.h"
@@ -24,7 +27,12 @@ void delay_ms(uint32_t time_ms);
 static const char* TAG = "hal-spi-vs1003";
 
 //--------------------------------------------
-#define SPI_BIT_RATE_DIV  SPI_2MHz_DIV
+#define SPI_DIV_SLOW      ((spi_clk_div_t)(2 * SPI_2MHz_DIV))  // reset, CLKI = XTALI: XTALI/7, 1 MHz
+#define SPI_DIV_SCI       SPI_4MHz_DIV    // registers after CLOCKF: CLKI/7
+#define SPI_DIV_SDI       SPI_8MHz_DIV    // data after CLOCKF: CLKI/4
+#define SPI_BLOCK_SIZE    64    // size of SPI1.data_buf
+#define SPI_CLKCNT_MAX    64    // largest divider of the clock counter alone
+#define DREQ_RESET_MS     100   // DREQ rises a few ms after reset
 
 //--------------------------------------------
 #define	GPIO_RESET       15
@@ -35,9 +43,63 @@ static const char* TAG = "hal-spi-vs1003";
 #define OUTPUT_PINS_SEL  (1ULL << GPIO_RESET) | (1ULL << GPIO_XCS) | (1ULL << GPIO_XDCS)
 #define INPUT_PINS_SEL   (1ULL << GPIO_DREQ)
 
+//--------------------------------------------
+static spi_clk_div_t spi_div = SPI_DIV_SLOW;
+static uint8_t spi_fast;
+static SemaphoreHandle_t dreq_event;
+
+//--------------------------------------------
+// spi_set_clk_div() only has the 6 bit clock counter,
+// a larger divider is split over the prescaler
+static void apply_clk_div(spi_clk_div_t clk_div)
+{
+    spi_clk_div_t div = clk_div;
+    uint32_t pre = 1;
+
+    while (div > SPI_CLKCNT_MAX)
+    {
+        div = (spi_clk_div_t)(div / 2);
+        pre *= 2;
+    }
+    spi_set_clk_div(HSPI_HOST, &div);
+    SPI1.clock.clkdiv_pre = pre - 1;
+}
+
+//--------------------------------------------
+static void set_clk_div(spi_clk_div_t clk_div)
+{
+    if (clk_div != spi_div)
+    {
+        // Waiting for an incomplete transfer
+        while (SPI1.cmd.usr);
+        spi_div = clk_div;
+        apply_clk_div(spi_div);
+    }
+}
+
+//--------------------------------------------
+static void IRAM_ATTR dreq_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+
+    xSemaphoreGiveFromISR(dreq_event, &woken);
+    if (woken)
+    {
+        portYIELD_FROM_ISR();
+    }
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_set_fast(uint8_t state)
+{
+    spi_fast = state;
+    ESP_LOGD(TAG, "%s clock", state ? "fast" : "slow");
+}
+
 //--------------------------------------------
 void hal_spi_vs1003_reset(void)
 {
+    hal_spi_vs1003_set_fast(0);
 	delay_ms(1);
     gpio_set_level(GPIO_RESET, 1);
 	delay_ms(1);
@@ -47,7 +109,11 @@ void hal_spi_vs1003_reset(void)
     gpio_set_level(GPIO_XDCS, 1);
     gpio_set_level(GPIO_RESET, 1);
 	delay_ms(1);
-	while (!gpio_get_level(GPIO_DREQ));
+    if (hal_spi_vs1003_wait_dreq(DREQ_RESET_MS) < 0)
+    {
+        ESP_LOGE(TAG, "reset: no DREQ");
+        return;
+    }
     ESP_LOGD(TAG, "reset ok");
 }
 
@@ -67,23 +133,30 @@ void hal_spi_vs1003_init(void)
     err = gpio_config(&io_conf);
     ESP_LOGD(TAG, "gpio_config for output pins: err = %d", err);
 
-    // Input pins
+    // Input pins, DREQ going high wakes the task waiting for it
+    io_conf.intr_type = GPIO_INTR_POSEDGE;
     io_conf.mode = GPIO_MODE_INPUT;
     io_conf.pull_up_en = 0;
     io_conf.pin_bit_mask = INPUT_PINS_SEL;
     err = gpio_config(&io_conf);
     ESP_LOGD(TAG, "gpio_config for input pins: err = %d", err);
+    dreq_event = xSemaphoreCreateBinary();
+    err = gpio_install_isr_service(0);
+    ESP_LOGD(TAG, "gpio_install_isr_service: err = %d", err);
+    err = gpio_isr_handler_add(GPIO_DREQ, dreq_isr, NULL);
+    ESP_LOGD(TAG, "gpio_isr_handler_add: err = %d", err);
 
     // Set SPI to master mode
     spi_config.mode = SPI_MASTER_MODE;
     // Interface parameters
     spi_config.interface.miso_en = 1;
     spi_config.interface.mosi_en = 1;
-    // Set the SPI clock frequency division factor
-    spi_config.clk_div = SPI_BIT_RATE_DIV;
+    // Set the SPI clock frequency division factor, the slow one after spi_init()
+    spi_config.clk_div = SPI_2MHz_DIV;
     err = spi_init(HSPI_HOST, &spi_config);
 
     ESP_LOGD(TAG, "spi_init: err = %d", err);
+    apply_clk_div(spi_div);
 
     // Enable full duplex mode for HSPI
     SPI1.user.duplex = 1;
@@ -94,6 +167,7 @@ uint8_t hal_spi_vs1003_txrx(uint8_t data)
 {
     uint32_t tmp = (uint32_t)data;
 
+    set_clk_div(spi_fast ? SPI_DIV_SCI : SPI_DIV_SLOW);
     // Waiting for an incomplete transfer
     while (SPI1.cmd.usr);
 
@@ -113,6 +187,46 @@ uint8_t hal_spi_vs1003_txrx(uint8_t data)
     return (uint8_t)tmp;
 }
 
+//--------------------------------------------
+void hal_spi_vs1003_tx_block(uint8_t *buf, size_t size)
+{
+    uint32_t tmp = 0;
+    size_t len;
+    size_t cnt;
+
+    set_clk_div(spi_fast ? SPI_DIV_SDI : SPI_DIV_SLOW);
+    while (size)
+    {
+        len = size > SPI_BLOCK_SIZE ? SPI_BLOCK_SIZE : size;
+
+        // Waiting for an incomplete transfer
+        while (SPI1.cmd.usr);
+
+        SPI1.user.usr_command = 0;
+        SPI1.user.usr_addr = 0;
+        SPI1.user.usr_mosi = 1;
+        SPI1.user.usr_miso = 0;
+        SPI1.user1.usr_mosi_bitlen = len * 8 - 1;
+        // the first byte goes out from the low byte of data_buf[0]
+        for (cnt = 0; cnt < len; cnt++)
+        {
+            tmp |= (uint32_t)buf[cnt] << ((cnt & 3) * 8);
+            if ((cnt & 3) == 3 || cnt == len - 1)
+            {
+                SPI1.data_buf[cnt >> 2] = tmp;
+                tmp = 0;
+            }
+        }
+
+        // Start send data
+        SPI1.cmd.usr = 1;
+        buf += len;
+        size -= len;
+    }
+    // Waiting for transfer
+    while (SPI1.cmd.usr);
+}
+
 //--------------------------------------------
 void hal_spi_vs1003_xcs(uint8_t state)
 {
@@ -130,3 +244,17 @@ uint8_t hal_spi_vs1003_dreq(void)
 {
 	return gpio_get_level(GPIO_DREQ);
 }
+
+//--------------------------------------------
+// returns 0 once DREQ is high, -1 on timeout
+int hal_spi_vs1003_wait_dreq(uint32_t timeout_ms)
+{
+    while (!gpio_get_level(GPIO_DREQ))
+    {
+        if (xSemaphoreTake(dreq_event, pdMS_TO_TICKS(timeout_ms)) != pdTRUE)
+        {
+            return gpio_get_level(GPIO_DREQ) ? 0 : -1;
+        }
+    }
+    return 0;
+}
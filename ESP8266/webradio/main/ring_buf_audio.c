@@ -14,35 +14,526 @@
 
 #include <stdint.h>     /* uint8_t ... uint64_t */
 #include <stdlib.h>     /* size_t */
-#include "pthread.h"
+#include <stdbool.h>    /* bool */
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "ring_buf.h"
+#include "ring_buf_audio.h"
+
+//--------------------------------------------
+// Default watermarks in milliseconds of audio
+#define WATERMARK_START_MS         500    // fast start of a new stream
+#define WATERMARK_HIGH_MS          2000   // restart after an underrun
+#define WATERMARK_LOW_MS           0      // stop and rebuffer
+#define DEFAULT_BITRATE_KBPS       128
+
+//--------------------------------------------
+// Audio buffer holds AUDIO_BUF_TARGET_MS of the stream within the limits
+#define AUDIO_BUF_TARGET_MS        4000
+#define AUDIO_BUF_MIN_SIZE         4096
+#define AUDIO_BUF_MAX_SIZE         16384  // takes the heap saved by the small TLS buffers
+#define BITRATE_DETECT_SIZE        4096   // audio bytes scanned for a frame header
+#define DECODED_BITRATE_POLLS      8      // decoder bitrates averaged per stream
+
+//--------------------------------------------
+#define FILL_SAMPLE_MS             100
 
 //--------------------------------------------
 static ring_buf_t ring_buf;
-static uint8_t audio_buf[4096];
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t start_ms;
+	uint32_t high_ms;
+	uint32_t low_ms;
+	uint32_t bitrate_kbps;
+	volatile uint32_t decoded_kbps;
+	volatile uint32_t stream_seq;
+	uint32_t played_seq;
+} watermarks_t;
+static watermarks_t watermarks =
+{
+	.start_ms = WATERMARK_START_MS,
+	.high_ms = WATERMARK_HIGH_MS,
+	.low_ms = WATERMARK_LOW_MS,
+	.bitrate_kbps = DEFAULT_BITRATE_KBPS,
+	.decoded_kbps = 0,
+	.stream_seq = 1,
+	.played_seq = 0
+};
+
+//--------------------------------------------
+// Written by the network task only
+typedef struct
+{
+	size_t detect_left;
+	bool resize_wanted;
+} sizing_t;
+static sizing_t sizing;
+
+//--------------------------------------------
+// Written by the player task only
+typedef struct
+{
+	uint32_t seq;
+	uint32_t sum_kbps;
+	uint32_t polls;
+} decoded_t;
+static decoded_t decoded;
+
+//--------------------------------------------
+// MPEG audio bitrates in kbps [MPEG-1, MPEG-2/2.5][layer I, II, III][index - 1]
+static const uint16_t mpeg_bitrates[2][3][14] =
+{
+	{
+		{ 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+		{ 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+		{ 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+	},
+	{
+		{ 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+		{ 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+		{ 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+	}
+};
+
+//--------------------------------------------
+// Each field is written by a single task: the network task marks
+// the tcp and feed stages, the player the rest.
+typedef struct
+{
+	uint32_t underruns;
+	uint32_t fill_hist[RING_BUF_AUDIO_FILL_BINS];
+	uint32_t fill_sample_ms;
+	bool marked[ring_buf_audio_stages];
+	uint32_t mark_ms[ring_buf_audio_stages];
+	uint32_t max_gap_ms[ring_buf_audio_stages];
+} stats_t;
+static stats_t stats;
+
+//--------------------------------------------
+static uint32_t get_time_ms(void)
+{
+	return xTaskGetTickCount() * portTICK_PERIOD_MS;
+}
+
+//--------------------------------------------
+static uint8_t *audio_buf_alloc(size_t size)
+{
+	return (uint8_t *)malloc(size);
+}
+
+//--------------------------------------------
+static void audio_buf_free(uint8_t *buf)
+{
+	free(buf);
+}
+
+//--------------------------------------------
+static size_t buffer_size(uint32_t bitrate_kbps)
+{
+	size_t size = (size_t)AUDIO_BUF_TARGET_MS * bitrate_kbps / 8;
+
+	if (size < AUDIO_BUF_MIN_SIZE)
+	{
+		return AUDIO_BUF_MIN_SIZE;
+	}
+	return size > AUDIO_BUF_MAX_SIZE ? AUDIO_BUF_MAX_SIZE : size;
+}
+
+//--------------------------------------------
+// bitrate of the first valid MPEG audio frame header, 0 if none is found
+static uint32_t mpeg_frame_bitrate(uint8_t *buf, size_t size)
+{
+	size_t cnt;
+	uint8_t version;
+	uint8_t layer;
+	uint8_t index;
+
+	for (cnt = 0; cnt + 3 <= size; cnt++)
+	{
+		if (buf[cnt] != 0xFF || (buf[cnt + 1] & 0xE0) != 0xE0)
+		{
+			continue;
+		}
+		version = (buf[cnt + 1] >> 3) & 0x03;   // 0 - MPEG-2.5, 1 - reserved, 2 - MPEG-2, 3 - MPEG-1
+		layer = (buf[cnt + 1] >> 1) & 0x03;     // 0 - reserved, 1 - III, 2 - II, 3 - I
+		index = buf[cnt + 2] >> 4;
+		if (version == 1 || layer == 0 || index == 0 || index == 15 || ((buf[cnt + 2] >> 2) & 0x03) == 3)
+		{
+			continue;
+		}
+		return mpeg_bitrates[version == 3 ? 0 : 1][3 - layer][index - 1];
+	}
+	return 0;
+}
+
+//--------------------------------------------
+// producer side: ask the player to move to a buffer sized for the bitrate
+static void request_resize(void)
+{
+	uint32_t decoded_kbps = watermarks.decoded_kbps;
+	size_t size;
+
+	// the decoder's average bitrate wins once it is off by more than a quarter
+	if (decoded_kbps &&
+		(decoded_kbps * 4 < watermarks.bitrate_kbps * 3 || decoded_kbps * 4 > watermarks.bitrate_kbps * 5))
+	{
+		ring_buf_audio_set_bitrate(decoded_kbps);
+	}
+	if (!sizing.resize_wanted)
+	{
+		return;
+	}
+	sizing.resize_wanted = false;
+	size = buffer_size(watermarks.bitrate_kbps);
+	if (size != ring_buf.length)
+	{
+		ring_buf_request_resize(&ring_buf, size);
+	}
+}
+
+//--------------------------------------------
+static size_t ms_to_bytes(uint32_t time_ms)
+{
+	size_t size = (size_t)time_ms * watermarks.bitrate_kbps / 8;
+	return size > ring_buf.length ? ring_buf.length : size;
+}
 
 //--------------------------------------------
 int ring_buf_audio_init(void)
 {
-	return ring_buf_init(&ring_buf, audio_buf, sizeof(audio_buf));
+	size_t size = buffer_size(DEFAULT_BITRATE_KBPS);
+	uint8_t *buf;
+
+	buf = audio_buf_alloc(size);
+	if (!buf)
+	{
+		return -1;
+	}
+	if (ring_buf_init(&ring_buf, buf, size) < 0)
+	{
+		audio_buf_free(buf);
+		return -1;
+	}
+	return 0;
 }
 
 //--------------------------------------------
 int ring_buf_audio_clear(void)
 {
+	watermarks.stream_seq++;
+	watermarks.decoded_kbps = 0;
+	// reconnection time is not a gap between packets
+	stats.marked[ring_buf_audio_stage_tcp] = false;
+	stats.marked[ring_buf_audio_stage_feed] = false;
 	return ring_buf_clear(&ring_buf);
 }
 
 //--------------------------------------------
 int ring_buf_audio_put(uint8_t *buf, size_t size)
 {
-	return ring_buf_put(&ring_buf, buf, size);
+	int res;
+
+	request_resize();
+	res = ring_buf_put(&ring_buf, buf, size);
+	if (res > 0)
+	{
+		ring_buf_audio_mark_stage(ring_buf_audio_stage_feed);
+	}
+	return res;
 }
 
 //--------------------------------------------
 int ring_buf_audio_get(uint8_t *buf, size_t size)
 {
-	return ring_buf_get(&ring_buf, buf, size);
+	int res;
+
+	res = ring_buf_get(&ring_buf, buf, size);
+	if (res > 0)
+	{
+		ring_buf_audio_mark_stage(ring_buf_audio_stage_play);
+	}
+	return res;
+}
+
+//--------------------------------------------
+int ring_buf_audio_reserve_write(uint8_t **buf)
+{
+	request_resize();
+	return ring_buf_reserve_write(&ring_buf, buf);
+}
+
+//--------------------------------------------
+int ring_buf_audio_commit_write(size_t size)
+{
+	int res;
+
+	res = ring_buf_commit_write(&ring_buf, size);
+	if (res > 0)
+	{
+		ring_buf_audio_mark_stage(ring_buf_audio_stage_feed);
+	}
+	return res;
+}
+
+//--------------------------------------------
+int ring_buf_audio_peek_read(uint8_t **buf)
+{
+	return ring_buf_peek_read(&ring_buf, buf);
+}
+
+//--------------------------------------------
+int ring_buf_audio_consume(size_t size)
+{
+	int res;
+
+	res = ring_buf_consume(&ring_buf, size);
+	if (res > 0)
+	{
+		ring_buf_audio_mark_stage(ring_buf_audio_stage_play);
+	}
+	return res;
+}
+
+//--------------------------------------------
+int ring_buf_audio_wait_read(size_t size, uint32_t timeout_ms)
+{
+	return ring_buf_wait_read(&ring_buf, size, timeout_ms);
+}
+
+//--------------------------------------------
+int ring_buf_audio_wait_write(size_t size, uint32_t timeout_ms)
+{
+	return ring_buf_wait_write(&ring_buf, size, timeout_ms);
+}
+
+//--------------------------------------------
+int ring_buf_audio_get_length(void)
+{
+	return ring_buf_get_length(&ring_buf);
+}
+
+//--------------------------------------------
+int ring_buf_audio_get_count(void)
+{
+	return ring_buf_get_count(&ring_buf);
+}
+
+//--------------------------------------------
+void ring_buf_audio_set_watermarks(uint32_t start_ms, uint32_t high_ms, uint32_t low_ms)
+{
+	watermarks.start_ms = start_ms;
+	watermarks.high_ms = high_ms;
+	watermarks.low_ms = low_ms;
+}
+
+//--------------------------------------------
+void ring_buf_audio_get_watermarks(uint32_t *start_ms, uint32_t *high_ms, uint32_t *low_ms)
+{
+	*start_ms = watermarks.start_ms;
+	*high_ms = watermarks.high_ms;
+	*low_ms = watermarks.low_ms;
+}
+
+//--------------------------------------------
+// 0 if the stream bitrate is unknown
+void ring_buf_audio_set_bitrate(uint32_t bitrate_kbps)
+{
+	watermarks.bitrate_kbps = bitrate_kbps ? bitrate_kbps : DEFAULT_BITRATE_KBPS;
+	// an unknown bitrate is taken from the first frame header
+	sizing.detect_left = bitrate_kbps ? 0 : BITRATE_DETECT_SIZE;
+	sizing.resize_wanted = bitrate_kbps != 0;
+}
+
+//--------------------------------------------
+// producer side: audio bytes of a stream started without a bitrate
+void ring_buf_audio_detect_bitrate(uint8_t *buf, size_t size)
+{
+	uint32_t bitrate_kbps;
+
+	if (!sizing.detect_left)
+	{
+		return;
+	}
+	size = size > sizing.detect_left ? sizing.detect_left : size;
+	sizing.detect_left -= size;
+	bitrate_kbps = mpeg_frame_bitrate(buf, size);
+	if (bitrate_kbps)
+	{
+		ring_buf_audio_set_bitrate(bitrate_kbps);
+	}
+}
+
+//--------------------------------------------
+// player side: bitrate the codec reports for the stream, 0 if unknown.
+// It is the bitrate of the last frame and swings with VBR, so the average
+// of the first DECODED_BITRATE_POLLS is handed over once per stream.
+void ring_buf_audio_set_decoded_bitrate(uint32_t bitrate_kbps)
+{
+	if (decoded.seq != watermarks.played_seq)
+	{
+		decoded.seq = watermarks.played_seq;
+		decoded.sum_kbps = 0;
+		decoded.polls = 0;
+	}
+	if (!bitrate_kbps || decoded.polls >= DECODED_BITRATE_POLLS)
+	{
+		return;
+	}
+	decoded.sum_kbps += bitrate_kbps;
+	// not once the network task has moved on to the next stream
+	if (++decoded.polls == DECODED_BITRATE_POLLS && decoded.seq == watermarks.stream_seq)
+	{
+		watermarks.decoded_kbps = decoded.sum_kbps / DECODED_BITRATE_POLLS;
+	}
+}
+
+//--------------------------------------------
+// player side: move to the buffer requested by the network task,
+// called while no span from ring_buf_audio_peek_read() is in use
+int ring_buf_audio_apply_resize(void)
+{
+	uint8_t *old_buf = ring_buf.buffer;
+	uint8_t *buf;
+	int size;
+	int count;
+
+	size = ring_buf_get_resize(&ring_buf);
+	if (size <= 0)
+	{
+		return size;
+	}
+	// a smaller buffer still takes all the buffered bytes
+	count = ring_buf_get_count(&ring_buf);
+	size = size < count ? count : size;
+	// without memory for the new buffer the current one is kept
+	buf = audio_buf_alloc(size);
+	ring_buf_resize(&ring_buf, buf, size);
+	if (buf)
+	{
+		audio_buf_free(old_buf);
+	}
+	return 0;
+}
+
+//--------------------------------------------
+// player side: fill level in bytes to start writing to the codec,
+// the fast start level for a new stream, the high watermark after an underrun
+int ring_buf_audio_get_start_level(void)
+{
+	size_t size;
+
+	if (watermarks.played_seq != watermarks.stream_seq)
+	{
+		size = ms_to_bytes(watermarks.start_ms);
+	}
+	else
+	{
+		size = ms_to_bytes(watermarks.high_ms);
+	}
+	return size ? size : 1;
+}
+
+//--------------------------------------------
+// player side: fill level in bytes at which writing stops until
+// the buffer is refilled up to the start level
+int ring_buf_audio_get_stop_level(void)
+{
+	size_t size = ms_to_bytes(watermarks.low_ms);
+	int start_level = ring_buf_audio_get_start_level();
+
+	return (int)size < start_level ? (int)size : start_level - 1;
+}
+
+//--------------------------------------------
+// player side: the start level has been reached,
+// returns 1 if a new stream follows one that has been played
+int ring_buf_audio_start_playing(void)
+{
+	int new_stream;
+
+	new_stream = watermarks.played_seq && watermarks.played_seq != watermarks.stream_seq;
+	watermarks.played_seq = watermarks.stream_seq;
+	return new_stream;
+}
+
+//--------------------------------------------
+// player side: the buffer has been cleared since the start level was
+// reached; checked after ring_buf_audio_peek_read(), which takes in
+// the clear, so that no byte of the new stream is seen before this
+int ring_buf_audio_is_new_stream(void)
+{
+	return watermarks.played_seq != watermarks.stream_seq;
+}
+
+//--------------------------------------------
+// player side: the buffer has run down to the stop level
+void ring_buf_audio_stop_playing(void)
+{
+	// a cleared buffer is a new stream rather than an underrun
+	if (watermarks.played_seq == watermarks.stream_seq)
+	{
+		stats.underruns++;
+	}
+}
+
+//--------------------------------------------
+// keeps the longest interval between two passes of a pipeline stage
+void ring_buf_audio_mark_stage(ring_buf_audio_stage_t stage)
+{
+	uint32_t now = get_time_ms();
+
+	if (stats.marked[stage] && now - stats.mark_ms[stage] > stats.max_gap_ms[stage])
+	{
+		stats.max_gap_ms[stage] = now - stats.mark_ms[stage];
+	}
+	stats.mark_ms[stage] = now;
+	stats.marked[stage] = true;
+}
+
+//--------------------------------------------
+// player side: adds the fill level to the histogram every FILL_SAMPLE_MS
+void ring_buf_audio_sample_fill(void)
+{
+	uint32_t now = get_time_ms();
+	int count;
+
+	if (now - stats.fill_sample_ms < FILL_SAMPLE_MS)
+	{
+		return;
+	}
+	stats.fill_sample_ms = now;
+	count = ring_buf_get_count(&ring_buf);
+	if (count < 0)
+	{
+		return;
+	}
+	stats.fill_hist[count * RING_BUF_AUDIO_FILL_BINS / (ring_buf.length + 1)]++;
+}
+
+//--------------------------------------------
+void ring_buf_audio_get_stats(ring_buf_audio_stats_t *audio_stats)
+{
+	int cnt;
+
+	audio_stats->bytes_in = ring_buf.bytes_in;
+	audio_stats->bytes_out = ring_buf.bytes_out;
+	audio_stats->stalls = ring_buf.stalls;
+	audio_stats->underruns = stats.underruns;
+	audio_stats->length = ring_buf.length;
+	audio_stats->max_count = ring_buf.max_count;
+	audio_stats->fill_percentage = ring_buf_get_percentage_fill(&ring_buf);
+	for (cnt = 0; cnt < RING_BUF_AUDIO_FILL_BINS; cnt++)
+	{
+		audio_stats->fill_hist[cnt] = stats.fill_hist[cnt];
+	}
+	for (cnt = 0; cnt < ring_buf_audio_stages; cnt++)
+	{
+		audio_stats->max_gap_ms[cnt] = stats.max_gap_ms[cnt];
+	}
 }
 
 //--------------------------------------------
@@ -54,5 +545,10 @@ int ring_buf_audio_get_percentage_fill(void)
 //--------------------------------------------
 int ring_buf_audio_destroy(void)
 {
-	return ring_buf_destroy(&ring_buf);
+	if (ring_buf_destroy(&ring_buf) < 0)
+	{
+		return -1;
+	}
+	audio_buf_free(ring_buf.buffer);
+	return 0;
 }
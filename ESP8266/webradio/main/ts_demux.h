@@ -0,0 +1,47 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef TS_DEMUX_H
+#define TS_DEMUX_H
+
+//--------------------------------------------
+#define TS_PACKET_SIZE             188
+
+//--------------------------------------------
+typedef enum
+{
+	ts_demux_unknown = 0,
+	ts_demux_ts,
+	ts_demux_raw                   // packed audio, ADTS or MPEG frames as they are
+} ts_demux_mode_t;
+
+//--------------------------------------------
+// Takes the first audio elementary stream out of an MPEG transport
+// stream as it arrives: the PAT gives the PMT, the PMT gives the audio
+// PID, and the PES headers are stripped off its packets.
+// Only a packet split over reads is copied, to packet.
+typedef struct
+{
+	ts_demux_mode_t mode;
+	uint16_t pmt_pid;
+	uint16_t audio_pid;
+	uint8_t packet[TS_PACKET_SIZE];
+	size_t packet_len;
+} ts_demux_t;
+
+//--------------------------------------------
+void ts_demux_init(ts_demux_t *demux);
+size_t ts_demux_next(ts_demux_t *demux, const uint8_t *buf, size_t size, const uint8_t **data, size_t *data_size);
+
+#endif /* TS_DEMUX_H */
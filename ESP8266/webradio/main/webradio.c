@@ -16,6 +16,7 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
 #include "esp_system.h"
 #include "esp_wifi.h"
 #include "esp_netif.h"
@@ -29,6 +30,13 @@
 #include "lwip/sockets.h"
 #include "lwip/netdb.h"
 #include "wr_socket.h"
+#include "http_header.h"
+#include "http_chunked.h"
+#include "playlist.h"
+#include "hls.h"
+#include "ts_demux.h"
+#include "icy_demux.h"
+#include "now_playing.h"
 #include "vs1053.h"
 
 //--------------------------------------------
@@ -37,6 +45,7 @@
 //--------------------------------------------
 #if RING_BUF_ENABLED
 #include "ring_buf_audio.h"
+#include "player.h"
 #endif
 
 //--------------------------------------------
@@ -93,6 +102,15 @@ static int16_t wifi_mode;
 #define POST_WEBRADIO_CGI          "/post_webradio.cgi"
 #define WIFI_AP_LIST               "/spiffs/options/wifiap.lst"
 #define WEBRADIO_LIST              "/spiffs/options/webradio.lst"
+#define GET_PLAYER_CGI             "/get_player.cgi"
+#define POST_PLAYER_CGI            "/post_player.cgi"
+#define PLAYER_LIST                "/spiffs/options/player.lst"
+#define PLAYER_LIST_FORMAT         "start_ms=%u\r\nhigh_ms=%u\r\nlow_ms=%u"
+#define REDIRECT_LIST              "/spiffs/options/redirect.lst"
+#define GET_STATUS_CGI             "/get_status.cgi"
+#define GET_TITLE_CGI              "/get_title.cgi"
+#define TITLE_FORMAT               "seq=%u\r\ntitle=%s\r\nurl=%s"
+#define TITLE_RESPONSE_HEADER      "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %u\r\n\r\n"
 #define GET_WIFI_MODE_JS           "/mode.js"
 #define GET_WIFI_MODE_JS_CONTENT   "let mode = %d;"
 
@@ -100,13 +118,19 @@ static int16_t wifi_mode;
 #define IP_ACQUIRED_WAIT_SEC       6
 
 //--------------------------------------------
-#define PLAY_TASK_STACK_SIZE       1024
+#define TITLE_MAX_CLIENTS          4
+#define TITLE_WAIT_MS              20000  // longest hold of a title request
+#define TITLE_CHECK_MS             1000
+
+//--------------------------------------------
+#define PLAY_TASK_STACK_SIZE       2560   // codec reset and cancel run in the player
 #define PLAY_TASK_PRIORITY         1
 
 //--------------------------------------------
 #define RECV_BUFFER_SIZE           1024
-#define PLAY_BUFFER_SIZE           256
 #define ICY_BUFFER_SIZE            1024
+#define RING_BUF_WAIT_MS           100
+#define RECV_WAIT_MS               100
 #define RESP_CONTEXT_BUFFER_SIZE   1024
 
 //--------------------------------------------
@@ -116,11 +140,35 @@ typedef enum
 	webradio_link_connected,
 	webradio_load_location,
 	webradio_html_header,
+	webradio_playlist,
+	webradio_hls_segment,
 	webradio_audio_stream
 } webradio_state_t;
 static webradio_state_t webradio_state;
 static uint8_t icy_buf[ICY_BUFFER_SIZE];
+static http_header_t http_header;
+static http_chunked_t http_chunked;
+static icy_demux_t icy_demux;
+static ts_demux_t ts_demux;
 static uint8_t resp_context[RESP_CONTEXT_BUFFER_SIZE];
+static httpd_handle_t http_server;
+
+//--------------------------------------------
+// Title request held open until the title changes or TITLE_WAIT_MS ends.
+// The record is the session context, so it goes with the connection;
+// it is used from the httpd task only.
+typedef struct
+{
+	int sockfd;
+	bool waiting;
+	uint32_t seq;
+	TickType_t deadline;
+} title_client_t;
+static title_client_t *title_clients[TITLE_MAX_CLIENTS];
+static volatile size_t title_waiting;
+#if RING_BUF_ENABLED
+static TaskHandle_t play_task_handle;
+#endif
 
 #ifdef FATAL_ERROR
 //--------------------------------------------
@@ -221,7 +269,7 @@ static void load_list(const char* name, uint8_t **context, size_t *length)
     if (fp == NULL)
     {
         *context = NULL;
-        length = 0;
+        *length = 0;
         ESP_LOGE(TAG, "Failed to open %s for reading", name);
 		fatal_error();
         return;
@@ -232,7 +280,7 @@ static void load_list(const char* name, uint8_t **context, size_t *length)
 	*context = (uint8_t *)malloc(size + 1);
     if (*context == NULL)
     {
-        length = 0;
+        *length = 0;
         ESP_LOGE(TAG, "Failed to allocate %d bytes", size);
 		fatal_error();
         return;
@@ -240,6 +288,7 @@ static void load_list(const char* name, uint8_t **context, size_t *length)
     fseek(fp, 0L, SEEK_SET);
     fread(*context, size, 1, fp);
     fclose(fp);
+	*(*context + size) = 0;
 	*length = size;
 }
 
@@ -320,6 +369,39 @@ static void load_webradio_location_from_list(uint8_t *context, size_t length)
 	}
 }
 
+//--------------------------------------------
+// the targets of permanent redirects outlive a reboot
+static void load_redirects(void)
+{
+	uint8_t *context;
+	size_t length;
+
+	load_list(REDIRECT_LIST, &context, &length);
+	if (context)
+	{
+		playlist_cache_load((const char *)context);
+		free(context);
+	}
+}
+
+//--------------------------------------------
+static void save_redirects(void)
+{
+	char *buf;
+
+	if (!playlist_cache_is_changed())
+	{
+		return;
+	}
+	buf = malloc(PLAYLIST_CACHE_TEXT_SIZE);
+	if (!buf)
+	{
+		return;
+	}
+	save_list(REDIRECT_LIST, (uint8_t *)buf, playlist_cache_save(buf, PLAYLIST_CACHE_TEXT_SIZE));
+	free(buf);
+}
+
 //--------------------------------------------
 static void set_first_webradio(void)
 {
@@ -336,6 +418,20 @@ static void set_next_webradio(void)
 	webradio_state = webradio_load_location;
 }
 
+//--------------------------------------------
+// returns false if the playlist of the list entry has nothing left to try
+static bool load_playlist_location(void)
+{
+	if (playlist_next(webradio.location, sizeof(webradio.location)) < 0)
+	{
+		return false;
+	}
+	// a failed cached target may have been dropped
+	save_redirects();
+	webradio.use_list = false;
+	return true;
+}
+
 //--------------------------------------------
 static void load_webradio_location(void)
 {
@@ -347,6 +443,10 @@ static void load_webradio_location(void)
 		load_list(WEBRADIO_LIST, &context, &length);
 		load_webradio_location_from_list(context, length);
 		free(context);
+		// a playlist resolved before is not fetched again
+		hls_close();
+		playlist_set_origin(webradio.location);
+		playlist_get_cached(webradio.location, sizeof(webradio.location));
 	}
 }
 
@@ -427,6 +527,105 @@ static int load_wifi_ap(void)
 	return res;
 }
 
+#if RING_BUF_ENABLED
+//--------------------------------------------
+// ring buffer and pipeline counters as key=value lines
+static size_t print_status(char *buf, size_t size)
+{
+	ring_buf_audio_stats_t stats;
+	vs1053_stats_t vs1053_stats;
+	vs1053_status_t decoder_status;
+	int len;
+	int res;
+
+	ring_buf_audio_get_stats(&stats);
+	len = snprintf(buf, size,
+		"bytes_in=%u\r\nbytes_out=%u\r\nstalls=%u\r\nunderruns=%u\r\n"
+		"length=%u\r\nmax_count=%u\r\nfill=%d\r\n"
+		"fill_hist=%u,%u,%u,%u,%u,%u,%u,%u\r\n"
+		"tcp_gap_ms=%u\r\nfeed_gap_ms=%u\r\nplay_gap_ms=%u",
+		(unsigned int)stats.bytes_in, (unsigned int)stats.bytes_out,
+		(unsigned int)stats.stalls, (unsigned int)stats.underruns,
+		(unsigned int)stats.length, (unsigned int)stats.max_count, stats.fill_percentage,
+		(unsigned int)stats.fill_hist[0], (unsigned int)stats.fill_hist[1],
+		(unsigned int)stats.fill_hist[2], (unsigned int)stats.fill_hist[3],
+		(unsigned int)stats.fill_hist[4], (unsigned int)stats.fill_hist[5],
+		(unsigned int)stats.fill_hist[6], (unsigned int)stats.fill_hist[7],
+		(unsigned int)stats.max_gap_ms[ring_buf_audio_stage_tcp],
+		(unsigned int)stats.max_gap_ms[ring_buf_audio_stage_feed],
+		(unsigned int)stats.max_gap_ms[ring_buf_audio_stage_play]);
+	if (len < 0)
+	{
+		return 0;
+	}
+	if ((size_t)len < size)
+	{
+		vs1053_get_stats(&vs1053_stats);
+		player_get_decoder_status(&decoder_status);
+		res = snprintf(buf + len, size - len,
+			"\r\nsci_reads=%u\r\nsci_writes=%u\r\nsdi_bursts=%u\r\nsdi_bytes=%u\r\n"
+			"dreq_timeouts=%u\r\ncancels=%u\r\nresets=%u\r\n"
+			"codec=%s\r\nbitrate=%u\r\nsample_rate=%u\r\nchannels=%u\r\ndecode_time=%u\r\n"
+			"player_stack_free=%u",
+			(unsigned int)vs1053_stats.sci_reads, (unsigned int)vs1053_stats.sci_writes,
+			(unsigned int)vs1053_stats.sdi_bursts, (unsigned int)vs1053_stats.sdi_bytes,
+			(unsigned int)vs1053_stats.dreq_timeouts, (unsigned int)vs1053_stats.cancels,
+			(unsigned int)vs1053_stats.resets,
+			decoder_status.codec ? decoder_status.codec : "none",
+			(unsigned int)decoder_status.bitrate_kbps, (unsigned int)decoder_status.sample_rate,
+			(unsigned int)decoder_status.channels, (unsigned int)decoder_status.decode_time,
+			(unsigned int)uxTaskGetStackHighWaterMark(play_task_handle));
+		if (res > 0)
+		{
+			len += res;
+		}
+	}
+	return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+//--------------------------------------------
+static uint32_t load_player_option(uint8_t *context, const char *name, uint32_t value)
+{
+	char *str;
+
+	str = strstr((char const *)context, name);
+	if (str)
+	{
+		return strtoul(str + strlen(name), NULL, 10);
+	}
+	return value;
+}
+
+//--------------------------------------------
+static void load_player_from_list(uint8_t *context)
+{
+	uint32_t start_ms;
+	uint32_t high_ms;
+	uint32_t low_ms;
+
+	// absent keys keep their current values
+	ring_buf_audio_get_watermarks(&start_ms, &high_ms, &low_ms);
+	start_ms = load_player_option(context, "start_ms=", start_ms);
+	high_ms = load_player_option(context, "high_ms=", high_ms);
+	low_ms = load_player_option(context, "low_ms=", low_ms);
+	ring_buf_audio_set_watermarks(start_ms, high_ms, low_ms);
+}
+
+//--------------------------------------------
+static void load_player(void)
+{
+	uint8_t *context;
+	size_t length;
+
+	load_list(PLAYER_LIST, &context, &length);
+	if (context)
+	{
+		load_player_from_list(context);
+		free(context);
+	}
+}
+#endif
+
 //--------------------------------------------
 static void set_first_wifi_ap(void)
 {
@@ -693,6 +892,195 @@ esp_err_t post_webradio_cgi(httpd_req_t *req)
 
     return ESP_OK;
 }
+#if RING_BUF_ENABLED
+//--------------------------------------------
+esp_err_t get_player_cgi(httpd_req_t *req)
+{
+	uint32_t start_ms;
+	uint32_t high_ms;
+	uint32_t low_ms;
+
+	ring_buf_audio_get_watermarks(&start_ms, &high_ms, &low_ms);
+	sprintf((char *)resp_context, PLAYER_LIST_FORMAT, (unsigned int)start_ms, (unsigned int)high_ms, (unsigned int)low_ms);
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, (const char *)resp_context, strlen((const char *)resp_context));
+    return ESP_OK;
+}
+//--------------------------------------------
+esp_err_t post_player_cgi(httpd_req_t *req)
+{
+    char*  buf = malloc(req->content_len + 1);
+    size_t off = 0;
+    int    ret;
+
+    if (!buf)
+    {
+        httpd_resp_send_500(req);
+        return ESP_FAIL;
+    }
+
+    while (off < req->content_len)
+    {
+        // Read data received in the request
+        ret = httpd_req_recv(req, buf + off, req->content_len - off);
+        if (ret <= 0)
+        {
+            if (ret == HTTPD_SOCK_ERR_TIMEOUT)
+            {
+                httpd_resp_send_408(req);
+            }
+            free (buf);
+            return ESP_FAIL;
+        }
+        off += ret;
+        ESP_LOGI(TAG, "/echo handler recv length %d", ret);
+    }
+    buf[off] = '\0';
+
+	save_list(PLAYER_LIST, (uint8_t *)buf, req->content_len);
+	load_player_from_list((uint8_t *)buf);
+    free(buf);
+
+    httpd_resp_send(req, "Ok", 2);
+
+    return ESP_OK;
+}
+//--------------------------------------------
+esp_err_t get_status_cgi(httpd_req_t *req)
+{
+	size_t length;
+
+	length = print_status((char *)resp_context, sizeof(resp_context));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, (const char *)resp_context, length);
+    return ESP_OK;
+}
+#endif
+//--------------------------------------------
+static size_t print_title(char *buf, size_t size)
+{
+	now_playing_t now_playing;
+	int len;
+
+	now_playing_get(&now_playing);
+	len = snprintf(buf, size, TITLE_FORMAT, (unsigned int)now_playing.seq, now_playing.title, now_playing.url);
+	if (len < 0)
+	{
+		return 0;
+	}
+	return (size_t)len < size ? (size_t)len : size - 1;
+}
+//--------------------------------------------
+// httpd task: answers the held requests whose title is stale or whose time is up
+static void title_push(void *arg)
+{
+	uint32_t seq = now_playing_get_seq();
+	TickType_t now = xTaskGetTickCount();
+	title_client_t *client;
+	char body[NOW_PLAYING_TITLE_SIZE + NOW_PLAYING_URL_SIZE + 32];
+	size_t length;
+	int res;
+	size_t cnt;
+
+	for (cnt = 0; cnt < TITLE_MAX_CLIENTS; cnt++)
+	{
+		client = title_clients[cnt];
+		if (!client || !client->waiting || (client->seq == seq && (int32_t)(now - client->deadline) < 0))
+		{
+			continue;
+		}
+		client->waiting = false;
+		title_waiting--;
+		length = print_title(body, sizeof(body));
+		res = snprintf((char *)resp_context, sizeof(resp_context), TITLE_RESPONSE_HEADER "%s", (unsigned int)length, body);
+		if (res > 0 && (size_t)res < sizeof(resp_context))
+		{
+			httpd_socket_send(http_server, client->sockfd, (const char *)resp_context, res, 0);
+		}
+	}
+}
+//--------------------------------------------
+// the connection of a title client is closed
+static void title_client_free(void *ctx)
+{
+	title_client_t *client = ctx;
+	size_t cnt;
+
+	for (cnt = 0; cnt < TITLE_MAX_CLIENTS; cnt++)
+	{
+		if (title_clients[cnt] == client)
+		{
+			title_clients[cnt] = NULL;
+		}
+	}
+	if (client->waiting)
+	{
+		title_waiting--;
+	}
+	free(client);
+}
+//--------------------------------------------
+// any task: hands the title change over to the httpd task
+static void title_notify(void)
+{
+	if (http_server && title_waiting)
+	{
+		httpd_queue_work(http_server, title_push, NULL);
+	}
+}
+//--------------------------------------------
+static void title_timer_cb(TimerHandle_t timer)
+{
+	title_notify();
+}
+//--------------------------------------------
+// get_title.cgi?seq=N is held until the title differs from N
+esp_err_t get_title_cgi(httpd_req_t *req)
+{
+	title_client_t *client = req->sess_ctx;
+	char query[24];
+	char value[12];
+	size_t length;
+	size_t cnt;
+
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK ||
+		httpd_query_key_value(query, "seq", value, sizeof(value)) != ESP_OK ||
+		strtoul(value, NULL, 10) != now_playing_get_seq())
+	{
+		goto send;
+	}
+	if (!client)
+	{
+		for (cnt = 0; cnt < TITLE_MAX_CLIENTS && title_clients[cnt]; cnt++);
+		if (cnt == TITLE_MAX_CLIENTS)
+		{
+			goto send;
+		}
+		client = calloc(1, sizeof(title_client_t));
+		if (!client)
+		{
+			goto send;
+		}
+		title_clients[cnt] = client;
+		req->sess_ctx = client;
+		req->free_ctx = title_client_free;
+	}
+	if (!client->waiting)
+	{
+		title_waiting++;
+	}
+	client->sockfd = httpd_req_to_sockfd(req);
+	client->seq = strtoul(value, NULL, 10);
+	client->deadline = xTaskGetTickCount() + pdMS_TO_TICKS(TITLE_WAIT_MS);
+	client->waiting = true;
+	// the answer comes from title_push()
+	return ESP_OK;
+send:
+	length = print_title((char *)resp_context, sizeof(resp_context));
+    httpd_resp_set_type(req, "text/plain");
+    httpd_resp_send(req, (const char *)resp_context, length);
+    return ESP_OK;
+}
 //--------------------------------------------
 esp_err_t get_mode_js(httpd_req_t *req)
 {
@@ -764,6 +1152,12 @@ httpd_uri_t http_server_handlers[] =
         .handler  = get_mode_js,
         .user_ctx = NULL,
     },
+    {
+        .uri      = GET_TITLE_CGI,
+        .method   = HTTP_GET,
+        .handler  = get_title_cgi,
+        .user_ctx = NULL,
+    },
     {
         .uri      = GET_WIFI_AP_CGI,
         .method   = HTTP_GET,
@@ -787,7 +1181,27 @@ httpd_uri_t http_server_handlers[] =
         .method   = HTTP_POST,
         .handler  = post_webradio_cgi,
         .user_ctx = NULL,
-    }
+    },
+#if RING_BUF_ENABLED
+    {
+        .uri      = GET_PLAYER_CGI,
+        .method   = HTTP_GET,
+        .handler  = get_player_cgi,
+        .user_ctx = NULL,
+    },
+    {
+        .uri      = POST_PLAYER_CGI,
+        .method   = HTTP_POST,
+        .handler  = post_player_cgi,
+        .user_ctx = NULL,
+    },
+    {
+        .uri      = GET_STATUS_CGI,
+        .method   = HTTP_GET,
+        .handler  = get_status_cgi,
+        .user_ctx = NULL,
+    },
+#endif
 };
 
 
@@ -807,212 +1221,277 @@ static void feed(uint8_t *buf, size_t size)
         {
             break;
         }
-		delay_ms(10);
+		// Sleep until the player frees enough space
+		ring_buf_audio_wait_write(size - len, RING_BUF_WAIT_MS);
 	}
 #else
-	vs1053_write_data(buf, size);
+	if (vs1053_write_data(buf, size) < 0)
+	{
+		// DREQ stuck low, the codec hangs
+		vs1053_reset();
+	}
 #endif
 }
 
 //--------------------------------------------
-static int webradio_recv_cb(uint8_t *pdata, size_t len, bool init)
+// Audio bytes are moved in place to the front of pdata over the removed
+// ICY metadata bytes, returns the resulting length.
+static size_t webradio_recv_cb(uint8_t *pdata, size_t len)
 {
-	static size_t icy_metaint;
-	static size_t icy_metaint_cnt;
-	static size_t skip_next_bytes;
-	static size_t icy_buf_cnt;
+	icy_span_t span;
+	size_t buf_cnt = 0;
+	size_t out_cnt = 0;
 
-	if (init)
-	{
-		icy_metaint = 0;
-		icy_metaint_cnt = 0;
-		skip_next_bytes = 0;
-		icy_buf_cnt = 0;
-		return 0;
-	}
-	if (webradio_state == webradio_html_header)
+	while (buf_cnt < len)
 	{
-		size_t html_block_length;
-		uint8_t *str;
-
-//        ESP_LOGI(TAG, "Webradio HTML header: %s", (char const *)pdata);
-		str = (uint8_t *)strstr((char const *)pdata, "\r\n\r\n");
-		if (!str)
-		{
-			return 1;
-		}
-		html_block_length = str - pdata + 4;
-		webradio_state = webradio_audio_stream;
-		str = (uint8_t *)strstr((char const *)pdata, "icy-metaint:");
-		if (str)
+		buf_cnt += icy_demux_next(&icy_demux, pdata + buf_cnt, len - buf_cnt, &span);
+		if (span.type == icy_span_meta && now_playing_update(span.data, span.size))
 		{
-			icy_metaint = strtol((const char *)(str + 12), NULL, 10);
-			icy_metaint_cnt = 0;
+			title_notify();
 		}
-		else
+		if (span.type != icy_span_audio)
 		{
-			icy_metaint = 0;
+			continue;
 		}
-        ESP_LOGI(TAG, "icy_metaint: %d", icy_metaint);
-        ESP_LOGI(TAG, "icy_metaint_cnt: %d", icy_metaint_cnt);
-        ESP_LOGI(TAG, "html_block_length: %d", html_block_length);
-        ESP_LOGI(TAG, "len: %d", len);
-		if (html_block_length == len)
+		if (span.data != pdata + out_cnt)
 		{
-			return 2;
+			memmove(pdata + out_cnt, span.data, span.size);
 		}
-		skip_next_bytes = html_block_length;
+		out_cnt += span.size;
 	}
+#if RING_BUF_ENABLED
+	// streams without icy-br take the bitrate from the first frame header
+	ring_buf_audio_detect_bitrate(pdata, out_cnt);
+#endif
+	return out_cnt;
+}
 
-	size_t meta_size = 0;
-	size_t buf_cnt = 0;
-	size_t size_to_play = 0;
+//--------------------------------------------
+// returns the number of header bytes at the start of pdata once
+// the header is complete, 0 if it goes on in the next read
+static int check_html_header_status_code(uint8_t *pdata, size_t len, uint32_t *status)
+{
+	int res;
 
-	while (buf_cnt < len)
+	res = http_header_parse(&http_header, pdata, len);
+	if (res <= 0)
 	{
-		if (icy_metaint && !skip_next_bytes && (buf_cnt + (icy_metaint - icy_metaint_cnt) < len))
-		{
-			size_to_play = icy_metaint - icy_metaint_cnt;
-			meta_size = pdata[buf_cnt + size_to_play];
-			meta_size = meta_size * 16 + 1;
-		}
-		else
-		{
-			size_to_play = len - buf_cnt;
-		}
-		if (!skip_next_bytes)
-		{
-			feed(pdata + buf_cnt, size_to_play);
-			buf_cnt += size_to_play;
-			if (icy_metaint)
-			{
-				icy_metaint_cnt += size_to_play;
-				if (icy_metaint_cnt == icy_metaint)
-				{
-					skip_next_bytes = meta_size;
-				}
-				else
-				{
-					skip_next_bytes = 0;
-				}
-			}
-			continue;
-		}
-		if (skip_next_bytes)
+		return res;
+	}
+	*status = http_header.status;
+	if (http_header_is_redirect(&http_header))
+	{
+		// Redirect, a cut URL would lead somewhere else
+		if (!http_header.location[0] || http_header.location_cut)
 		{
-			if (len - buf_cnt < skip_next_bytes)
-			{
-				if (icy_metaint && icy_metaint_cnt)
-				{
-					size_t copy_bytes;
-					copy_bytes = sizeof(icy_buf) - icy_buf_cnt < len - buf_cnt ? sizeof(icy_buf) - icy_buf_cnt : len - buf_cnt;
-					if (icy_buf_cnt >= sizeof(icy_buf) || copy_bytes > sizeof(icy_buf) - icy_buf_cnt)
-					{
-						return -1;
-					}
-					else
-					{
-						memcpy(icy_buf + icy_buf_cnt, pdata + buf_cnt, copy_bytes);
-					}
-					icy_buf_cnt += len - buf_cnt;
-				}
-				size_to_play = 0;
-				skip_next_bytes = skip_next_bytes - (len - buf_cnt);
-				buf_cnt = len;
-			}
-			else
-			{
-				if (icy_metaint && icy_metaint_cnt)
-				{
-					size_t copy_bytes;
-					copy_bytes = sizeof(icy_buf) - icy_buf_cnt < skip_next_bytes ? sizeof(icy_buf) - icy_buf_cnt : skip_next_bytes;
-					if (icy_buf_cnt >= sizeof(icy_buf) || copy_bytes > sizeof(icy_buf) - icy_buf_cnt)
-					{
-						return -2;
-					}
-					else
-					{
-						memcpy(icy_buf + icy_buf_cnt, pdata + buf_cnt, copy_bytes);
-					}
-					icy_buf_cnt = 0;
-					icy_metaint_cnt = 0;
-				}
-				size_to_play -= skip_next_bytes;
-				buf_cnt += skip_next_bytes;
-				skip_next_bytes = 0;
-			}
-			continue;
+			return -2;
 		}
+		load_webradio_location_from_buf(http_header.location, strlen(http_header.location));
+		playlist_redirected(*status == 301 || *status == 308);
 	}
-	return 0;
+	else
+	{
+		// No redirect, use server list
+		webradio.use_list = true;
+	}
+	return res;
 }
 
 //--------------------------------------------
-#define HTTP_VER1_0          "HTTP/1.0"
-#define HTTP_VER1_1          "HTTP/1.1"
-#define HTTP_LOCATION        "Location:"
-#define HTTP_STRING_END      "\r\n"
-#define HTTP_HEADER_END      "\r\n\r\n"
+#define HTTP_PREFIX          "http://"
+#define HTTPS_PREFIX         "https://"
+#define GET_REQUEST_FORMAT   "GET /%s HTTP/1.1\r\nHost:%s\r\nicy-metadata:1\r\n\r\n"
 
 //--------------------------------------------
-static int check_html_header_status_code(uint8_t *pdata, size_t len, uint32_t *status)
+// scheme, host and port are the same
+static bool is_same_server(const char *uri1, const char *uri2)
 {
-	size_t hlen = sizeof(HTTP_VER1_0) - 1;
-	char *beg;
-	char *end;
+	const char *host1;
+	const char *host2;
+	size_t len;
+
+	host1 = strstr(uri1, "://");
+	host1 = host1 ? host1 + 3 : uri1;
+	host2 = strstr(uri2, "://");
+	host2 = host2 ? host2 + 3 : uri2;
+	len = (host1 - uri1) + strcspn(host1, "/");
+	return len == (host2 - uri2) + strcspn(host2, "/") && !strncasecmp(uri1, uri2, len);
+}
 
-	beg = strstr((char const *)pdata, HTTP_HEADER_END);
-	if (!beg)
+//--------------------------------------------
+// the request for the new location goes over the connection of the previous one
+// if the server is the same and the previous response has been read to its end
+static int webradio_request(short sock_id, const char *prev_location)
+{
+	const char *url;
+	const char *urn;
+	char *domain;
+	size_t domain_len;
+	char *get_request;
+	volatile int res;
+
+	if ((!http_header.chunked && !http_header.has_length) || http_header.connection_close ||
+		!is_same_server(prev_location, webradio.location))
 	{
 		return -1;
 	}
-	// Verify HTTP version is 1.1 or 1.0
-	if (strncmp((char const*)pdata, HTTP_VER1_0, hlen) &&
-		strncmp((char const*)pdata, HTTP_VER1_1, hlen))
+	url = strstr(webradio.location, "://");
+	url = url ? url + 3 : webradio.location;
+	domain_len = strcspn(url, ":/");
+	urn = strchr(url, '/');
+	urn = urn ? urn + 1 : "";
+	domain = malloc(domain_len + 1);
+	if (!domain)
 	{
 		return -2;
 	}
-	*status = strtoul((char const*)(pdata + hlen), NULL, 10);
-	if (!*status)
+	domain[domain_len] = '\0';
+	strncpy(domain, url, domain_len);
+	get_request = malloc(sizeof(GET_REQUEST_FORMAT) + domain_len + strlen(urn));
+	if (!get_request)
 	{
-		return -3;
+		free(domain);
+		return -2;
+	}
+	sprintf(get_request, GET_REQUEST_FORMAT, urn, domain);
+	res = wr_send(sock_id, get_request, strlen(get_request), 0);
+	free(get_request);
+	free(domain);
+	return res < 0 ? -3 : 0;
+}
+
+//--------------------------------------------
+// the next segment, or the media playlist once more
+static int load_hls_location(int res)
+{
+	if (res >= 0)
+	{
+		res = hls_next(webradio.location, sizeof(webradio.location));
 	}
-	if (*status == 201 || *status == 301 || *status == 302 || *status == 303 || *status == 307 || *status == 308)
+	if (res < 0)
 	{
-		// Redirect
-		beg = strstr((char const *)pdata, HTTP_LOCATION);
-		end = strstr((char const *)beg, HTTP_STRING_END);
-		if (!beg || !end)
-		{
-			return -4;
-		}
-		beg += sizeof(HTTP_LOCATION) - 1;
-		if (*beg == ' ')
+		ESP_LOGI(TAG, "HLS stream is over.");
+		hls_close();
+		webradio.use_list = true;
+		return -2;
+	}
+	if (res > 0 && hls_get_wait_ms())
+	{
+		// Nothing new in the playlist yet
+		delay_ms(hls_get_wait_ms());
+	}
+	webradio.use_list = false;
+	return 0;
+}
+
+//--------------------------------------------
+// the first entry of the received playlist is the next location,
+// an HLS media playlist gives the next segment
+static int load_playlist(void)
+{
+	int res;
+
+	if (hls_is_open())
+	{
+		// the refreshed media playlist
+		return load_hls_location(hls_update());
+	}
+	res = playlist_parse(webradio.location);
+	if (res == PLAYLIST_HLS)
+	{
+		hls_open();
+		if (hls_update() >= 0)
 		{
-			beg += 1;
+			ESP_LOGI(TAG, "HLS stream.");
+			// Later tunes of the station go straight to the media playlist
+			playlist_resolved(webradio.location);
+			save_redirects();
+#if RING_BUF_ENABLED
+			ring_buf_audio_set_bitrate(0);
+#endif
+			if (now_playing_clear())
+			{
+				title_notify();
+			}
+			return load_hls_location(0);
 		}
-		load_webradio_location_from_buf(beg, end - beg);
+		hls_close();
 	}
-	else
+	if (res < 0 || !load_playlist_location())
 	{
-		// No redirect, use server list
-		webradio.use_list = true;
+		ESP_LOGI(TAG, "No stream in the playlist.");
+		set_next_webradio();
+		return -4;
 	}
 	return 0;
 }
 
+//--------------------------------------------
+// the audio of an HLS segment goes to the player
+static void feed_segment(uint8_t *pdata, size_t len)
+{
+	const uint8_t *data;
+	size_t data_size;
+	size_t buf_cnt = 0;
+
+	while (buf_cnt < len)
+	{
+		buf_cnt += ts_demux_next(&ts_demux, pdata + buf_cnt, len - buf_cnt, &data, &data_size);
+		if (data_size)
+		{
+			feed((uint8_t *)data, data_size);
+		}
+	}
+}
+
 //--------------------------------------------
 static int webradio_recv(short sock_id)
 {
 	static uint8_t recv_buf[RECV_BUFFER_SIZE];
+	static char prev_location[MAX_LOCATION_LENGTH];
     volatile int res;
+	uint8_t *buf;
+	size_t buf_len;
 	size_t len;
+	size_t audio_len;
+	size_t body_pos;
+	size_t body_len = 0;
 	uint32_t status;
+	int next_res;
+	bool reused = false;
 
-	webradio_recv_cb(NULL, 0, true);
+	http_header_init(&http_header);
 	while (1)
 	{
-        res = wr_recv(sock_id, &recv_buf, sizeof(recv_buf), 0);
+#if RING_BUF_ENABLED
+		if (webradio_state == webradio_audio_stream)
+		{
+			// Receive straight into the free span of the audio ring buffer
+			res = ring_buf_audio_reserve_write(&buf);
+			if (res <= 0)
+			{
+				// Sleep until the player frees a receive buffer worth of space
+				ring_buf_audio_wait_write(RECV_BUFFER_SIZE, RING_BUF_WAIT_MS);
+				continue;
+			}
+			buf_len = (size_t)res;
+		}
+		else
+#endif
+		{
+			buf = recv_buf;
+			buf_len = sizeof(recv_buf);
+		}
+		// Sleep only while no data is pending
+		res = wr_select(sock_id, RECV_WAIT_MS);
+		if (res == 0)
+		{
+			continue;
+		}
+		if (res > 0)
+		{
+			res = wr_recv(sock_id, buf, buf_len, 0);
+		}
 		len = (uint32_t)res;
 		if (res < 0)
 		{
@@ -1032,10 +1511,24 @@ static int webradio_recv(short sock_id)
 			{
 				fatal_error();
 			}
+			if (webradio_state == webradio_playlist)
+			{
+				// The playlist ends with the connection
+				return load_playlist();
+			}
+			if (webradio_state == webradio_hls_segment)
+			{
+				return load_hls_location(0);
+			}
+			if (reused && webradio_state == webradio_html_header)
+			{
+				// The server has not kept the connection, a new one is made
+				return 0;
+			}
 			return -2;
 		}
-#ifdef DEBUG_INT
-		check_debug_int(&tcp_debug_int, len);
+#if RING_BUF_ENABLED
+		ring_buf_audio_mark_stage(ring_buf_audio_stage_tcp);
 #endif
 		if (webradio_state == webradio_load_location)
 		{
@@ -1047,13 +1540,27 @@ static int webradio_recv(short sock_id)
 			}
 			return -3;
 		}
+		body_pos = 0;
 		if (webradio_state == webradio_html_header)
 		{
 			res = check_html_header_status_code(recv_buf, len, &status);
 			if (res < 0)
 			{
-				fatal_error();
+				ESP_LOGI(TAG, "Error in HTTP header parsing.");
+			    res = wr_close(sock_id);
+				if (res < 0)
+				{
+					fatal_error();
+				}
+				webradio.use_list = true;
+				return -4;
+			}
+			if (res == 0)
+			{
+				// The header goes on in the next read
+				continue;
 			}
+			body_pos = (size_t)res;
 			if (status != 200)
 			{
 				// Redirect or error
@@ -1067,12 +1574,55 @@ static int webradio_recv(short sock_id)
 					// redirect
 					return 0;
 				}
+				else if (hls_is_open() && !hls_is_refresh())
+				{
+					// A segment that has gone is skipped, only a failed
+					// media playlist ends the HLS stream
+					return load_hls_location(0);
+				}
 				else
 				{
-					// error
+					// error, the next playlist entry if there is one
+					load_playlist_location();
 					return -4;
 				}
 			}
+			http_chunked_init(&http_chunked);
+			if (playlist_is_playlist(http_header.content_type, webradio.location))
+			{
+				// The playlist is parsed once its body is complete
+				ESP_LOGI(TAG, "Playlist: %s", http_header.content_type);
+				playlist_open();
+				hls_begin(webradio.location);
+				body_len = 0;
+				webradio_state = webradio_playlist;
+			}
+			else if (hls_is_open())
+			{
+				// The next segment of the HLS stream
+				ts_demux_init(&ts_demux);
+				body_len = 0;
+				webradio_state = webradio_hls_segment;
+			}
+			else
+			{
+                ESP_LOGI(TAG, "icy_metaint: %u", (unsigned int)http_header.icy_metaint);
+                ESP_LOGI(TAG, "icy_br: %u", (unsigned int)http_header.icy_br);
+                ESP_LOGI(TAG, "header_length: %u", (unsigned int)body_pos);
+#if RING_BUF_ENABLED
+				// the stream bitrate converts the player watermarks from ms to bytes
+				ring_buf_audio_set_bitrate(http_header.icy_br);
+#endif
+				icy_demux_init(&icy_demux, http_header.icy_metaint, icy_buf, sizeof(icy_buf));
+				if (now_playing_clear())
+				{
+					title_notify();
+				}
+				// Later tunes of the station skip its playlist and redirects
+				playlist_resolved(webradio.location);
+				save_redirects();
+				webradio_state = webradio_audio_stream;
+			}
 		}
 		if (webradio_state == webradio_not_connected)
 		{
@@ -1084,28 +1634,89 @@ static int webradio_recv(short sock_id)
 			}
 			return 0;
 		}
-		res = webradio_recv_cb(recv_buf, len, false);
-		if (res < 0)
+		if (http_header.chunked)
 		{
-			// Not supported
-            ESP_LOGI(TAG, "Error in audio stream parsing.");
-		    res = wr_close(sock_id);
+			// Chunk size lines are dropped in place before the ICY demuxer
+			res = http_chunked_decode(&http_chunked, buf + body_pos, len - body_pos);
+			if (res < 0)
+			{
+				ESP_LOGI(TAG, "Error in HTTP chunk parsing.");
+				res = wr_close(sock_id);
+				if (res < 0)
+				{
+					fatal_error();
+				}
+				return -4;
+			}
+			if (webradio_state == webradio_audio_stream && http_chunked_is_done(&http_chunked))
+			{
+				// The last chunk ends the stream as a closed connection would
+				ESP_LOGI(TAG, "Connection closed.");
+				res = wr_close(sock_id);
+				if (res < 0)
+				{
+					fatal_error();
+				}
+				return -2;
+			}
+			len = body_pos + (size_t)res;
+		}
+		if (webradio_state == webradio_playlist || webradio_state == webradio_hls_segment)
+		{
+			if (!http_header.chunked && http_header.has_length && body_len + len - body_pos > http_header.content_length)
+			{
+				// Nothing beyond the body
+				len = body_pos + http_header.content_length - body_len;
+			}
+			if (webradio_state == webradio_playlist)
+			{
+				playlist_append(buf + body_pos, len - body_pos);
+				// a media playlist may be longer than the playlist body
+				hls_append(buf + body_pos, len - body_pos);
+			}
+			else
+			{
+				feed_segment(buf + body_pos, len - body_pos);
+			}
+			body_len += len - body_pos;
+			if ((http_header.chunked && !http_chunked_is_done(&http_chunked)) ||
+				(!http_header.chunked && (!http_header.has_length || body_len < http_header.content_length)))
+			{
+				// The body goes on in the next read
+				continue;
+			}
+			snprintf(prev_location, sizeof(prev_location), "%s", webradio.location);
+			next_res = webradio_state == webradio_playlist ? load_playlist() : load_hls_location(0);
+			if (next_res == 0 && webradio_request(sock_id, prev_location) == 0)
+			{
+				// The next response comes over the same connection
+				http_header_init(&http_header);
+				webradio_state = webradio_html_header;
+				reused = true;
+				continue;
+			}
+			res = wr_close(sock_id);
 			if (res < 0)
 			{
 				fatal_error();
 			}
-			set_next_webradio();
-			return -5;
+			return next_res;
+		}
+		// Body bytes that came with the header go straight to the audio path
+		audio_len = webradio_recv_cb(buf + body_pos, len - body_pos);
+#if RING_BUF_ENABLED
+		if (buf != recv_buf)
+		{
+			ring_buf_audio_commit_write(audio_len);
+		}
+		else
+#endif
+		{
+			feed(buf + body_pos, audio_len);
 		}
-        delay_ms(10);
 	}
 }
 
-//--------------------------------------------
-#define HTTP_PREFIX          "http://"
-#define HTTPS_PREFIX         "https://"
-#define GET_REQUEST_FORMAT   "GET /%s HTTP/1.1\r\nHost:%s\r\nicy-metadata:1\r\n\r\n"
-
 //--------------------------------------------
 static int webradio_connect(const char *uri, int *sock_id)
 {
@@ -1254,6 +1865,7 @@ static void start_webserver(void)
     size_t cnt;
     httpd_handle_t server = NULL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    TimerHandle_t timer;
 
     config.max_uri_handlers = sizeof(http_server_handlers)/sizeof(httpd_uri_t);
 
@@ -1275,6 +1887,13 @@ static void start_webserver(void)
             return;
         }
     }
+    http_server = server;
+    // held title requests time out even if the title does not change
+    timer = xTimerCreate("title", pdMS_TO_TICKS(TITLE_CHECK_MS), pdTRUE, NULL, title_timer_cb);
+    if (timer)
+    {
+        xTimerStart(timer, 0);
+    }
 }
 
 //--------------------------------------------
@@ -1309,31 +1928,9 @@ static int wifi_ap_connect(wifi_config_t *wifi_config)
 #if RING_BUF_ENABLED
 void play_task(void *pvParameters)
 {
-	bool start = false;
-	static uint8_t buf[PLAY_BUFFER_SIZE];
-	size_t size;
-
 	while (1)
 	{
-		switch (ring_buf_audio_get_percentage_fill())
-		{
-		case 0:
-			start = false;
-			break;
-		case 100:
-			start = true;
-			break;
-		}
-		if (start)
-		{
-			size = ring_buf_audio_get(buf, sizeof(buf));
-			vs1053_write_data(buf, size);
-			delay_ms(10);
-		}
-		else
-		{
-			delay_ms(500);
-		}
+		player_run();
 	}
 }
 #endif
@@ -1352,9 +1949,11 @@ void app_main()
 
 #if RING_BUF_ENABLED
 	ring_buf_audio_init();
-    xTaskCreate(play_task, "player", PLAY_TASK_STACK_SIZE, NULL, PLAY_TASK_PRIORITY, NULL);
+	load_player();
+    xTaskCreate(play_task, "player", PLAY_TASK_STACK_SIZE, NULL, PLAY_TASK_PRIORITY, &play_task_handle);
 #endif
 
+	load_redirects();
 	set_first_webradio();
 	webradio_state = webradio_not_connected;
     wifi_mode = 0;
@@ -1415,8 +2014,11 @@ void app_main()
 		res = webradio_connect(webradio.location, &sock_id);
 		if (res < 0)
 		{
-			set_next_webradio();
 			ESP_LOGE(TAG, "webradio_connect error %d", res);
+			if (!load_playlist_location())
+			{
+				set_next_webradio();
+			}
 			continue;
 		}
 		webradio_state = webradio_html_header;
@@ -1425,9 +2027,14 @@ void app_main()
 		{
 			// New audio stream
 #if RING_BUF_ENABLED
+			// The player cancels decoding once the new stream starts
 			ring_buf_audio_clear();
+#else
+			if (vs1053_cancel() < 0)
+			{
+				vs1053_reset();
+			}
 #endif
-			vs1053_reset();
 		}
 	}
 }
@@ -0,0 +1,263 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdio.h>      /* printf */
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, malloc, abort, strtoul */
+#include <string.h>     /* memcpy, memmove, memset */
+#include <stdbool.h>    /* bool */
+#include <unistd.h>     /* getopt */
+#include <time.h>       /* clock_gettime */
+#include "icy_demux.h"
+#include "host_test.h"
+
+//--------------------------------------------
+// Throughput of the receive path of webradio_recv_cb: a read is copied
+// into the receive buffer as recv does, icy_demux splits it and the
+// audio is moved in place over the metadata. The copy alone is timed
+// as well, the difference is what the demuxer costs.
+
+//--------------------------------------------
+// Same as the network task of webradio.c
+#define RECV_BUFFER_SIZE           1024
+#define ICY_BUFFER_SIZE            1024
+
+//--------------------------------------------
+#define NS_PER_S                   1000000000ULL
+#define STREAM_SIZE                (4 * 1024 * 1024)
+#define TITLE_EVERY                8        // metadata blocks
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t metaint;
+	uint32_t read_size;
+	uint32_t megabytes;
+} options_t;
+static options_t options =
+{
+	.metaint = 16000,
+	.read_size = RECV_BUFFER_SIZE,
+	.megabytes = 256
+};
+
+//--------------------------------------------
+typedef struct
+{
+	uint8_t *data;
+	size_t size;
+	uint64_t audio_len;
+	uint32_t audio_hash;
+	uint32_t titles;
+} stream_t;
+static stream_t stream;
+
+//--------------------------------------------
+typedef struct
+{
+	icy_demux_t demux;
+	uint8_t meta_buf[ICY_BUFFER_SIZE];
+	uint8_t recv_buf[RECV_BUFFER_SIZE];
+	uint64_t audio_len;
+	uint32_t audio_hash;
+	uint32_t titles;
+} receiver_t;
+static receiver_t rx;
+
+//--------------------------------------------
+// audio of noise, mostly empty metadata and now and then a title
+static void stream_make(stream_t *s)
+{
+	static const char title[] = "StreamTitle='Artist - A Title Of A Song';StreamUrl='';";
+	uint32_t seed = 1;
+	uint32_t blocks = 0;
+	size_t audio_left = options.metaint;
+	size_t len;
+
+	s->data = malloc(STREAM_SIZE);
+	if (!s->data)
+	{
+		abort();
+	}
+	s->size = 0;
+	s->audio_len = 0;
+	s->audio_hash = 2166136261U;
+	s->titles = 0;
+	while (s->size < STREAM_SIZE)
+	{
+		if (!options.metaint || audio_left)
+		{
+			s->data[s->size] = (uint8_t)host_test_rand(&seed);
+			s->audio_hash = host_test_hash(s->audio_hash, &s->data[s->size++], 1);
+			s->audio_len++;
+			audio_left--;
+			continue;
+		}
+		audio_left = options.metaint;
+		len = ++blocks % TITLE_EVERY ? 0 : (sizeof(title) + 15) / 16;
+		if (s->size + 1 + len * 16 > STREAM_SIZE)
+		{
+			break;
+		}
+		s->data[s->size++] = (uint8_t)len;
+		memset(s->data + s->size, 0, len * 16);
+		memcpy(s->data + s->size, title, len ? sizeof(title) - 1 : 0);
+		s->size += len * 16;
+		s->titles += len ? 1 : 0;
+	}
+}
+
+//--------------------------------------------
+// webradio_recv_cb
+static size_t receiver_body(receiver_t *r, uint8_t *pdata, size_t len)
+{
+	icy_span_t span;
+	size_t buf_cnt = 0;
+	size_t out_cnt = 0;
+
+	while (buf_cnt < len)
+	{
+		buf_cnt += icy_demux_next(&r->demux, pdata + buf_cnt, len - buf_cnt, &span);
+		if (span.type == icy_span_meta && span.size)
+		{
+			r->titles++;
+		}
+		if (span.type != icy_span_audio)
+		{
+			continue;
+		}
+		if (span.data != pdata + out_cnt)
+		{
+			memmove(pdata + out_cnt, span.data, span.size);
+		}
+		out_cnt += span.size;
+	}
+	return out_cnt;
+}
+
+//--------------------------------------------
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+//--------------------------------------------
+// the whole stream once, demuxed or only copied; verify hashes the audio
+static void run_stream(bool demux, bool verify)
+{
+	size_t offset;
+	size_t len;
+	size_t out_len;
+
+	icy_demux_init(&rx.demux, options.metaint, rx.meta_buf, sizeof(rx.meta_buf));
+	for (offset = 0; offset < stream.size; offset += len)
+	{
+		len = stream.size - offset < options.read_size ? stream.size - offset : options.read_size;
+		memcpy(rx.recv_buf, stream.data + offset, len);
+		if (!demux)
+		{
+			continue;
+		}
+		out_len = receiver_body(&rx, rx.recv_buf, len);
+		rx.audio_len += out_len;
+		if (verify)
+		{
+			rx.audio_hash = host_test_hash(rx.audio_hash, rx.recv_buf, out_len);
+		}
+	}
+}
+
+//--------------------------------------------
+// ns of all passes over the stream that make up the megabytes
+static uint64_t time_passes(bool demux, uint32_t passes)
+{
+	uint64_t start = now_ns();
+	uint32_t cnt;
+
+	for (cnt = 0; cnt < passes; cnt++)
+	{
+		run_stream(demux, false);
+	}
+	return now_ns() - start;
+}
+
+//--------------------------------------------
+static void usage(const char *name)
+{
+	printf("usage: %s [-m metaint] [-r read size] [-n megabytes]\n", name);
+	printf("  -m  audio bytes between metadata blocks, 0 - none (%u)\n", (unsigned int)options.metaint);
+	printf("  -r  bytes per read, up to %u (%u)\n", RECV_BUFFER_SIZE, (unsigned int)options.read_size);
+	printf("  -n  megabytes to run through (%u)\n", (unsigned int)options.megabytes);
+}
+
+//--------------------------------------------
+int main(int argc, char *argv[])
+{
+	uint64_t copy_ns;
+	uint64_t demux_ns;
+	uint64_t reads;
+	uint64_t bytes;
+	uint32_t passes;
+	bool ok;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:r:n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'm':
+			options.metaint = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			options.read_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			options.megabytes = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	if (!options.read_size || options.read_size > RECV_BUFFER_SIZE)
+	{
+		usage(argv[0]);
+		return 2;
+	}
+	stream_make(&stream);
+	passes = (uint32_t)(((uint64_t)options.megabytes * 1024 * 1024 + stream.size - 1) / stream.size);
+	passes = passes ? passes : 1;
+
+	rx.audio_hash = 2166136261U;
+	run_stream(true, true);
+	ok = rx.audio_len == stream.audio_len && rx.audio_hash == stream.audio_hash && rx.titles == stream.titles;
+
+	copy_ns = time_passes(false, passes);
+	demux_ns = time_passes(true, passes);
+	bytes = (uint64_t)stream.size * passes;
+	reads = (bytes + options.read_size - 1) / options.read_size;
+	printf("icy_demux: metaint %u, %u byte reads, %u MB\n", (unsigned int)options.metaint,
+		(unsigned int)options.read_size, (unsigned int)(bytes >> 20));
+	printf("stream: %u bytes, %llu audio, %u titles, audio %s\n", (unsigned int)stream.size,
+		(unsigned long long)stream.audio_len, (unsigned int)stream.titles, ok ? "matches" : "DIFFERS");
+	printf("copy: %.0f MB/s, demux: %.0f MB/s, %.1f ns per read over the copy\n",
+		(double)bytes * 1000 / copy_ns, (double)bytes * 1000 / demux_ns,
+		demux_ns > copy_ns ? (double)(demux_ns - copy_ns) / reads : 0.0);
+	printf("%s\n", ok ? "ok" : "FAILED");
+	free(stream.data);
+	return ok ? 0 : 1;
+}
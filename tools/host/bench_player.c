@@ -0,0 +1,431 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdio.h>      /* printf */
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, strtoul */
+#include <string.h>     /* memset */
+#include <stdbool.h>    /* bool */
+#include <unistd.h>     /* getopt */
+#include <time.h>       /* clock_gettime */
+#include <pthread.h>    /* pthread_create */
+#include "hal-spi-vs1003.h"
+#include "vs1053.h"
+#include "vs1053-regs.h"
+#include "ring_buf_audio.h"
+#include "player.h"
+#include "hal-spi-vs1003-sim.h"
+#include "host_time.h"
+
+//--------------------------------------------
+// the plugin image under another name, vs1053-spi.c owns vs1053_plugin
+#define vs1053_plugin plugin_image
+#include "vs1053-plugin.h"
+#undef vs1053_plugin
+
+//--------------------------------------------
+// Same as the network task of webradio.c
+#define RECV_BUFFER_SIZE           1024
+#define RING_BUF_WAIT_MS           100
+
+//--------------------------------------------
+#define NS_PER_S                   1000000000ULL
+#define FRAME_MAX_SIZE             1441     // 320 kbps, 32000 Hz, padded
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t bitrate_kbps;
+	uint32_t network_kbps;     // 0 - as fast as the buffer takes it
+	uint32_t seconds;
+	uint32_t speed;
+	uint32_t stall_s;          // the decoder hangs after this, 0 - never
+	uint32_t vbr_spread;       // VBR frame bitrates around the average
+} options_t;
+static options_t options =
+{
+	.bitrate_kbps = 128,
+	.network_kbps = 0,
+	.seconds = 20,
+	.speed = 10
+};
+
+//--------------------------------------------
+// MPEG-1 layer III frames at 44100 Hz, the payload is noise.
+// Other bitrates are a headerless stream, the codec takes it for WAV.
+typedef struct
+{
+	uint8_t frame[FRAME_MAX_SIZE];
+	size_t length;
+	size_t offset;
+	uint8_t index;
+	uint32_t padding;
+	uint32_t seed;
+	uint32_t sum;
+} stream_t;
+static stream_t stream;
+
+//--------------------------------------------
+typedef struct
+{
+	volatile bool running;
+	uint64_t start_ns;
+	uint64_t total;
+	uint64_t sent;
+	uint32_t underruns;
+	uint32_t resizes;
+	uint64_t cpu_ns;
+} bench_t;
+static bench_t bench;
+
+//--------------------------------------------
+static const uint16_t mp3_bitrates[14] =
+{
+	32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320
+};
+
+//--------------------------------------------
+static void stream_next_frame(stream_t *s)
+{
+	uint32_t size = 144000 * options.bitrate_kbps;
+	size_t cnt = 0;
+	uint8_t pad;
+
+	s->length = sizeof(s->frame);
+	if (s->index)
+	{
+		// padding slots keep the average at the bitrate
+		s->padding += size % 44100;
+		pad = s->padding >= 44100;
+		if (pad)
+		{
+			s->padding -= 44100;
+		}
+		s->length = size / 44100 + pad;
+		s->frame[cnt++] = 0xFF;
+		s->frame[cnt++] = 0xFB;
+		s->frame[cnt++] = (uint8_t)(s->index << 4 | pad << 1);
+		s->frame[cnt++] = 0x00;
+	}
+	for (; cnt < s->length; cnt++)
+	{
+		s->seed = s->seed * 1103515245 + 12345;
+		s->frame[cnt] = (uint8_t)(s->seed >> 16);
+	}
+	s->offset = 0;
+}
+
+//--------------------------------------------
+static void stream_read(stream_t *s, uint8_t *buf, size_t size)
+{
+	size_t cnt;
+
+	for (cnt = 0; cnt < size; cnt++)
+	{
+		if (s->offset == s->length)
+		{
+			stream_next_frame(s);
+		}
+		buf[cnt] = s->frame[s->offset++];
+		s->sum = vs1053_sim_checksum(s->sum, buf[cnt]);
+	}
+}
+
+//--------------------------------------------
+// the network task: a new stream at the network rate
+static void *feed_thread(void *param)
+{
+	uint64_t start = host_time_now_ns();
+	uint64_t due;
+	ring_buf_audio_stats_t stats;
+	uint8_t *buf;
+	int size;
+
+	(void)param;
+	ring_buf_audio_clear();
+	ring_buf_audio_set_bitrate(options.bitrate_kbps);
+	while (bench.sent < bench.total)
+	{
+		if (options.network_kbps)
+		{
+			due = start + bench.sent * 8 * 1000000 / options.network_kbps;
+			if (due > host_time_now_ns())
+			{
+				host_time_sleep_until_ns(due);
+			}
+		}
+		size = ring_buf_audio_reserve_write(&buf);
+		if (size <= 0)
+		{
+			ring_buf_audio_wait_write(RECV_BUFFER_SIZE, RING_BUF_WAIT_MS);
+			continue;
+		}
+		if (size > RECV_BUFFER_SIZE)
+		{
+			size = RECV_BUFFER_SIZE;
+		}
+		if ((uint64_t)size > bench.total - bench.sent)
+		{
+			size = (int)(bench.total - bench.sent);
+		}
+		stream_read(&stream, buf, size);
+		ring_buf_audio_detect_bitrate(buf, size);
+		ring_buf_audio_commit_write(size);
+		bench.sent += size;
+	}
+	// the end of the stream is not an underrun
+	ring_buf_audio_get_stats(&stats);
+	bench.underruns = stats.underruns;
+	return NULL;
+}
+
+//--------------------------------------------
+static void *play_thread(void *param)
+{
+	struct timespec ts;
+	int length = ring_buf_audio_get_length();
+
+	(void)param;
+	while (bench.running)
+	{
+		player_run();
+		if (length != ring_buf_audio_get_length())
+		{
+			length = ring_buf_audio_get_length();
+			bench.resizes++;
+		}
+		if (options.stall_s && host_time_now_ns() - bench.start_ns >= options.stall_s * NS_PER_S)
+		{
+			vs1053_sim_set_stuck(1);
+			options.stall_s = 0;
+		}
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	bench.cpu_ns = (uint64_t)ts.tv_sec * NS_PER_S + ts.tv_nsec;
+	return NULL;
+}
+
+//--------------------------------------------
+// WRAM words of the plugin and their checksum
+static void plugin_words(uint32_t *words, uint32_t *sum)
+{
+	size_t cnt = 0;
+	unsigned short addr, n;
+
+	*words = 0;
+	*sum = 0;
+	while (cnt < sizeof(plugin_image) / sizeof(plugin_image[0]))
+	{
+		addr = plugin_image[cnt++];
+		n = plugin_image[cnt++];
+		if (n & 0x8000U)
+		{
+			n &= 0x7FFF;
+			for (; n; n--)
+			{
+				if (addr == VS1053_WRAM)
+				{
+					*sum = vs1053_sim_checksum(*sum, plugin_image[cnt]);
+					(*words)++;
+				}
+			}
+			cnt++;
+			continue;
+		}
+		for (; n; n--, cnt++)
+		{
+			if (addr == VS1053_WRAM)
+			{
+				*sum = vs1053_sim_checksum(*sum, plugin_image[cnt]);
+				(*words)++;
+			}
+		}
+	}
+}
+
+//--------------------------------------------
+static int check(bool ok, const char *what)
+{
+	if (!ok)
+	{
+		printf("FAIL: %s\n", what);
+	}
+	return ok ? 0 : 1;
+}
+
+//--------------------------------------------
+static int parse_options(int argc, char *argv[])
+{
+	size_t cnt;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "b:n:t:s:x:v:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b':
+			options.bitrate_kbps = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			options.network_kbps = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			options.seconds = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			options.speed = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			options.stall_s = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			options.vbr_spread = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			return -1;
+		}
+	}
+	for (cnt = 0; cnt < sizeof(mp3_bitrates) / sizeof(mp3_bitrates[0]); cnt++)
+	{
+		if (mp3_bitrates[cnt] == options.bitrate_kbps)
+		{
+			stream.index = (uint8_t)(cnt + 1);
+		}
+	}
+	return options.bitrate_kbps ? 0 : -1;
+}
+
+//--------------------------------------------
+int main(int argc, char *argv[])
+{
+	pthread_t feed;
+	pthread_t play;
+	vs1053_sim_stats_t sim;
+	vs1053_stats_t codec;
+	vs1053_status_t status;
+	ring_buf_audio_stats_t audio;
+	uint32_t words;
+	uint32_t sum;
+	uint64_t start;
+	uint64_t elapsed;
+	uint16_t decode_time;
+	bool stall;
+	int fails = 0;
+
+	if (parse_options(argc, argv) < 0)
+	{
+		fprintf(stderr, "usage: %s [-b bitrate kbps] [-n network kbps] [-t seconds] [-s speed] [-x stall after seconds] [-v vbr spread]\n", argv[0]);
+		return 2;
+	}
+	printf("bitrate %u kbps, network %u kbps, %u s of audio at %ux, decoder stall at %u s, vbr spread %u\n",
+		(unsigned int)options.bitrate_kbps, (unsigned int)options.network_kbps,
+		(unsigned int)options.seconds, (unsigned int)options.speed, (unsigned int)options.stall_s,
+		(unsigned int)options.vbr_spread);
+	stall = options.stall_s != 0;
+	host_time_init(options.speed);
+
+	// codec reset and plugin upload
+	start = host_time_now_ns();
+	vs1053_init_iface();
+	elapsed = host_time_now_ns() - start;
+	vs1053_sim_get_stats(&sim);
+	plugin_words(&words, &sum);
+	printf("init: %u us, %u plugin words, %u sci overruns\n",
+		(unsigned int)(elapsed / 1000), (unsigned int)sim.wram_words, (unsigned int)sim.sci_overruns);
+	fails += check(sim.wram_words == words && sim.wram_sum == sum, "plugin words lost or reordered");
+	// the AIADDR write that starts the plugin is still executed
+	hal_spi_vs1003_wait_dreq(VS1053_DREQ_TIMEOUT_MS);
+	fails += check(vs1053_read_register(VS1053_CLOCKF) == (VS1053_CLOCKF_MULT_XTALIx30 | VS1053_CLOCKF_ADDx10),
+		"CLOCKF");
+
+	// one stream from the network task through the player to the codec
+	vs1053_sim_set_bitrate(options.bitrate_kbps);
+	vs1053_sim_set_vbr(options.vbr_spread);
+	if (ring_buf_audio_init() < 0)
+	{
+		fprintf(stderr, "no memory for the audio buffer\n");
+		return 2;
+	}
+	bench.total = (uint64_t)options.bitrate_kbps * 1000 / 8 * options.seconds;
+	bench.running = true;
+	start = host_time_now_ns();
+	bench.start_ns = start;
+	pthread_create(&play, NULL, play_thread, NULL);
+	pthread_create(&feed, NULL, feed_thread, NULL);
+	pthread_join(feed, NULL);
+	while (ring_buf_audio_get_count() > 0)
+	{
+		host_time_sleep_ms(10);
+	}
+	bench.running = false;
+	pthread_join(play, NULL);
+	while (vs1053_sim_get_fifo_count())
+	{
+		host_time_sleep_ms(10);
+	}
+	elapsed = host_time_now_ns() - start;
+	decode_time = vs1053_read_register(VS1053_DECODE_TIME);
+	player_get_decoder_status(&status);
+	ring_buf_audio_get_stats(&audio);
+	vs1053_sim_get_stats(&sim);
+	vs1053_get_stats(&codec);
+
+	printf("stream: %u bytes, ring in %u out %u, %u bytes long, %u resizes, underruns %u while streaming\n",
+		(unsigned int)bench.total, (unsigned int)audio.bytes_in, (unsigned int)audio.bytes_out,
+		(unsigned int)audio.length, (unsigned int)bench.resizes, (unsigned int)bench.underruns);
+	printf("codec: sdi %u bytes in %u blocks, %u overflows, %u fifo underruns, decode time %u s, %s %u kbps\n",
+		(unsigned int)sim.sdi_bytes, (unsigned int)sim.sdi_blocks, (unsigned int)sim.sdi_overflows,
+		(unsigned int)sim.fifo_underruns, (unsigned int)decode_time,
+		status.codec ? status.codec : "none", (unsigned int)status.bitrate_kbps);
+	printf("sci: %u bytes, %u reads, %u writes, %u words, %u overruns, %u clock violations, %u cs conflicts\n",
+		(unsigned int)sim.sci_bytes, (unsigned int)sim.sci_reads, (unsigned int)sim.sci_writes,
+		(unsigned int)sim.sci_words,
+		(unsigned int)sim.sci_overruns, (unsigned int)sim.clock_violations, (unsigned int)sim.cs_conflicts);
+	printf("bus: %u.%01u%% busy, %u dreq waits, %u timeouts, %u cancels, %u resets\n",
+		(unsigned int)(sim.bus_ns * 100 / elapsed), (unsigned int)(sim.bus_ns * 1000 / elapsed % 10),
+		(unsigned int)sim.dreq_waits, (unsigned int)sim.dreq_timeouts,
+		(unsigned int)sim.cancels, (unsigned int)sim.resets);
+	printf("player: %u us host cpu per s of audio\n",
+		(unsigned int)(bench.cpu_ns / 1000 / (options.seconds ? options.seconds : 1)));
+
+	// FIFO underruns are not checked, the host scheduler adds to them
+	fails += check(audio.bytes_in == bench.total && audio.bytes_out == bench.total, "ring bytes in != out");
+	if (!stall)
+	{
+		fails += check(sim.sdi_bytes == bench.total && sim.sdi_sum == stream.sum, "stream bytes lost or reordered");
+		fails += check(decode_time + 1 >= options.seconds && decode_time <= options.seconds, "decode time");
+	}
+	// a stuck decoder is cancelled once, a sound one never
+	fails += check(sim.cancels == (stall ? 1 : 0) && sim.resets == 1, stall ? "stall not recovered" : "false stall");
+	// the firmware counters are what the status page shows
+	fails += check(codec.sci_reads == sim.sci_reads && codec.sci_writes == sim.sci_writes &&
+		codec.sdi_bursts == sim.sdi_blocks, "codec stats differ from the bus");
+	fails += check(!sim.sci_overruns, "SCI word while the codec was busy");
+	fails += check(!sim.sdi_overflows, "SDI bytes to a full FIFO");
+	fails += check(!sim.clock_violations, "SPI clock above CLKI limits");
+	fails += check(!sim.cs_conflicts, "XCS and XDCS low together");
+	fails += check(!sim.dreq_timeouts, "DREQ timeout");
+	if (stream.index && !options.vbr_spread)
+	{
+		fails += check(status.bitrate_kbps == options.bitrate_kbps, "decoder status bitrate");
+	}
+	// once for the stream bitrate, once more for the decoder's
+	fails += check(bench.resizes <= 2, "buffer resized with every bitrate swing");
+	if (!options.network_kbps || options.network_kbps > options.bitrate_kbps)
+	{
+		fails += check(!bench.underruns, "underrun with the network ahead of the stream");
+	}
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails ? 1 : 0;
+}
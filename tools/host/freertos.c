@@ -0,0 +1,116 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* malloc, free */
+#include <time.h>       /* struct timespec */
+#include <pthread.h>    /* pthread_mutex_t, pthread_cond_t */
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "host_time.h"
+
+//--------------------------------------------
+// Binary semaphore on a mutex and a condition variable
+struct host_semaphore
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int given;
+};
+
+//--------------------------------------------
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	SemaphoreHandle_t sem;
+	pthread_condattr_t attr;
+
+	sem = (SemaphoreHandle_t)malloc(sizeof(struct host_semaphore));
+	if (!sem)
+	{
+		return NULL;
+	}
+	pthread_mutex_init(&sem->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sem->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	sem->given = 0;
+	return sem;
+}
+
+//--------------------------------------------
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+	pthread_cond_destroy(&sem->cond);
+	pthread_mutex_destroy(&sem->lock);
+	free(sem);
+}
+
+//--------------------------------------------
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	BaseType_t res;
+
+	pthread_mutex_lock(&sem->lock);
+	res = sem->given ? pdFALSE : pdTRUE;
+	sem->given = 1;
+	pthread_cond_signal(&sem->cond);
+	pthread_mutex_unlock(&sem->lock);
+	return res;
+}
+
+//--------------------------------------------
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+	struct timespec ts;
+	int res = 0;
+
+	host_time_real_deadline(&ts, ticks == portMAX_DELAY ? 0 : ticks);
+	pthread_mutex_lock(&sem->lock);
+	while (!sem->given && res == 0)
+	{
+		if (ticks == portMAX_DELAY)
+		{
+			pthread_cond_wait(&sem->cond, &sem->lock);
+		}
+		else
+		{
+			res = pthread_cond_timedwait(&sem->cond, &sem->lock, &ts);
+		}
+	}
+	res = sem->given;
+	sem->given = 0;
+	pthread_mutex_unlock(&sem->lock);
+	return res ? pdTRUE : pdFALSE;
+}
+
+//--------------------------------------------
+TickType_t xTaskGetTickCount(void)
+{
+	return (TickType_t)(host_time_now_ns() / 1000000);
+}
+
+//--------------------------------------------
+void vTaskDelay(TickType_t ticks)
+{
+	host_time_sleep_ms(ticks);
+}
+
+//--------------------------------------------
+// webradio.c provides it on the target
+void delay_ms(uint32_t time_ms)
+{
+	vTaskDelay(pdMS_TO_TICKS(time_ms));
+}
@@ -0,0 +1,641 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t */
+#include <string.h>     /* memset */
+#include <time.h>       /* struct timespec */
+#include "hal-spi-vs1003.h"
+#include "hal-spi-vs1003-sim.h"
+#include "vs1053-regs.h"
+#include "host_time.h"
+
+//--------------------------------------------
+// VS1053b on the host: the SCI register file, the 2048 byte SDI FIFO
+// drained at the stream bitrate and DREQ as the datasheet describes it.
+// The bus clocks are those of the ESP32 HAL, transfers take simulated time.
+
+//--------------------------------------------
+#define SPI_CLK_SLOW     (1*1000*1000)   // reset, CLKI = XTALI: XTALI/7
+#define SPI_CLK_SCI      (4*1000*1000)   // registers after CLOCKF: CLKI/7
+#define SPI_CLK_SDI      (8*1000*1000)   // data after CLOCKF: CLKI/4
+#define DREQ_RESET_MS    100     // DREQ rises a few ms after reset
+
+//--------------------------------------------
+#define NS_PER_S                   1000000000ULL
+#define NS_PER_MS                  1000000ULL
+#define XTALI_HZ                   12288000ULL
+#define SDI_FIFO_SIZE              2048
+#define SDI_DREQ_FREE              32       // DREQ high: room for a 32 byte burst
+#define RESET_XTALI                22000    // DREQ low after XRESET, 1.8 ms
+#define CLOCKF_EXEC_XTALI          1200
+#define CANCEL_DECODE_BYTES        512      // SM_CANCEL is cleared within this
+#define HEADER_DECODE_BYTES        1024     // HDAT0/HDAT1 valid after the first frames
+#define DEFAULT_BITRATE_KBPS       128
+
+//--------------------------------------------
+// SCI write execution time in CLKI, DREQ is low meanwhile
+static const uint16_t sci_exec_clki[16] =
+{
+	80,     // MODE
+	80,     // STATUS
+	80,     // BASS
+	0,      // CLOCKF, in XTALI
+	100,    // DECODE_TIME
+	450,    // AUDATA
+	100,    // WRAM
+	100,    // WRAMADDR
+	80,     // HDAT0
+	80,     // HDAT1
+	210,    // AIADDR
+	80,     // VOL
+	80,     // AICTRL0
+	80,     // AICTRL1
+	80,     // AICTRL2
+	80      // AICTRL3
+};
+
+//--------------------------------------------
+// MPEG-1 layer III bitrates in kbps [index - 1]
+static const uint16_t mp3_bitrates[14] =
+{
+	32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320
+};
+
+//--------------------------------------------
+typedef enum
+{
+	sci_opcode = 0,
+	sci_address,
+	sci_data_hi,
+	sci_data_lo
+} sci_phase_t;
+
+//--------------------------------------------
+// Pins and the SCI frame in progress
+typedef struct
+{
+	uint8_t fast;
+	uint8_t xcs;
+	uint8_t xdcs;
+	sci_phase_t phase;
+	uint8_t opcode;
+	uint8_t address;
+	uint16_t word;
+	uint32_t words;
+} bus_t;
+static bus_t bus;
+
+//--------------------------------------------
+typedef struct
+{
+	uint16_t regs[16];
+	uint16_t wram[65536];
+	uint16_t wram_addr;
+	uint64_t busy_until;          // DREQ low for SCI until then
+	uint64_t reset_until;         // the chip is held in reset
+	uint32_t fifo_count;
+	uint64_t fifo_ns;             // the FIFO is drained up to this time
+	uint64_t time_bytes;          // decoded bytes behind DECODE_TIME
+	uint64_t stream_bytes;        // decoded bytes since reset or cancel
+	uint32_t cancel_left;
+	uint32_t bitrate_kbps;
+	uint32_t vbr_spread;          // frame bitrate indexes around the average
+	uint32_t vbr_seed;
+	int stuck;
+} chip_t;
+static chip_t chip = { .bitrate_kbps = DEFAULT_BITRATE_KBPS };
+
+//--------------------------------------------
+static vs1053_sim_stats_t stats;
+
+//--------------------------------------------
+uint32_t vs1053_sim_checksum(uint32_t sum, uint32_t data)
+{
+	return (sum ^ data) * 16777619U;
+}
+
+//--------------------------------------------
+static uint64_t clki_hz(void)
+{
+	uint32_t mult = chip.regs[VS1053_CLOCKF] >> 13;
+
+	return mult ? XTALI_HZ * (mult + 3) / 2 : XTALI_HZ;
+}
+
+//--------------------------------------------
+static uint64_t fifo_rate(void)
+{
+	return (uint64_t)chip.bitrate_kbps * 1000 / 8;
+}
+
+//--------------------------------------------
+// the decoder has taken size bytes from the FIFO
+static void decode(uint32_t size)
+{
+	stats.decoded_bytes += size;
+	chip.stream_bytes += size;
+	if (!__atomic_load_n(&chip.stuck, __ATOMIC_RELAXED))
+	{
+		chip.time_bytes += size;
+	}
+	if (!chip.cancel_left)
+	{
+		return;
+	}
+	if (size < chip.cancel_left)
+	{
+		chip.cancel_left -= size;
+		return;
+	}
+	// decoding has stopped, the next bytes are a new stream
+	chip.cancel_left = 0;
+	chip.regs[VS1053_MODE] &= ~VS1053_MODE_CANCEL;
+	chip.regs[VS1053_DECODE_TIME] = 0;
+	chip.time_bytes = 0;
+	chip.stream_bytes = 0;
+	__atomic_store_n(&chip.stuck, 0, __ATOMIC_RELAXED);
+	stats.cancels++;
+}
+
+//--------------------------------------------
+static void fifo_drain(uint64_t now)
+{
+	uint64_t rate = fifo_rate();
+	uint64_t size;
+
+	if (now <= chip.fifo_ns)
+	{
+		return;
+	}
+	if (!chip.fifo_count)
+	{
+		chip.fifo_ns = now;
+		return;
+	}
+	size = (now - chip.fifo_ns) * rate / NS_PER_S;
+	if (size >= chip.fifo_count)
+	{
+		size = chip.fifo_count;
+		chip.fifo_ns = now;
+		stats.fifo_underruns++;
+	}
+	else
+	{
+		chip.fifo_ns += size * NS_PER_S / rate;
+	}
+	chip.fifo_count -= (uint32_t)size;
+	decode((uint32_t)size);
+}
+
+//--------------------------------------------
+static void fifo_put(const uint8_t *buf, size_t size, uint64_t now)
+{
+	size_t cnt;
+
+	if (now < chip.reset_until)
+	{
+		stats.sdi_overflows += size;
+		return;
+	}
+	fifo_drain(now);
+	if (size > SDI_FIFO_SIZE - chip.fifo_count)
+	{
+		stats.sdi_overflows += size - (SDI_FIFO_SIZE - chip.fifo_count);
+		size = SDI_FIFO_SIZE - chip.fifo_count;
+	}
+	if (!chip.fifo_count)
+	{
+		chip.fifo_ns = now;
+	}
+	chip.fifo_count += (uint32_t)size;
+	stats.sdi_bytes += size;
+	for (cnt = 0; cnt < size; cnt++)
+	{
+		stats.sdi_sum = vs1053_sim_checksum(stats.sdi_sum, buf[cnt]);
+	}
+}
+
+//--------------------------------------------
+// earliest time from now on with DREQ high
+static uint64_t dreq_time(uint64_t now)
+{
+	uint64_t rate = fifo_rate();
+	uint64_t time_ns = now;
+	uint64_t fifo_ns;
+	uint32_t size;
+
+	fifo_drain(now);
+	if (time_ns < chip.busy_until)
+	{
+		time_ns = chip.busy_until;
+	}
+	if (chip.fifo_count > SDI_FIFO_SIZE - SDI_DREQ_FREE)
+	{
+		size = chip.fifo_count - (SDI_FIFO_SIZE - SDI_DREQ_FREE);
+		fifo_ns = chip.fifo_ns + (size * NS_PER_S + rate - 1) / rate;
+		if (time_ns < fifo_ns)
+		{
+			time_ns = fifo_ns;
+		}
+	}
+	return time_ns;
+}
+
+//--------------------------------------------
+// hardware reset or SM_RESET, the plugin has to be loaded again
+static void chip_reset(uint64_t now)
+{
+	memset(chip.regs, 0, sizeof(chip.regs));
+	chip.regs[VS1053_MODE] = VS1053_MODE_SDINEW;
+	chip.regs[VS1053_STATUS] = 0x0040;   // version 4, VS1053
+	chip.wram_addr = 0;
+	chip.fifo_count = 0;
+	chip.fifo_ns = now;
+	chip.time_bytes = 0;
+	chip.stream_bytes = 0;
+	chip.cancel_left = 0;
+	__atomic_store_n(&chip.stuck, 0, __ATOMIC_RELAXED);
+	chip.reset_until = now + RESET_XTALI * NS_PER_S / XTALI_HZ;
+	chip.busy_until = chip.reset_until;
+	stats.wram_words = 0;
+	stats.wram_sum = 0;
+}
+
+//--------------------------------------------
+// MPEG-1 layer III or WAV, 44100 Hz, stereo once the first frames are decoded
+static uint16_t read_header(uint8_t reg)
+{
+	uint16_t index = 0;
+	size_t cnt;
+
+	if (chip.stream_bytes < HEADER_DECODE_BYTES)
+	{
+		return 0;
+	}
+	for (cnt = 0; cnt < sizeof(mp3_bitrates) / sizeof(mp3_bitrates[0]); cnt++)
+	{
+		if (mp3_bitrates[cnt] == chip.bitrate_kbps)
+		{
+			index = (uint16_t)(cnt + 1);
+		}
+	}
+	if (!index)
+	{
+		// no MPEG bitrate, a WAV stream with the byte rate in HDAT0
+		switch (reg)
+		{
+		case VS1053_HDAT0:
+			return fifo_rate() > 0xFFFF ? 0xFFFF : (uint16_t)fifo_rate();
+		case VS1053_HDAT1:
+			return 0x7665;
+		default:
+			return 44100 | 1;
+		}
+	}
+	switch (reg)
+	{
+	case VS1053_HDAT0:
+		if (chip.vbr_spread)
+		{
+			// the header of some frame of a VBR stream
+			chip.vbr_seed = chip.vbr_seed * 1103515245 + 12345;
+			index += (chip.vbr_seed >> 16) % (2 * chip.vbr_spread + 1);
+			index = index > chip.vbr_spread ? index - chip.vbr_spread : 1;
+			index = index > 14 ? 14 : index;
+		}
+		return index << 12;
+	case VS1053_HDAT1:
+		return 0xFFFB;
+	default:
+		return 44100 | 1;
+	}
+}
+
+//--------------------------------------------
+static uint16_t read_register(uint8_t reg)
+{
+	stats.sci_words++;
+	switch (reg)
+	{
+	case VS1053_DECODE_TIME:
+		return (uint16_t)(chip.regs[reg] + chip.time_bytes / fifo_rate());
+	case VS1053_AUDATA:
+	case VS1053_HDAT0:
+	case VS1053_HDAT1:
+		return read_header(reg);
+	case VS1053_WRAM:
+		return chip.wram[chip.wram_addr++];
+	case VS1053_WRAMADDR:
+		return chip.wram_addr;
+	default:
+		return chip.regs[reg];
+	}
+}
+
+//--------------------------------------------
+// the word is complete at now, DREQ stays low while it is executed
+static void write_register(uint8_t reg, uint16_t data, uint64_t now)
+{
+	uint64_t exec_ns = sci_exec_clki[reg] * NS_PER_S / clki_hz();
+
+	stats.sci_words++;
+	switch (reg)
+	{
+	case VS1053_MODE:
+		chip.regs[reg] = data;
+		if (data & VS1053_MODE_RESET)
+		{
+			chip_reset(now);
+			return;
+		}
+		if ((data & VS1053_MODE_CANCEL) && !chip.cancel_left)
+		{
+			chip.cancel_left = CANCEL_DECODE_BYTES;
+		}
+		break;
+	case VS1053_CLOCKF:
+		chip.regs[reg] = data;
+		exec_ns = CLOCKF_EXEC_XTALI * NS_PER_S / XTALI_HZ;
+		break;
+	case VS1053_DECODE_TIME:
+		chip.regs[reg] = data;
+		chip.time_bytes = 0;
+		break;
+	case VS1053_WRAM:
+		chip.wram[chip.wram_addr++] = data;
+		stats.wram_words++;
+		stats.wram_sum = vs1053_sim_checksum(stats.wram_sum, data);
+		break;
+	case VS1053_WRAMADDR:
+		chip.wram_addr = data;
+		break;
+	case VS1053_HDAT0:
+	case VS1053_HDAT1:
+		break;
+	default:
+		chip.regs[reg] = data;
+		break;
+	}
+	chip.busy_until = now + exec_ns;
+}
+
+//--------------------------------------------
+// one byte of an SCI frame, start and end of its transfer
+static uint8_t sci_byte(uint8_t data, uint64_t start, uint64_t end, uint32_t clock_hz)
+{
+	uint8_t res = 0;
+
+	stats.sci_bytes++;
+	// reads up to CLKI/7, writes up to CLKI/4
+	if (clock_hz * (bus.opcode == VS1053_CMD_READ && bus.phase > sci_address ? 7 : 4) > clki_hz())
+	{
+		stats.clock_violations++;
+	}
+	switch (bus.phase)
+	{
+	case sci_opcode:
+		bus.opcode = data;
+		bus.phase = sci_address;
+		break;
+	case sci_address:
+		bus.address = data & 0x0F;
+		bus.words = 0;
+		bus.phase = sci_data_hi;
+		// frames, as vs1053-spi.c counts them
+		if (bus.opcode == VS1053_CMD_READ)
+		{
+			stats.sci_reads++;
+		}
+		else if (bus.opcode == VS1053_CMD_WRITE)
+		{
+			stats.sci_writes++;
+		}
+		if (bus.opcode == VS1053_CMD_READ && start < chip.busy_until)
+		{
+			stats.sci_overruns++;
+		}
+		break;
+	case sci_data_hi:
+		bus.phase = sci_data_lo;
+		if (bus.opcode == VS1053_CMD_READ)
+		{
+			bus.word = read_register(bus.address);
+			res = bus.word >> 8;
+			break;
+		}
+		// every word of a multiple write waits for DREQ
+		if (start < chip.busy_until)
+		{
+			stats.sci_overruns++;
+		}
+		bus.word = data << 8;
+		break;
+	case sci_data_lo:
+		bus.phase = sci_data_hi;
+		bus.words++;
+		if (bus.opcode == VS1053_CMD_READ)
+		{
+			res = (uint8_t)bus.word;
+			break;
+		}
+		if (bus.opcode == VS1053_CMD_WRITE)
+		{
+			write_register(bus.address, bus.word | data, end);
+		}
+		break;
+	}
+	return res;
+}
+
+//--------------------------------------------
+// moves the simulated time over a transfer, returns its start
+static uint64_t bus_transfer(size_t size, uint32_t clock_hz, uint64_t *end)
+{
+	uint64_t time_ns = size * 8 * NS_PER_S / clock_hz;
+	uint64_t start = host_time_now_ns();
+
+	host_time_advance_ns(time_ns);
+	stats.bus_ns += time_ns;
+	*end = start + time_ns;
+	return start;
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_set_fast(uint8_t state)
+{
+	bus.fast = state;
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_reset(void)
+{
+	hal_spi_vs1003_set_fast(0);
+	host_time_wait_until_ns(host_time_now_ns() + 2 * NS_PER_MS);
+	bus.xcs = 1;
+	bus.xdcs = 1;
+	// XRESET goes high
+	chip_reset(host_time_now_ns());
+	stats.resets++;
+	host_time_wait_until_ns(host_time_now_ns() + NS_PER_MS);
+	hal_spi_vs1003_wait_dreq(DREQ_RESET_MS);
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_init(void)
+{
+	memset(&bus, 0, sizeof(bus));
+	bus.xcs = 1;
+	bus.xdcs = 1;
+}
+
+//--------------------------------------------
+uint8_t hal_spi_vs1003_txrx(uint8_t data)
+{
+	uint32_t clock_hz = bus.fast ? SPI_CLK_SCI : SPI_CLK_SLOW;
+	uint64_t start;
+	uint64_t end;
+
+	start = bus_transfer(1, clock_hz, &end);
+	if (!bus.xcs && !bus.xdcs)
+	{
+		stats.cs_conflicts++;
+		return 0;
+	}
+	if (!bus.xcs)
+	{
+		return sci_byte(data, start, end, clock_hz);
+	}
+	if (!bus.xdcs)
+	{
+		stats.sdi_bytes_txrx++;
+		if (clock_hz * 4 > clki_hz())
+		{
+			stats.clock_violations++;
+		}
+		fifo_put(&data, 1, start);
+	}
+	return 0;
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_tx_block(uint8_t *buf, size_t size)
+{
+	uint32_t clock_hz = bus.fast ? SPI_CLK_SDI : SPI_CLK_SLOW;
+	uint64_t start;
+	uint64_t end;
+
+	start = bus_transfer(size, clock_hz, &end);
+	stats.sdi_blocks++;
+	if (!bus.xcs)
+	{
+		stats.cs_conflicts++;
+		return;
+	}
+	if (bus.xdcs)
+	{
+		// nobody listens
+		stats.sdi_overflows += size;
+		return;
+	}
+	if (clock_hz * 4 > clki_hz())
+	{
+		stats.clock_violations++;
+	}
+	fifo_put(buf, size, start);
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_xcs(uint8_t state)
+{
+	if (!state && bus.xcs)
+	{
+		bus.phase = sci_opcode;
+	}
+	bus.xcs = state;
+}
+
+//--------------------------------------------
+void hal_spi_vs1003_xdcs(uint8_t state)
+{
+	bus.xdcs = state;
+}
+
+//--------------------------------------------
+uint8_t hal_spi_vs1003_dreq(void)
+{
+	uint64_t now = host_time_now_ns();
+
+	return dreq_time(now) <= now;
+}
+
+//--------------------------------------------
+// returns 0 once DREQ is high, -1 on timeout
+int hal_spi_vs1003_wait_dreq(uint32_t timeout_ms)
+{
+	uint64_t now = host_time_now_ns();
+	uint64_t time_ns = dreq_time(now);
+
+	if (time_ns <= now)
+	{
+		return 0;
+	}
+	stats.dreq_waits++;
+	if (time_ns > now + timeout_ms * NS_PER_MS)
+	{
+		host_time_wait_until_ns(now + timeout_ms * NS_PER_MS);
+		stats.dreq_timeouts++;
+		return -1;
+	}
+	host_time_wait_until_ns(time_ns);
+	return 0;
+}
+
+//--------------------------------------------
+// FIFO drain rate, HDAT0 reports it as the MPEG bitrate index
+// or as the WAV byte rate for other bitrates
+void vs1053_sim_set_bitrate(uint32_t bitrate_kbps)
+{
+	chip.bitrate_kbps = bitrate_kbps ? bitrate_kbps : DEFAULT_BITRATE_KBPS;
+}
+
+//--------------------------------------------
+// HDAT0 reports frame bitrates up to spread table steps off the average
+void vs1053_sim_set_vbr(uint32_t spread)
+{
+	chip.vbr_spread = spread;
+}
+
+//--------------------------------------------
+// a stuck decoder keeps taking bytes, DECODE_TIME stands still
+// until a cancel or a reset
+void vs1053_sim_set_stuck(int state)
+{
+	__atomic_store_n(&chip.stuck, state, __ATOMIC_RELAXED);
+}
+
+//--------------------------------------------
+// called while no thread uses the HAL
+void vs1053_sim_get_stats(vs1053_sim_stats_t *sim_stats)
+{
+	*sim_stats = stats;
+}
+
+//--------------------------------------------
+// called while no thread uses the HAL
+uint32_t vs1053_sim_get_fifo_count(void)
+{
+	fifo_drain(host_time_now_ns());
+	return chip.fifo_count;
+}
@@ -0,0 +1,53 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef HAL_SPI_VS1003_SIM_H_
+#define HAL_SPI_VS1003_SIM_H_
+
+//--------------------------------------------
+// What the simulated VS1053b has seen on its bus
+typedef struct
+{
+	uint32_t sci_bytes;           // txrx() bytes with XCS low
+	uint32_t sci_reads;           // read frames, XCS assertions
+	uint32_t sci_writes;          // write frames, a multiple write is one
+	uint32_t sci_words;           // register words read or written
+	uint32_t sdi_bytes_txrx;      // txrx() bytes with XDCS low
+	uint32_t sdi_blocks;          // tx_block() calls
+	uint64_t sdi_bytes;           // bytes taken into the FIFO
+	uint32_t sdi_sum;             // checksum of these bytes
+	uint64_t decoded_bytes;       // bytes drained from the FIFO
+	uint32_t sci_overruns;        // SCI word started while DREQ was low for SCI
+	uint32_t sdi_overflows;       // bytes sent to a full FIFO and lost
+	uint32_t clock_violations;    // SCI or SDI bytes above the allowed clock
+	uint32_t cs_conflicts;        // XCS and XDCS low together
+	uint32_t fifo_underruns;      // FIFO ran empty
+	uint32_t dreq_waits;
+	uint32_t dreq_timeouts;
+	uint32_t cancels;             // SM_CANCEL cleared by the decoder
+	uint32_t resets;              // hardware resets
+	uint32_t wram_words;          // WRAM words written since the last reset
+	uint32_t wram_sum;            // checksum of these words
+	uint64_t bus_ns;              // time the bus spent on transfers
+} vs1053_sim_stats_t;
+
+//--------------------------------------------
+void vs1053_sim_set_bitrate(uint32_t bitrate_kbps);
+void vs1053_sim_set_vbr(uint32_t spread);
+void vs1053_sim_set_stuck(int state);
+void vs1053_sim_get_stats(vs1053_sim_stats_t *stats);
+uint32_t vs1053_sim_get_fifo_count(void);
+uint32_t vs1053_sim_checksum(uint32_t sum, uint32_t data);
+
+#endif // HAL_SPI_VS1003_SIM_H_
@@ -0,0 +1,265 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdio.h>      /* fopen, printf, vsnprintf */
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, malloc, abort */
+#include <stdbool.h>    /* bool */
+#include <string.h>     /* strchr, strrchr, strcspn */
+#include <stdarg.h>     /* va_list */
+#include "host_test.h"
+
+//--------------------------------------------
+#define EXPECT_EXT                 ".expect"
+#define TRACE_GROW                 4096
+#define DIFF_LINE_MAX              160      // of a line shown on a difference
+
+//--------------------------------------------
+// the whole file and a terminating zero, NULL if it can not be read
+uint8_t *host_test_load(const char *path, size_t *size)
+{
+	FILE *file;
+	uint8_t *data;
+	long length;
+
+	file = fopen(path, "rb");
+	if (!file)
+	{
+		return NULL;
+	}
+	data = NULL;
+	if (!fseek(file, 0, SEEK_END) && (length = ftell(file)) >= 0 && !fseek(file, 0, SEEK_SET))
+	{
+		data = malloc((size_t)length + 1);
+		if (data && fread(data, 1, (size_t)length, file) != (size_t)length)
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+	fclose(file);
+	if (data)
+	{
+		data[length] = 0;
+		*size = (size_t)length;
+	}
+	return data;
+}
+
+//--------------------------------------------
+// xorshift32, the same sequence on every host
+uint32_t host_test_rand(uint32_t *seed)
+{
+	uint32_t x = *seed ? *seed : 1;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+	return x;
+}
+
+//--------------------------------------------
+// the size of the next read of a stream split at random:
+// mostly short reads, which cut every field somewhere
+size_t host_test_split(uint32_t *seed, size_t left, size_t max)
+{
+	size_t size;
+
+	switch (host_test_rand(seed) % 4)
+	{
+	case 0:
+		size = 1;
+		break;
+	case 1:
+		size = 1 + host_test_rand(seed) % 8;
+		break;
+	case 2:
+		size = 1 + host_test_rand(seed) % 64;
+		break;
+	default:
+		size = 1 + host_test_rand(seed) % max;
+		break;
+	}
+	return size < left ? size : left;
+}
+
+//--------------------------------------------
+// FNV-1a
+uint32_t host_test_hash(uint32_t hash, const uint8_t *data, size_t size)
+{
+	size_t cnt;
+
+	for (cnt = 0; cnt < size; cnt++)
+	{
+		hash = (hash ^ data[cnt]) * 16777619U;
+	}
+	return hash;
+}
+
+//--------------------------------------------
+void host_trace_init(host_trace_t *trace)
+{
+	trace->text = NULL;
+	trace->length = 0;
+	trace->size = 0;
+}
+
+//--------------------------------------------
+void host_trace_free(host_trace_t *trace)
+{
+	free(trace->text);
+	host_trace_init(trace);
+}
+
+//--------------------------------------------
+void host_trace_printf(host_trace_t *trace, const char *format, ...)
+{
+	va_list args;
+	int length;
+
+	for (;;)
+	{
+		va_start(args, format);
+		length = vsnprintf(trace->text + trace->length, trace->size - trace->length, format, args);
+		va_end(args);
+		if (length < 0)
+		{
+			abort();
+		}
+		if (trace->length + (size_t)length < trace->size)
+		{
+			trace->length += (size_t)length;
+			return;
+		}
+		trace->size += (size_t)length + TRACE_GROW;
+		trace->text = realloc(trace->text, trace->size);
+		if (!trace->text)
+		{
+			abort();
+		}
+	}
+}
+
+//--------------------------------------------
+// data as one line, trailing zeros dropped and other bytes
+// outside of printable ASCII escaped
+void host_trace_text(host_trace_t *trace, const uint8_t *data, size_t size)
+{
+	size_t cnt;
+
+	while (size && !data[size - 1])
+	{
+		size--;
+	}
+	for (cnt = 0; cnt < size; cnt++)
+	{
+		if (data[cnt] < 0x20 || data[cnt] > 0x7E || data[cnt] == '\\')
+		{
+			host_trace_printf(trace, "\\x%02X", data[cnt]);
+		}
+		else
+		{
+			host_trace_printf(trace, "%c", data[cnt]);
+		}
+	}
+	host_trace_printf(trace, "\n");
+}
+
+//--------------------------------------------
+// the first line that differs, 0 if there is none
+static size_t first_difference(const char *text, const char *expected, size_t *offset)
+{
+	size_t line = 1;
+	size_t cnt;
+
+	for (cnt = 0; text[cnt] == expected[cnt]; cnt++)
+	{
+		if (!text[cnt])
+		{
+			return 0;
+		}
+		if (text[cnt] == '\n')
+		{
+			line++;
+			*offset = cnt + 1;
+		}
+	}
+	return line;
+}
+
+//--------------------------------------------
+static int line_length(const char *text)
+{
+	size_t length = strcspn(text, "\n");
+
+	return (int)(length < DIFF_LINE_MAX ? length : DIFF_LINE_MAX);
+}
+
+//--------------------------------------------
+// prints the first line that differs, returns -1 if there is one
+int host_trace_compare(const host_trace_t *trace, const host_trace_t *expected, const char *what)
+{
+	const char *text = trace->text ? trace->text : "";
+	const char *expected_text = expected->text ? expected->text : "";
+	size_t offset = 0;
+	size_t line;
+
+	line = first_difference(text, expected_text, &offset);
+	if (!line)
+	{
+		return 0;
+	}
+	printf("%s: line %u differs\n", what, (unsigned int)line);
+	printf("  expected: %.*s\n", line_length(expected_text + offset), expected_text + offset);
+	printf("  got:      %.*s\n", line_length(text + offset), text + offset);
+	return -1;
+}
+
+//--------------------------------------------
+// compares the trace of the fixture at path with its .expect file,
+// or writes the file when update is set
+int host_trace_check(const host_trace_t *trace, const char *path, bool update)
+{
+	char expect_path[1024];
+	const char *ext = strrchr(path, '.');
+	size_t length = ext && !strchr(ext, '/') ? (size_t)(ext - path) : strlen(path);
+	host_trace_t expected;
+	size_t size;
+	FILE *file;
+	int res;
+
+	snprintf(expect_path, sizeof(expect_path), "%.*s%s", (int)length, path, EXPECT_EXT);
+	if (update)
+	{
+		file = fopen(expect_path, "wb");
+		if (!file || fwrite(trace->text, 1, trace->length, file) != trace->length)
+		{
+			printf("%s: can not write\n", expect_path);
+			return -1;
+		}
+		fclose(file);
+		return 0;
+	}
+	host_trace_init(&expected);
+	expected.text = (char *)host_test_load(expect_path, &size);
+	if (!expected.text)
+	{
+		printf("%s: can not read, make update writes it\n", expect_path);
+		return -1;
+	}
+	res = host_trace_compare(trace, &expected, path);
+	host_trace_free(&expected);
+	return res;
+}
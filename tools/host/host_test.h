@@ -0,0 +1,40 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+//--------------------------------------------
+// What a parser did with a stream, one line per event. A fixture
+// stream.ext is checked against the trace kept in stream.expect.
+typedef struct
+{
+	char *text;
+	size_t length;
+	size_t size;
+} host_trace_t;
+
+//--------------------------------------------
+uint8_t *host_test_load(const char *path, size_t *size);
+uint32_t host_test_rand(uint32_t *seed);
+size_t host_test_split(uint32_t *seed, size_t left, size_t max);
+uint32_t host_test_hash(uint32_t hash, const uint8_t *data, size_t size);
+void host_trace_init(host_trace_t *trace);
+void host_trace_free(host_trace_t *trace);
+void host_trace_printf(host_trace_t *trace, const char *format, ...);
+void host_trace_text(host_trace_t *trace, const uint8_t *data, size_t size);
+int host_trace_check(const host_trace_t *trace, const char *path, bool update);
+int host_trace_compare(const host_trace_t *trace, const host_trace_t *expected, const char *what);
+
+#endif /* HOST_TEST_H */
@@ -0,0 +1,163 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <time.h>       /* clock_gettime, clock_nanosleep */
+#include <errno.h>      /* EINTR */
+#include <pthread.h>    /* pthread_mutex_t */
+#include "host_time.h"
+
+//--------------------------------------------
+#define NS_PER_S                   1000000000ULL
+#define NS_PER_MS                  1000000ULL
+#define SLEEP_SLACK_NS             1000000ULL   // wall clock, shorter sleeps are skipped
+
+//--------------------------------------------
+typedef struct
+{
+	pthread_mutex_t lock;
+	struct timespec origin;
+	uint32_t speed;
+	uint64_t now_ns;
+} host_time_t;
+static host_time_t host_time =
+{
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.speed = 1
+};
+
+//--------------------------------------------
+static uint64_t real_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec - host_time.origin.tv_sec) * NS_PER_S + ts.tv_nsec - host_time.origin.tv_nsec;
+}
+
+//--------------------------------------------
+// called under the lock
+static uint64_t sync_now(void)
+{
+	uint64_t time_ns = real_ns() * host_time.speed;
+
+	if (time_ns > host_time.now_ns)
+	{
+		host_time.now_ns = time_ns;
+	}
+	return host_time.now_ns;
+}
+
+//--------------------------------------------
+void host_time_init(uint32_t speed)
+{
+	pthread_mutex_lock(&host_time.lock);
+	clock_gettime(CLOCK_MONOTONIC, &host_time.origin);
+	host_time.speed = speed ? speed : 1;
+	host_time.now_ns = 0;
+	pthread_mutex_unlock(&host_time.lock);
+}
+
+//--------------------------------------------
+uint32_t host_time_get_speed(void)
+{
+	return host_time.speed;
+}
+
+//--------------------------------------------
+uint64_t host_time_now_ns(void)
+{
+	uint64_t time_ns;
+
+	pthread_mutex_lock(&host_time.lock);
+	time_ns = sync_now();
+	pthread_mutex_unlock(&host_time.lock);
+	return time_ns;
+}
+
+//--------------------------------------------
+void host_time_advance_ns(uint64_t time_ns)
+{
+	pthread_mutex_lock(&host_time.lock);
+	host_time.now_ns = sync_now() + time_ns;
+	pthread_mutex_unlock(&host_time.lock);
+}
+
+//--------------------------------------------
+static void sleep_real_ns(uint64_t wake_ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = host_time.origin.tv_sec + (time_t)(wake_ns / NS_PER_S);
+	ts.tv_nsec = host_time.origin.tv_nsec + (long)(wake_ns % NS_PER_S);
+	if (ts.tv_nsec >= (long)NS_PER_S)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= NS_PER_S;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+	{
+	}
+}
+
+//--------------------------------------------
+// HAL side: the codec is idle until time_ns, the simulated time jumps there.
+// The wall clock is let to lag by SLEEP_SLACK_NS, short waits cost no sleep.
+void host_time_wait_until_ns(uint64_t time_ns)
+{
+	uint64_t wake_ns = time_ns / host_time.speed;
+
+	pthread_mutex_lock(&host_time.lock);
+	if (sync_now() < time_ns)
+	{
+		host_time.now_ns = time_ns;
+	}
+	pthread_mutex_unlock(&host_time.lock);
+	if (wake_ns > real_ns() + SLEEP_SLACK_NS)
+	{
+		sleep_real_ns(wake_ns - SLEEP_SLACK_NS);
+	}
+}
+
+//--------------------------------------------
+// other threads sleep on the wall clock and leave the simulated time alone
+void host_time_sleep_until_ns(uint64_t time_ns)
+{
+	while (host_time_now_ns() < time_ns)
+	{
+		sleep_real_ns(time_ns / host_time.speed);
+	}
+}
+
+//--------------------------------------------
+void host_time_sleep_ms(uint32_t time_ms)
+{
+	host_time_sleep_until_ns(host_time_now_ns() + time_ms * NS_PER_MS);
+}
+
+//--------------------------------------------
+// CLOCK_MONOTONIC deadline for a wait of time_ms of simulated time
+void host_time_real_deadline(struct timespec *ts, uint32_t time_ms)
+{
+	uint64_t wait_ns = time_ms * NS_PER_MS / host_time.speed;
+
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec += (time_t)(wait_ns / NS_PER_S);
+	ts->tv_nsec += (long)(wait_ns % NS_PER_S);
+	if (ts->tv_nsec >= (long)NS_PER_S)
+	{
+		ts->tv_sec++;
+		ts->tv_nsec -= NS_PER_S;
+	}
+}
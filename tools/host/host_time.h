@@ -0,0 +1,31 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef HOST_TIME_H
+#define HOST_TIME_H
+
+//--------------------------------------------
+// Simulated time of the host build. It runs speed times faster than
+// the wall clock and the HAL pushes it ahead over SPI transfers and DREQ
+// waits, the wall clock catches up with it while the HAL sleeps.
+void host_time_init(uint32_t speed);
+uint32_t host_time_get_speed(void);
+uint64_t host_time_now_ns(void);
+void host_time_advance_ns(uint64_t time_ns);
+void host_time_wait_until_ns(uint64_t time_ns);
+void host_time_sleep_until_ns(uint64_t time_ns);
+void host_time_sleep_ms(uint32_t time_ms);
+void host_time_real_deadline(struct timespec *ts, uint32_t time_ms);
+
+#endif /* HOST_TIME_H */
@@ -0,0 +1,29 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef ESP_HEAP_CAPS_H
+#define ESP_HEAP_CAPS_H
+
+#include <stdlib.h>
+
+//--------------------------------------------
+// Host build: any heap memory will do
+#define MALLOC_CAP_DMA             (1 << 3)
+#define MALLOC_CAP_8BIT            (1 << 2)
+#define MALLOC_CAP_SPIRAM          (1 << 10)
+
+#define heap_caps_malloc(size, caps)   malloc(size)
+#define heap_caps_free(ptr)            free(ptr)
+
+#endif /* ESP_HEAP_CAPS_H */
@@ -0,0 +1,34 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#ifndef FREERTOS_H
+#define FREERTOS_H
+
+//--------------------------------------------
+// Host build: the FreeRTOS types used by the shared modules,
+// one tick is one millisecond of the simulated time
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdFALSE                    0
+#define pdTRUE                     1
+#define pdPASS                     pdTRUE
+#define portMAX_DELAY              ((TickType_t)0xFFFFFFFFUL)
+#define portTICK_PERIOD_MS         1
+#define portTICK_RATE_MS           portTICK_PERIOD_MS
+#define pdMS_TO_TICKS(ms)          ((TickType_t)(ms))
+
+#endif /* FREERTOS_H */
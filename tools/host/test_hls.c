@@ -0,0 +1,350 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdio.h>      /* printf, snprintf */
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, strtoul */
+#include <string.h>     /* strncmp, strrchr */
+#include <stdbool.h>    /* bool */
+#include <unistd.h>     /* getopt */
+#include "playlist.h"
+#include "hls.h"
+#include "ts_demux.h"
+#include "host_test.h"
+
+//--------------------------------------------
+// A station in fixtures/hls/<name> is played the way the network task
+// of webradio.c plays it: index.m3u8 is asked first, a master playlist
+// gives the media playlist, hls_next gives the segments and the
+// refreshes, and the segments go through ts_demux.
+// The canned server answers the n-th request of a path with path.n
+// when there is one, so a live playlist moves on between refreshes.
+// Responses arrive in the reads of the firmware, byte by byte, in reads
+// that split every TS packet and split at random; every way gives
+// the trace in <name>.expect.
+
+//--------------------------------------------
+// Same as the network task of webradio.c
+#define RECV_BUFFER_SIZE           1024
+
+//--------------------------------------------
+#define SERVER_HOST                "http://hls.example.com"
+#define SERVER_PATHS               64
+#define REQUEST_MAX                64       // a live station is left then
+#define PACKET_SPLIT_READ          100      // less than a TS packet
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t splits;
+	uint32_t seed;
+	bool update;
+} options_t;
+static options_t options =
+{
+	.splits = 200,
+	.seed = 1
+};
+
+//--------------------------------------------
+typedef struct
+{
+	const char *root;
+	char paths[SERVER_PATHS][HLS_LOCATION_SIZE];
+	uint32_t requests[SERVER_PATHS];
+	size_t path_count;
+} server_t;
+static server_t server;
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t seed;                         // 0 - reads of max_read bytes
+	size_t max_read;
+	uint8_t recv_buf[RECV_BUFFER_SIZE];
+	ts_demux_t ts_demux;
+} client_t;
+
+//--------------------------------------------
+// the times path has been asked before
+static uint32_t server_count(const char *path)
+{
+	size_t cnt;
+
+	for (cnt = 0; cnt < server.path_count; cnt++)
+	{
+		if (!strcmp(server.paths[cnt], path))
+		{
+			return server.requests[cnt]++;
+		}
+	}
+	if (server.path_count < SERVER_PATHS)
+	{
+		snprintf(server.paths[server.path_count], sizeof(server.paths[0]), "%s", path);
+		server.requests[server.path_count++] = 1;
+	}
+	return 0;
+}
+
+//--------------------------------------------
+// the body for location, NULL for a 404
+static uint8_t *server_get(const char *location, char *path, size_t path_size, size_t *size)
+{
+	char file[1024];
+	uint8_t *data;
+	uint32_t count;
+
+	if (strncmp(location, SERVER_HOST "/", sizeof(SERVER_HOST)))
+	{
+		snprintf(path, path_size, "%s", location);
+		return NULL;
+	}
+	snprintf(path, path_size, "%.*s", (int)strcspn(location + sizeof(SERVER_HOST) - 1, "?#"), location + sizeof(SERVER_HOST) - 1);
+	count = server_count(path);
+	for (; count; count--)
+	{
+		snprintf(file, sizeof(file), "%s%s.%u", server.root, path, (unsigned int)count);
+		data = host_test_load(file, size);
+		if (data)
+		{
+			return data;
+		}
+	}
+	snprintf(file, sizeof(file), "%s%s", server.root, path);
+	return host_test_load(file, size);
+}
+
+//--------------------------------------------
+static size_t client_read_size(client_t *client, size_t left)
+{
+	size_t len = left < client->max_read ? left : client->max_read;
+
+	return client->seed ? host_test_split(&client->seed, len, client->max_read) : len;
+}
+
+//--------------------------------------------
+// the body collected as webradio_recv collects a playlist
+static void client_playlist(client_t *client, const char *location, const uint8_t *data, size_t size)
+{
+	size_t offset;
+	size_t len;
+
+	playlist_open();
+	hls_begin(location);
+	for (offset = 0; offset < size; offset += len)
+	{
+		len = client_read_size(client, size - offset);
+		memcpy(client->recv_buf, data + offset, len);
+		playlist_append(client->recv_buf, len);
+		hls_append(client->recv_buf, len);
+	}
+}
+
+//--------------------------------------------
+// feed_segment: the audio of every read out of ts_demux
+static void client_segment(client_t *client, const uint8_t *data, size_t size, host_trace_t *trace)
+{
+	const uint8_t *audio;
+	size_t audio_size;
+	size_t audio_len = 0;
+	uint32_t audio_hash = 2166136261U;
+	size_t offset;
+	size_t buf_cnt;
+	size_t len;
+
+	ts_demux_init(&client->ts_demux);
+	for (offset = 0; offset < size; offset += len)
+	{
+		len = client_read_size(client, size - offset);
+		memcpy(client->recv_buf, data + offset, len);
+		for (buf_cnt = 0; buf_cnt < len; )
+		{
+			buf_cnt += ts_demux_next(&client->ts_demux, client->recv_buf + buf_cnt, len - buf_cnt, &audio, &audio_size);
+			audio_hash = host_test_hash(audio_hash, audio, audio_size);
+			audio_len += audio_size;
+		}
+	}
+	host_trace_printf(trace, "%s, audio %u %08X\n", client->ts_demux.mode == ts_demux_ts ? "ts" :
+		client->ts_demux.mode == ts_demux_raw ? "raw" : "empty", (unsigned int)audio_len, (unsigned int)audio_hash);
+}
+
+//--------------------------------------------
+// load_hls_location: the next segment or the media playlist once more,
+// returns what hls_next does
+static int client_next(char *location, size_t size, int res, host_trace_t *trace)
+{
+	if (res >= 0)
+	{
+		res = hls_next(location, size);
+	}
+	if (res < 0)
+	{
+		host_trace_printf(trace, "end\n");
+		hls_close();
+		return -1;
+	}
+	if (res > 0 && hls_get_wait_ms())
+	{
+		host_trace_printf(trace, "wait %u ms\n", (unsigned int)hls_get_wait_ms());
+	}
+	return res;
+}
+
+//--------------------------------------------
+// plays the station from its index.m3u8 until the stream is over
+static void run_station(const char *name, uint32_t seed, size_t max_read, host_trace_t *trace)
+{
+	static client_t client;
+	char location[HLS_LOCATION_SIZE];
+	char path[HLS_LOCATION_SIZE];
+	uint8_t *data;
+	size_t size;
+	uint32_t request;
+	int next = 1;
+	int res;
+
+	client.seed = seed;
+	client.max_read = max_read;
+	server.path_count = 0;
+	snprintf(location, sizeof(location), SERVER_HOST "/%s/index.m3u8", name);
+	playlist_set_origin(location);
+	hls_close();
+	for (request = 0; request < REQUEST_MAX; request++)
+	{
+		data = server_get(location, path, sizeof(path), &size);
+		host_trace_printf(trace, "get %s: ", path);
+		if (!data)
+		{
+			host_trace_printf(trace, "not found\n");
+			// a segment is skipped, a media playlist ends the stream
+			if (!hls_is_open() || hls_is_refresh() || client_next(location, sizeof(location), 0, trace) < 0)
+			{
+				return;
+			}
+			continue;
+		}
+		if (hls_is_open() && !next)
+		{
+			client_segment(&client, data, size, trace);
+			next = client_next(location, sizeof(location), 0, trace);
+		}
+		else if (hls_is_open())
+		{
+			// the refreshed media playlist
+			client_playlist(&client, location, data, size);
+			res = hls_update();
+			host_trace_printf(trace, "refresh, %d queued\n", res);
+			next = client_next(location, sizeof(location), res, trace);
+		}
+		else
+		{
+			client_playlist(&client, location, data, size);
+			res = playlist_parse(location);
+			if (res == PLAYLIST_HLS)
+			{
+				hls_open();
+				res = hls_update();
+				host_trace_printf(trace, "media playlist, %d queued\n", res);
+				next = res < 0 ? -1 : client_next(location, sizeof(location), 0, trace);
+			}
+			else
+			{
+				host_trace_printf(trace, "playlist, %d entries\n", res);
+				next = res < 0 ? -1 : playlist_next(location, sizeof(location));
+			}
+		}
+		free(data);
+		if (next < 0)
+		{
+			return;
+		}
+	}
+	host_trace_printf(trace, "left after %u requests\n", (unsigned int)request);
+}
+
+//--------------------------------------------
+// the trace of every split must be the one of the whole reads
+static int check_station(const char *dir)
+{
+	host_trace_t expected;
+	host_trace_t trace;
+	char root[1024];
+	char what[1100];
+	const char *name;
+	uint32_t split;
+	int res;
+
+	// the server serves the directory above the station
+	name = strrchr(dir, '/');
+	name = name ? name + 1 : dir;
+	snprintf(root, sizeof(root), "%.*s", (int)(name - dir), dir);
+	server.root = root;
+	host_trace_init(&expected);
+	run_station(name, 0, RECV_BUFFER_SIZE, &expected);
+	res = host_trace_check(&expected, dir, options.update);
+	for (split = 0; !res && split <= options.splits; split++)
+	{
+		host_trace_init(&trace);
+		// byte by byte, then reads that split every packet, then at random
+		run_station(name, split > 1 ? options.seed + split : 0,
+			split > 1 ? RECV_BUFFER_SIZE : split ? PACKET_SPLIT_READ : 1, &trace);
+		snprintf(what, sizeof(what), "%s, split %u", dir, (unsigned int)split);
+		res = host_trace_compare(&trace, &expected, what);
+		host_trace_free(&trace);
+	}
+	printf("%s: %s\n", dir, res ? "FAILED" : "ok");
+	host_trace_free(&expected);
+	return res;
+}
+
+//--------------------------------------------
+static void usage(const char *name)
+{
+	printf("usage: %s [-i splits] [-s seed] [-u] station_dir ...\n", name);
+	printf("  -i  random splits of every station (%u)\n", (unsigned int)options.splits);
+	printf("  -s  seed of the splits (%u)\n", (unsigned int)options.seed);
+	printf("  -u  write the .expect files from the whole reads\n");
+}
+
+//--------------------------------------------
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:s:u")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			options.splits = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			options.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			options.update = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	for (; optind < argc; optind++)
+	{
+		failed |= check_station(argv[optind]);
+	}
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,493 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdio.h>      /* printf, snprintf */
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, strtoul */
+#include <string.h>     /* memcpy, memcmp, memset */
+#include <stdbool.h>    /* bool */
+#include <unistd.h>     /* getopt */
+#include "http_header.h"
+#include "http_chunked.h"
+#include "host_test.h"
+
+//--------------------------------------------
+// Recorded chunked responses in fixtures/chunked go through http_header
+// and http_chunked the way the network task takes them, in the reads
+// of the firmware, byte by byte and split at random; every way gives
+// the trace in the .expect file of the response.
+// Generated bodies are chunked at random, with extensions, leading
+// zeros, trailers and bare LFs, and split so that reads end inside
+// the chunk size lines and the CRLFs; the output must be the body.
+
+//--------------------------------------------
+// Same as the network task of webradio.c
+#define RECV_BUFFER_SIZE           1024
+
+//--------------------------------------------
+#define FUZZ_BODY_MAX              20000
+#define FUZZ_STREAM_MAX            (FUZZ_BODY_MAX * 8 + 1024)
+#define TEXT_MAX                   1024     // longer bodies are traced by hash
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t splits;
+	uint32_t streams;
+	uint32_t seed;
+	bool update;
+} options_t;
+static options_t options =
+{
+	.splits = 200,
+	.streams = 20000,
+	.seed = 1
+};
+
+//--------------------------------------------
+typedef enum
+{
+	receiver_header = 0,
+	receiver_body,
+	receiver_done,
+	receiver_error
+} receiver_state_t;
+
+//--------------------------------------------
+typedef struct
+{
+	http_header_t header;
+	http_chunked_t chunked;
+	uint8_t recv_buf[RECV_BUFFER_SIZE];
+	receiver_state_t state;
+	uint8_t *body;
+	size_t body_len;
+	size_t body_size;
+} receiver_t;
+
+//--------------------------------------------
+static void receiver_init(receiver_t *rx, uint8_t *body, size_t body_size)
+{
+	http_header_init(&rx->header);
+	http_chunked_init(&rx->chunked);
+	rx->state = receiver_header;
+	rx->body = body;
+	rx->body_len = 0;
+	rx->body_size = body_size;
+}
+
+//--------------------------------------------
+// one read: the chunks are decoded in place in the receive buffer
+static void receiver_read(receiver_t *rx, const uint8_t *data, size_t size, host_trace_t *trace)
+{
+	uint8_t *pdata = rx->recv_buf;
+	int res;
+
+	memcpy(pdata, data, size);
+	if (rx->state == receiver_header)
+	{
+		res = http_header_parse(&rx->header, pdata, size);
+		if (res <= 0)
+		{
+			rx->state = res ? receiver_error : receiver_header;
+			return;
+		}
+		host_trace_printf(trace, "header %u chunked %d\n", (unsigned int)rx->header.status, (int)rx->header.chunked);
+		if (http_header_is_redirect(&rx->header))
+		{
+			host_trace_printf(trace, "redirect %s\n", rx->header.location_cut ? "cut" : rx->header.location);
+		}
+		rx->state = receiver_body;
+		pdata += res;
+		size -= (size_t)res;
+	}
+	if (rx->state != receiver_body)
+	{
+		return;
+	}
+	res = rx->header.chunked ? http_chunked_decode(&rx->chunked, pdata, size) : (int)size;
+	if (res < 0 || (size_t)res > size || rx->body_len + (size_t)res > rx->body_size)
+	{
+		rx->state = receiver_error;
+		return;
+	}
+	memcpy(rx->body + rx->body_len, pdata, (size_t)res);
+	rx->body_len += (size_t)res;
+	if (rx->header.chunked && http_chunked_is_done(&rx->chunked))
+	{
+		rx->state = receiver_done;
+	}
+}
+
+//--------------------------------------------
+// reads of max_read bytes, or split at random unless seed is 0
+static void run_response(receiver_t *rx, const uint8_t *data, size_t size, uint32_t seed, size_t max_read, host_trace_t *trace)
+{
+	size_t offset = 0;
+	size_t len;
+
+	while (offset < size && (rx->state == receiver_header || rx->state == receiver_body))
+	{
+		len = size - offset < max_read ? size - offset : max_read;
+		if (seed)
+		{
+			len = host_test_split(&seed, len, max_read);
+		}
+		receiver_read(rx, data + offset, len, trace);
+		offset += len;
+	}
+}
+
+//--------------------------------------------
+// a short playlist or page, shown in the trace as it is
+static bool is_text(const uint8_t *data, size_t size)
+{
+	size_t cnt;
+
+	if (size > TEXT_MAX)
+	{
+		return false;
+	}
+	for (cnt = 0; cnt < size; cnt++)
+	{
+		if ((data[cnt] < 0x20 || data[cnt] > 0x7E) && data[cnt] != '\t' && data[cnt] != '\r' && data[cnt] != '\n')
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+//--------------------------------------------
+// the body delivered up to an error depends on the reads, it is left out
+static void trace_response(const uint8_t *data, size_t size, uint32_t seed, size_t max_read, host_trace_t *trace)
+{
+	static uint8_t body[FUZZ_STREAM_MAX];
+	static receiver_t rx;
+
+	receiver_init(&rx, body, sizeof(body));
+	run_response(&rx, data, size, seed, max_read, trace);
+	if (rx.state == receiver_error)
+	{
+		host_trace_printf(trace, "error\n");
+		return;
+	}
+	host_trace_printf(trace, "%s, body %u %08X\n", rx.state == receiver_done ? "done" : "closed",
+		(unsigned int)rx.body_len, (unsigned int)host_test_hash(2166136261U, rx.body, rx.body_len));
+	if (is_text(rx.body, rx.body_len))
+	{
+		host_trace_text(trace, rx.body, rx.body_len);
+	}
+}
+
+//--------------------------------------------
+// the trace of every split must be the one of the whole reads
+static int check_fixture(const char *path)
+{
+	host_trace_t expected;
+	host_trace_t trace;
+	char what[1024];
+	uint8_t *data;
+	size_t size;
+	uint32_t split;
+	int res;
+
+	data = host_test_load(path, &size);
+	if (!data)
+	{
+		printf("%s: can not read\n", path);
+		return -1;
+	}
+	host_trace_init(&expected);
+	trace_response(data, size, 0, RECV_BUFFER_SIZE, &expected);
+	res = host_trace_check(&expected, path, options.update);
+	for (split = 0; !res && split <= options.splits; split++)
+	{
+		host_trace_init(&trace);
+		// split 0 is byte by byte
+		trace_response(data, size, split ? options.seed + split : 0, split ? RECV_BUFFER_SIZE : 1, &trace);
+		snprintf(what, sizeof(what), "%s, split %u", path, (unsigned int)split);
+		res = host_trace_compare(&trace, &expected, what);
+		host_trace_free(&trace);
+	}
+	printf("%s: %u bytes, %s\n", path, (unsigned int)size, res ? "FAILED" : "ok");
+	host_trace_free(&expected);
+	free(data);
+	return res;
+}
+
+//--------------------------------------------
+// what each byte of a generated response is
+typedef enum
+{
+	fuzz_header = 0,
+	fuzz_size_line,
+	fuzz_data,
+	fuzz_data_end,
+	fuzz_trailer
+} fuzz_byte_t;
+
+//--------------------------------------------
+typedef struct
+{
+	uint8_t body[FUZZ_BODY_MAX];
+	size_t body_len;
+	uint8_t data[FUZZ_STREAM_MAX];
+	uint8_t kind[FUZZ_STREAM_MAX];
+	size_t length;
+	size_t end;                // of the last chunk and the trailer
+	size_t bad_chunk;          // body offset of the chunk with a broken size
+	bool bad;                  // there is one
+	uint32_t seed;
+	uint32_t size_line_cuts;
+	uint32_t data_end_cuts;
+} fuzz_t;
+static fuzz_t fuzz;
+
+//--------------------------------------------
+static void fuzz_put(fuzz_t *f, const void *data, size_t size, fuzz_byte_t kind)
+{
+	memcpy(f->data + f->length, data, size);
+	memset(f->kind + f->length, kind, size);
+	f->length += size;
+}
+
+//--------------------------------------------
+static uint32_t fuzz_rand(fuzz_t *f, uint32_t range)
+{
+	return host_test_rand(&f->seed) % range;
+}
+
+//--------------------------------------------
+// mostly CRLF, now and then a bare LF
+static void fuzz_line_end(fuzz_t *f, fuzz_byte_t kind)
+{
+	if (fuzz_rand(f, 8))
+	{
+		fuzz_put(f, "\r\n", 2, kind);
+	}
+	else
+	{
+		fuzz_put(f, "\n", 1, kind);
+	}
+}
+
+//--------------------------------------------
+// hex in either case, leading zeros, an extension now and then
+static void fuzz_put_size_line(fuzz_t *f, size_t size)
+{
+	static const char *const ext[] = { ";name=value", ";a=1;b=\"x y\"", " ", "\t;ext", ";" };
+	char line[64];
+	int digits;
+	int len;
+
+	digits = snprintf(line, sizeof(line), fuzz_rand(f, 2) ? "%0*x" : "%0*X", (int)fuzz_rand(f, 4) + 1, (unsigned int)size);
+	len = digits;
+	if (!fuzz_rand(f, 4))
+	{
+		len += snprintf(line + len, sizeof(line) - len, "%s", ext[fuzz_rand(f, sizeof(ext) / sizeof(ext[0]))]);
+	}
+	if (!f->bad && !fuzz_rand(f, 256))
+	{
+		// a digit that makes the size line garbage
+		line[fuzz_rand(f, (uint32_t)digits)] = 'g';
+		f->bad = true;
+	}
+	fuzz_put(f, line, (size_t)len, fuzz_size_line);
+	fuzz_line_end(f, fuzz_size_line);
+}
+
+//--------------------------------------------
+static size_t fuzz_chunk_size(fuzz_t *f, size_t left)
+{
+	size_t size;
+
+	switch (fuzz_rand(f, 4))
+	{
+	case 0:
+		size = 1;
+		break;
+	case 1:
+		size = 1 + fuzz_rand(f, 16);
+		break;
+	case 2:
+		size = 1 + fuzz_rand(f, 512);
+		break;
+	default:
+		size = 1 + fuzz_rand(f, 5000);
+		break;
+	}
+	return size < left ? size : left;
+}
+
+//--------------------------------------------
+// a random body chunked at random, the last chunk, maybe trailer fields,
+// maybe bytes after the end that are no longer body
+static void fuzz_response(fuzz_t *f)
+{
+	static const char header[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+	static const char trailer[] = "X-Trailer: value";
+	size_t offset;
+	size_t size;
+	uint32_t cnt;
+
+	f->length = 0;
+	f->bad = false;
+	f->body_len = fuzz_rand(f, FUZZ_BODY_MAX + 1);
+	for (offset = 0; offset < f->body_len; offset++)
+	{
+		f->body[offset] = (uint8_t)host_test_rand(&f->seed);
+	}
+	fuzz_put(f, header, sizeof(header) - 1, fuzz_header);
+	for (offset = 0; offset < f->body_len; offset += size)
+	{
+		size = fuzz_chunk_size(f, f->body_len - offset);
+		f->bad_chunk = f->bad ? f->bad_chunk : offset;
+		fuzz_put_size_line(f, size);
+		fuzz_put(f, f->body + offset, size, fuzz_data);
+		fuzz_line_end(f, fuzz_data_end);
+	}
+	f->bad_chunk = f->bad ? f->bad_chunk : f->body_len;
+	fuzz_put_size_line(f, 0);
+	for (cnt = fuzz_rand(f, 4) ? 0 : fuzz_rand(f, 3) + 1; cnt; cnt--)
+	{
+		fuzz_put(f, trailer, sizeof(trailer) - 1, fuzz_trailer);
+		fuzz_line_end(f, fuzz_trailer);
+	}
+	fuzz_line_end(f, fuzz_trailer);
+	f->end = f->length;
+	if (!fuzz_rand(f, 4))
+	{
+		fuzz_put(f, header, sizeof(header) - 1, fuzz_header);
+	}
+}
+
+//--------------------------------------------
+// counts the reads that end inside a size line or a CRLF after data
+static void fuzz_count_cuts(fuzz_t *f, uint32_t seed)
+{
+	size_t offset = 0;
+
+	for (;;)
+	{
+		offset += host_test_split(&seed, f->length - offset, RECV_BUFFER_SIZE);
+		if (offset >= f->end)
+		{
+			return;
+		}
+		if (f->kind[offset - 1] == f->kind[offset])
+		{
+			f->size_line_cuts += f->kind[offset] == fuzz_size_line;
+			f->data_end_cuts += f->kind[offset] == fuzz_data_end;
+		}
+	}
+}
+
+//--------------------------------------------
+static int fuzz_run(void)
+{
+	static uint8_t body[FUZZ_STREAM_MAX];
+	static receiver_t rx;
+	host_trace_t trace;
+	uint32_t num;
+	uint32_t seed;
+	uint32_t bad = 0;
+	bool ok = true;
+
+	fuzz.seed = options.seed;
+	for (num = 0; ok && num < options.streams; num++)
+	{
+		fuzz_response(&fuzz);
+		seed = host_test_rand(&fuzz.seed);
+		fuzz_count_cuts(&fuzz, seed);
+		receiver_init(&rx, body, sizeof(body));
+		host_trace_init(&trace);
+		run_response(&rx, fuzz.data, fuzz.length, seed, RECV_BUFFER_SIZE, &trace);
+		host_trace_free(&trace);
+		if (fuzz.bad)
+		{
+			// what came before the broken chunk and nothing after it
+			bad++;
+			ok = rx.state == receiver_error && rx.body_len <= fuzz.bad_chunk &&
+				!memcmp(rx.body, fuzz.body, rx.body_len);
+		}
+		else
+		{
+			ok = rx.state == receiver_done && rx.body_len == fuzz.body_len &&
+				!memcmp(rx.body, fuzz.body, rx.body_len);
+		}
+		if (!ok)
+		{
+			printf("stream %u of seed %u: state %d, body %u of %u bytes%s\n", (unsigned int)num,
+				(unsigned int)options.seed, (int)rx.state, (unsigned int)rx.body_len,
+				(unsigned int)fuzz.body_len, fuzz.bad ? ", broken size line" : "");
+		}
+	}
+	// the splits have to cut the framing, or they test nothing
+	if (ok && options.streams && (!fuzz.size_line_cuts || !fuzz.data_end_cuts))
+	{
+		printf("no read ended inside a size line or a CRLF\n");
+		ok = false;
+	}
+	printf("fuzz: %u streams, %u broken, reads cut %u size lines and %u CRLFs, %s\n",
+		(unsigned int)num, (unsigned int)bad, (unsigned int)fuzz.size_line_cuts,
+		(unsigned int)fuzz.data_end_cuts, ok ? "ok" : "FAILED");
+	return ok ? 0 : -1;
+}
+
+//--------------------------------------------
+static void usage(const char *name)
+{
+	printf("usage: %s [-i splits] [-f streams] [-s seed] [-u] response.http ...\n", name);
+	printf("  -i  random splits of every recorded response (%u)\n", (unsigned int)options.splits);
+	printf("  -f  generated responses (%u)\n", (unsigned int)options.streams);
+	printf("  -s  seed of the splits and the generated responses (%u)\n", (unsigned int)options.seed);
+	printf("  -u  write the .expect files from the whole reads\n");
+}
+
+//--------------------------------------------
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:f:s:u")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			options.splits = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			options.streams = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			options.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			options.update = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	for (; optind < argc; optind++)
+	{
+		failed |= check_fixture(argv[optind]);
+	}
+	failed |= fuzz_run();
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
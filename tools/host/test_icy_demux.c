@@ -0,0 +1,411 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdio.h>      /* printf, snprintf */
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, strtoul */
+#include <string.h>     /* memcpy, memmove */
+#include <stdbool.h>    /* bool */
+#include <unistd.h>     /* getopt */
+#include "http_header.h"
+#include "icy_demux.h"
+#include "host_test.h"
+
+//--------------------------------------------
+// Recorded responses of ICY servers in fixtures/icy go through
+// http_header and icy_demux the way webradio_recv_cb takes them,
+// in the reads of the firmware, byte by byte and split at random;
+// every way gives the trace in the .expect file of the stream.
+// Generated streams with random metaint, length bytes and cuts
+// are checked against the trace the generator knows.
+
+//--------------------------------------------
+// Same as the network task of webradio.c
+#define RECV_BUFFER_SIZE           1024
+#define ICY_BUFFER_SIZE            1024
+
+//--------------------------------------------
+#define FUZZ_AUDIO_MAX             20000
+
+//--------------------------------------------
+typedef struct
+{
+	uint32_t splits;
+	uint32_t streams;
+	uint32_t seed;
+	bool update;
+} options_t;
+static options_t options =
+{
+	.splits = 200,
+	.streams = 2000,
+	.seed = 1
+};
+
+//--------------------------------------------
+typedef struct
+{
+	http_header_t header;
+	icy_demux_t demux;
+	uint8_t meta_buf[ICY_BUFFER_SIZE];
+	uint8_t recv_buf[RECV_BUFFER_SIZE];
+	bool body;
+	uint64_t audio_len;
+	uint32_t audio_hash;
+} receiver_t;
+
+//--------------------------------------------
+static void receiver_init(receiver_t *rx)
+{
+	http_header_init(&rx->header);
+	rx->body = false;
+	rx->audio_len = 0;
+	rx->audio_hash = 2166136261U;
+}
+
+//--------------------------------------------
+// webradio_recv_cb: audio moved in place to the front of pdata
+static size_t receiver_body(receiver_t *rx, uint8_t *pdata, size_t len, host_trace_t *trace)
+{
+	icy_span_t span;
+	size_t buf_cnt = 0;
+	size_t out_cnt = 0;
+	size_t res;
+
+	while (buf_cnt < len)
+	{
+		res = icy_demux_next(&rx->demux, pdata + buf_cnt, len - buf_cnt, &span);
+		if (!res || res > len - buf_cnt ||
+			(span.type == icy_span_audio && (span.data != pdata + buf_cnt || span.size != res)) ||
+			(span.type == icy_span_meta && (span.data != rx->meta_buf || span.size > ICY_BUFFER_SIZE)) ||
+			(span.type == icy_span_none && (span.data || span.size)))
+		{
+			host_trace_printf(trace, "bad span %d of %u bytes for %u of %u bytes\n",
+				(int)span.type, (unsigned int)span.size, (unsigned int)res, (unsigned int)(len - buf_cnt));
+			return out_cnt;
+		}
+		buf_cnt += res;
+		if (span.type == icy_span_meta)
+		{
+			host_trace_printf(trace, "meta @%llu %u ", (unsigned long long)(rx->audio_len + out_cnt), (unsigned int)span.size);
+			host_trace_text(trace, span.data, span.size);
+		}
+		if (span.type != icy_span_audio)
+		{
+			continue;
+		}
+		if (span.data != pdata + out_cnt)
+		{
+			memmove(pdata + out_cnt, span.data, span.size);
+		}
+		out_cnt += span.size;
+	}
+	return out_cnt;
+}
+
+//--------------------------------------------
+static void receiver_read(receiver_t *rx, const uint8_t *data, size_t size, host_trace_t *trace)
+{
+	uint8_t *pdata = rx->recv_buf;
+	size_t len;
+	int res;
+
+	memcpy(pdata, data, size);
+	if (!rx->body)
+	{
+		res = http_header_parse(&rx->header, pdata, size);
+		if (res < 0)
+		{
+			host_trace_printf(trace, "bad header\n");
+			rx->body = true;
+			return;
+		}
+		if (!res)
+		{
+			return;
+		}
+		host_trace_printf(trace, "header %u metaint %u br %u\n", (unsigned int)rx->header.status,
+			(unsigned int)rx->header.icy_metaint, (unsigned int)rx->header.icy_br);
+		icy_demux_init(&rx->demux, rx->header.icy_metaint, rx->meta_buf, sizeof(rx->meta_buf));
+		rx->body = true;
+		pdata += res;
+		size -= (size_t)res;
+	}
+	len = receiver_body(rx, pdata, size, trace);
+	rx->audio_hash = host_test_hash(rx->audio_hash, pdata, len);
+	rx->audio_len += len;
+}
+
+//--------------------------------------------
+// reads of max_read bytes, or split at random unless seed is 0
+static void run_stream(const uint8_t *data, size_t size, uint32_t seed, size_t max_read, host_trace_t *trace)
+{
+	static receiver_t rx;
+	size_t offset = 0;
+	size_t len;
+
+	receiver_init(&rx);
+	while (offset < size)
+	{
+		len = size - offset < max_read ? size - offset : max_read;
+		if (seed)
+		{
+			len = host_test_split(&seed, len, max_read);
+		}
+		receiver_read(&rx, data + offset, len, trace);
+		offset += len;
+	}
+	host_trace_printf(trace, "audio %llu %08X\n", (unsigned long long)rx.audio_len, (unsigned int)rx.audio_hash);
+}
+
+//--------------------------------------------
+// the trace of every split must be the one of the whole reads
+static int check_splits(const uint8_t *data, size_t size, const host_trace_t *expected, const char *name)
+{
+	host_trace_t trace;
+	char what[1024];
+	uint32_t split;
+	int res = 0;
+
+	for (split = 0; !res && split <= options.splits; split++)
+	{
+		host_trace_init(&trace);
+		// split 0 is byte by byte
+		run_stream(data, size, split ? options.seed + split : 0, split ? RECV_BUFFER_SIZE : 1, &trace);
+		snprintf(what, sizeof(what), "%s, split %u", name, (unsigned int)split);
+		res = host_trace_compare(&trace, expected, what);
+		host_trace_free(&trace);
+	}
+	return res;
+}
+
+//--------------------------------------------
+static int check_fixture(const char *path)
+{
+	host_trace_t expected;
+	uint8_t *data;
+	size_t size;
+	int res;
+
+	data = host_test_load(path, &size);
+	if (!data)
+	{
+		printf("%s: can not read\n", path);
+		return -1;
+	}
+	host_trace_init(&expected);
+	run_stream(data, size, 0, RECV_BUFFER_SIZE, &expected);
+	res = host_trace_check(&expected, path, options.update);
+	if (!res)
+	{
+		res = check_splits(data, size, &expected, path);
+	}
+	printf("%s: %u bytes, %s\n", path, (unsigned int)size, res ? "FAILED" : "ok");
+	host_trace_free(&expected);
+	free(data);
+	return res;
+}
+
+//--------------------------------------------
+typedef struct
+{
+	uint8_t *data;
+	size_t length;
+	size_t size;
+	uint32_t seed;
+	uint64_t audio_len;
+	uint32_t audio_hash;
+} fuzz_t;
+
+//--------------------------------------------
+// false once the stream is cut
+static bool fuzz_put(fuzz_t *fuzz, uint8_t byte)
+{
+	if (fuzz->length == fuzz->size)
+	{
+		return false;
+	}
+	fuzz->data[fuzz->length++] = byte;
+	return true;
+}
+
+//--------------------------------------------
+static uint32_t fuzz_metaint(fuzz_t *fuzz)
+{
+	switch (host_test_rand(&fuzz->seed) % 6)
+	{
+	case 0:
+		return 0;
+	case 1:
+		return 1;
+	case 2:
+		return 16;
+	case 3:
+		return 1 + host_test_rand(&fuzz->seed) % 64;
+	case 4:
+		return 1 + host_test_rand(&fuzz->seed) % 2048;
+	default:
+		return 8192;
+	}
+}
+
+//--------------------------------------------
+// mostly no metadata, some short titles, now and then a block
+// up to the longest one, longer than the metadata buffer
+static uint32_t fuzz_meta_blocks(fuzz_t *fuzz)
+{
+	switch (host_test_rand(&fuzz->seed) % 4)
+	{
+	case 0:
+		return 0;
+	case 1:
+		return 1 + host_test_rand(&fuzz->seed) % 4;
+	case 2:
+		return 1 + host_test_rand(&fuzz->seed) % 64;
+	default:
+		return host_test_rand(&fuzz->seed) % 256;
+	}
+}
+
+//--------------------------------------------
+// a response of random metaint, audio and metadata, cut anywhere;
+// expected gets what the receiver has to make of it
+static void fuzz_stream(fuzz_t *fuzz, host_trace_t *expected)
+{
+	uint8_t meta[255 * 16];
+	uint32_t metaint = fuzz_metaint(fuzz);
+	uint32_t blocks;
+	size_t audio_left;
+	size_t cnt;
+	size_t len;
+
+	fuzz->length = 0;
+	fuzz->size = host_test_rand(&fuzz->seed) % (FUZZ_AUDIO_MAX + 1);
+	fuzz->size += (size_t)snprintf((char *)fuzz->data, 64, metaint ? "ICY 200 OK\r\nicy-metaint:%u\r\n\r\n" : "ICY 200 OK\r\n\r\n", (unsigned int)metaint);
+	fuzz->length = strlen((char *)fuzz->data);
+	fuzz->audio_len = 0;
+	fuzz->audio_hash = 2166136261U;
+	host_trace_printf(expected, "header 200 metaint %u br 0\n", (unsigned int)metaint);
+	for (;;)
+	{
+		audio_left = metaint ? metaint : fuzz->size;
+		for (; audio_left; audio_left--)
+		{
+			if (!fuzz_put(fuzz, (uint8_t)host_test_rand(&fuzz->seed)))
+			{
+				break;
+			}
+			fuzz->audio_hash = host_test_hash(fuzz->audio_hash, &fuzz->data[fuzz->length - 1], 1);
+			fuzz->audio_len++;
+		}
+		blocks = fuzz_meta_blocks(fuzz);
+		if (audio_left || !fuzz_put(fuzz, (uint8_t)blocks))
+		{
+			break;
+		}
+		len = blocks * 16;
+		for (cnt = 0; cnt < len; cnt++)
+		{
+			meta[cnt] = (uint8_t)host_test_rand(&fuzz->seed);
+			if (!fuzz_put(fuzz, meta[cnt]))
+			{
+				break;
+			}
+		}
+		if (cnt < len)
+		{
+			break;
+		}
+		if (len)
+		{
+			// the demuxer keeps the head of a longer block
+			len = len < ICY_BUFFER_SIZE ? len : ICY_BUFFER_SIZE;
+			host_trace_printf(expected, "meta @%llu %u ", (unsigned long long)fuzz->audio_len, (unsigned int)len);
+			host_trace_text(expected, meta, len);
+		}
+	}
+	host_trace_printf(expected, "audio %llu %08X\n", (unsigned long long)fuzz->audio_len, (unsigned int)fuzz->audio_hash);
+}
+
+//--------------------------------------------
+static int fuzz(void)
+{
+	static uint8_t data[FUZZ_AUDIO_MAX + 64];
+	fuzz_t fuzz = { .data = data, .seed = options.seed };
+	host_trace_t expected;
+	host_trace_t trace;
+	char what[64];
+	uint32_t num;
+	int res = 0;
+
+	for (num = 0; !res && num < options.streams; num++)
+	{
+		host_trace_init(&expected);
+		fuzz_stream(&fuzz, &expected);
+		host_trace_init(&trace);
+		run_stream(fuzz.data, fuzz.length, host_test_rand(&fuzz.seed), RECV_BUFFER_SIZE, &trace);
+		snprintf(what, sizeof(what), "stream %u of seed %u", (unsigned int)num, (unsigned int)options.seed);
+		res = host_trace_compare(&trace, &expected, what);
+		host_trace_free(&trace);
+		host_trace_free(&expected);
+	}
+	printf("fuzz: %u streams, %s\n", (unsigned int)num, res ? "FAILED" : "ok");
+	return res;
+}
+
+//--------------------------------------------
+static void usage(const char *name)
+{
+	printf("usage: %s [-i splits] [-f streams] [-s seed] [-u] stream.icy ...\n", name);
+	printf("  -i  random splits of every recorded stream (%u)\n", (unsigned int)options.splits);
+	printf("  -f  generated streams (%u)\n", (unsigned int)options.streams);
+	printf("  -s  seed of the splits and the generated streams (%u)\n", (unsigned int)options.seed);
+	printf("  -u  write the .expect files from the whole reads\n");
+}
+
+//--------------------------------------------
+int main(int argc, char *argv[])
+{
+	int failed = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:f:s:u")) != -1)
+	{
+		switch (opt)
+		{
+		case 'i':
+			options.splits = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			options.streams = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			options.seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'u':
+			options.update = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+	for (; optind < argc; optind++)
+	{
+		failed |= check_fixture(argv[optind]);
+	}
+	failed |= fuzz();
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed ? 1 : 0;
+}
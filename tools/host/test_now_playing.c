@@ -0,0 +1,177 @@
+/*
+* Copyright (c) 2023, 2024 Vladimir Alemasov
+* All rights reserved
+*
+* This program and the accompanying materials are distributed under
+* the terms of GNU General Public License version 2
+* as published by the Free Software Foundation.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*/
+
+#include <stdio.h>      /* printf, snprintf, sscanf */
+#include <stdint.h>     /* uint8_t ... uint64_t */
+#include <stdlib.h>     /* size_t, rand_r */
+#include <string.h>     /* memcpy, strcmp */
+#include <stdbool.h>    /* bool */
+#include <time.h>       /* nanosleep */
+#include <pthread.h>    /* pthread_create */
+#include <sched.h>      /* sched_yield */
+#include "now_playing.h"
+
+//--------------------------------------------
+// The network task publishes titles as fast as it can while readers
+// check every copy: the title, the url and seq come from one update.
+// now_playing.c is built with memcpy renamed to test_memcpy, which
+// gives up the CPU at a random point of every copy so the writer and
+// the readers interleave inside them even on a single core.
+
+//--------------------------------------------
+#define READERS                    3
+#define RUN_MS                     1000
+
+//--------------------------------------------
+typedef struct
+{
+	volatile bool running;
+	uint32_t updates;
+	uint32_t reads[READERS];
+	uint32_t torn[READERS];
+} test_t;
+static test_t test;
+
+//--------------------------------------------
+// the title repeats the number of the update up to a length that
+// changes with every update, the url is the number
+static void make_title(uint32_t num, char *title, size_t size)
+{
+	size_t len = 0;
+	size_t max = 20 + num % 100;
+
+	title[0] = '\0';
+	while (len + 12 < max && len < size)
+	{
+		len += snprintf(title + len, size - len, "%u-", (unsigned int)num);
+	}
+}
+
+//--------------------------------------------
+static size_t make_meta(uint32_t num, char *meta, size_t size)
+{
+	char title[NOW_PLAYING_TITLE_SIZE];
+
+	make_title(num, title, sizeof(title));
+	return snprintf(meta, size, "StreamTitle='%s';StreamUrl='%u';", title, (unsigned int)num);
+}
+
+//--------------------------------------------
+void *test_memcpy(void *dest, const void *src, size_t size)
+{
+	static __thread unsigned int seed = 1;
+	size_t part = rand_r(&seed) % (size + 1);
+
+	memcpy(dest, src, part);
+	sched_yield();
+	memcpy((uint8_t *)dest + part, (const uint8_t *)src + part, size - part);
+	return dest;
+}
+
+//--------------------------------------------
+static bool consistent(const now_playing_t *now)
+{
+	char title[NOW_PLAYING_TITLE_SIZE];
+	unsigned int num;
+
+	if (!now->seq)
+	{
+		return !now->title[0] && !now->url[0];
+	}
+	if (sscanf(now->url, "%u", &num) != 1)
+	{
+		return false;
+	}
+	make_title(num, title, sizeof(title));
+	// every update changes the title, so seq counts them
+	return !strcmp(title, now->title) && now->seq == num + 1;
+}
+
+//--------------------------------------------
+static void *writer_thread(void *param)
+{
+	char meta[512];
+	size_t size;
+	unsigned int seed = 1;
+
+	(void)param;
+	while (test.running)
+	{
+		size = make_meta(test.updates, meta, sizeof(meta));
+		now_playing_update((const uint8_t *)meta, size);
+		test.updates++;
+		// a copy that overlaps an update is retried, leave the readers
+		// a chance to finish one now and then
+		if (!(rand_r(&seed) % 4))
+		{
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+//--------------------------------------------
+static void *reader_thread(void *param)
+{
+	int num = (int)(intptr_t)param;
+	now_playing_t now;
+
+	while (test.running)
+	{
+		now_playing_get(&now);
+		test.reads[num]++;
+		if (!consistent(&now))
+		{
+			test.torn[num]++;
+		}
+	}
+	return NULL;
+}
+
+//--------------------------------------------
+int main(void)
+{
+	pthread_t writer;
+	pthread_t readers[READERS];
+	struct timespec ts = { RUN_MS / 1000, RUN_MS % 1000 * 1000000 };
+	uint32_t reads = 0;
+	uint32_t torn = 0;
+	int cnt;
+
+	test.running = true;
+	pthread_create(&writer, NULL, writer_thread, NULL);
+	for (cnt = 0; cnt < READERS; cnt++)
+	{
+		pthread_create(&readers[cnt], NULL, reader_thread, (void *)(intptr_t)cnt);
+	}
+	nanosleep(&ts, NULL);
+	test.running = false;
+	pthread_join(writer, NULL);
+	for (cnt = 0; cnt < READERS; cnt++)
+	{
+		pthread_join(readers[cnt], NULL);
+		reads += test.reads[cnt];
+		torn += test.torn[cnt];
+	}
+	printf("now_playing: %u updates, %u reads, %u torn\n",
+		(unsigned int)test.updates, (unsigned int)reads, (unsigned int)torn);
+	// a reader that never gets a copy through tests nothing
+	if (reads < test.updates / 100)
+	{
+		printf("readers starved\n");
+		torn++;
+	}
+	printf("%s\n", torn ? "FAILED" : "ok");
+	return torn ? 1 : 0;
+}